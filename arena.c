@@ -0,0 +1,118 @@
+/*
+ * Copyright (C) Matthew Earl
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+/* Per-frame memory arena. */
+#include <stdio.h>
+#include <stdlib.h>
+#include "arena.h"
+
+#define ARENA_ALIGN		16
+#define ARENA_BLOCK_SIZE	(64*1024)
+
+/* The block header is padded so that the memory after it is aligned. */
+#define BLOCK_HEADER	((sizeof(arenablock_t)+ARENA_ALIGN-1)&~(size_t)(ARENA_ALIGN-1))
+
+static arenablock_t *
+newblock ( size_t size )
+{
+	arenablock_t *b;
+
+	if(size < ARENA_BLOCK_SIZE)
+		size = ARENA_BLOCK_SIZE;
+	b = (arenablock_t*)malloc(BLOCK_HEADER+size);
+	if(!b)
+	{
+		fprintf(stderr,"Out of memory for a %lu byte arena block\n",
+				(unsigned long)size);
+		exit(1);
+	}
+	b->next = NULL;
+	b->size = size;
+	b->used = 0;
+	return b;
+}
+
+static void
+freeblocks ( arenablock_t *b )
+{
+	arenablock_t *next;
+
+	for(;b;b=next)
+	{
+		next = b->next;
+		free(b);
+	}
+}
+
+void
+initarena ( arena_t *a )
+{
+	a->blocks = NULL;
+	a->used = 0;
+	a->peak = 0;
+}
+
+void *
+arenaalloc ( arena_t *a, size_t size )
+{
+	arenablock_t *b=a->blocks;
+	void *p;
+
+	size = (size+ARENA_ALIGN-1)&~(size_t)(ARENA_ALIGN-1);
+	if(!b || b->used+size > b->size)
+	{
+		/* Grow geometrically so a frame needs few blocks the first time. */
+		b = newblock(b && 2*b->size > size ? 2*b->size : size);
+		b->next = a->blocks;
+		a->blocks = b;
+	}
+	p = (char*)b + BLOCK_HEADER + b->used;
+	b->used += size;
+	a->used += size;
+	return p;
+}
+
+/* resetarena
+ *
+ * Give back everything allocated since the last reset. If the frame
+ * needed more than one block they are replaced by one big enough for the
+ * largest frame so far.
+ */
+void
+resetarena ( arena_t *a )
+{
+	if(a->used > a->peak)
+		a->peak = a->used;
+	a->used = 0;
+	if(!a->blocks)
+		return;
+	if(a->blocks->next)
+	{
+		freeblocks(a->blocks);
+		a->blocks = newblock(a->peak);
+		return;
+	}
+	a->blocks->used = 0;
+}
+
+void
+freearena ( arena_t *a )
+{
+	freeblocks(a->blocks);
+	initarena(a);
+}
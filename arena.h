@@ -0,0 +1,47 @@
+/*
+ * Copyright (C) Matthew Earl
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+#ifndef _ARENA_H_
+#define _ARENA_H_
+
+#include <stddef.h>
+
+/* Memory for things that only last a frame. Allocations are carved out
+ * of large blocks and all given back at once by resetarena. Once the
+ * arena has grown to hold a whole frame it keeps a single block of that
+ * size, so allocating from it never reaches the heap.
+ */
+typedef struct arenablock_s
+{
+	struct arenablock_s *next;
+	size_t size,used;
+} arenablock_t;
+
+typedef struct arena_s
+{
+	arenablock_t *blocks;	/* newest first */
+	size_t used;		/* bytes handed out since the last reset */
+	size_t peak;		/* most handed out between two resets */
+} arena_t;
+
+void initarena ( arena_t *a );
+void *arenaalloc ( arena_t *a, size_t size );
+void resetarena ( arena_t *a );
+void freearena ( arena_t *a );
+
+#endif
@@ -0,0 +1,281 @@
+/*
+ * Copyright (C) Matthew Earl
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+/* Renderer benchmark. Each level is rendered headless along a camera path
+ * derived only from the level geometry, so runs are repeatable and can be
+ * compared between builds.
+ */
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "raycaster.h"
+#include "threads.h"
+
+#define DEFAULT_BENCH_FRAMES	300
+#define WARMUP_FRAMES		10
+#define BENCH_TURNS		2.0f	/* full turns of the view over the path */
+#define BENCH_BOB		16.0f	/* eye level variation, units */
+#define SPRITE_TEXTURE		"monster_stand.tga"
+
+typedef struct waypoint_s
+{
+	vector2d_t pos;
+	platform_t *platform;
+} waypoint_t;
+
+typedef struct benchresult_s
+{
+	int frames;
+	double mean,p50,p99,max;	/* ms */
+	double mpixels;			/* Mpixels/s */
+	double mbytes;			/* MB/s of frame written */
+} benchresult_t;
+
+platform_t *
+findplatform ( raycaster_t *r, vector2d_t *v )
+{
+	int i;
+
+	for(i=0;i<r->level.numplatforms;i++)
+	{
+		if(isinplatform(r,&r->level.platforms[i],v))
+			return &r->level.platforms[i];
+	}
+	return NULL;
+}
+
+/* Pick one waypoint per platform that the camera fits in, at the average
+ * of the platform's vertices. Both ends of every edge are counted, as the
+ * first ends alone can all lie on one side of a small platform.
+ */
+int
+findwaypoints ( raycaster_t *r, waypoint_t *wp )
+{
+	int i,j,n=0;
+	platform_t *p;
+	vector2d_t centre;
+
+	for(i=0;i<r->level.numplatforms;i++)
+	{
+		p = &r->level.platforms[i];
+		if(p->ceilheight - p->floorheight <= VIEW_HEIGHT + BENCH_BOB)
+			continue;
+
+		vectorzero(&centre);
+		for(j=0;j<p->numedges;j++)
+		{
+			vectoradd(&centre,&p->edges[j]->verts[0]->pos,&centre);
+			vectoradd(&centre,&p->edges[j]->verts[1]->pos,&centre);
+		}
+		vectorscale(&centre,0.5f/p->numedges,&centre);
+		if(findplatform(r,&centre) != p)
+			continue;
+
+		vectorcopy(&wp[n].pos,&centre);
+		wp[n].platform = p;
+		n++;
+	}
+	return n;
+}
+
+/* Put a sprite at every waypoint apart from the two the camera is between. */
+void
+addbenchsprites ( raycaster_t *r, waypoint_t *wp, int numwaypoints, int current,
+		texture_t *t )
+{
+	vector2d_t verts[2],side;
+	int i;
+
+	if(!t)
+		return;
+	for(i=0;i<numwaypoints;i++)
+	{
+		if(i == current || i == (current+1)%numwaypoints)
+			continue;
+		vectorrot90(&r->viewdir,&side);
+		vectorscale(&side,t->width/2,&side);
+		vectorsubtract(&wp[i].pos,&side,&verts[0]);
+		vectoradd(&wp[i].pos,&side,&verts[1]);
+		addsprite(r,wp[i].platform,verts,t->height,wp[i].platform->floorheight,
+				SURFACE_NONE,t);
+	}
+}
+
+/* Place the camera for frame f of n. The path visits each waypoint in turn,
+ * turning and bobbing as it goes.
+ */
+int
+setcamera ( raycaster_t *r, waypoint_t *wp, int numwaypoints, int f, int n )
+{
+	float t,angle;
+	int k;
+	platform_t *p;
+	vector2d_t pos;
+
+	t = (float)f*numwaypoints/n;
+	k = (int)t;
+	t -= k;
+	vectormidpoint(&wp[k].pos,&wp[(k+1)%numwaypoints].pos,t,&pos);
+
+	/* Stay at the waypoint if the straight line leaves somewhere the camera
+	 * does not fit.
+	 */
+	p = findplatform(r,&pos);
+	if(!p || p->ceilheight - p->floorheight <= VIEW_HEIGHT + BENCH_BOB)
+	{
+		vectorcopy(&pos,&wp[k].pos);
+		p = wp[k].platform;
+	}
+
+	angle = 2.0f*M_PI*BENCH_TURNS*f/n;
+	angletovector(angle,&r->viewdir);
+	vectorcopy(&r->viewpos,&pos);
+	r->currentplatform = p;
+	r->eyelevel = p->floorheight + VIEW_HEIGHT + BENCH_BOB*sinf(4.0f*angle);
+	return k;
+}
+
+static int
+comparetimes ( const void *a, const void *b )
+{
+	double x=*(double*)a,y=*(double*)b;
+	return x < y ? -1 : (x > y);
+}
+
+int
+benchlevel ( options_t *o, char *level, benchresult_t *res )
+{
+	raycaster_t r;
+	waypoint_t *wp;
+	texture_t *spritetexture;
+	double *times,total=0.0;
+	long long start;
+	int i,k,n,numwaypoints;
+
+	o->level = level;
+	if(!initraycaster(&r,o))
+		return 0;
+
+	wp = (waypoint_t*)malloc(sizeof(waypoint_t)*r.level.numplatforms);
+	numwaypoints = findwaypoints(&r,wp);
+	if(!numwaypoints)
+	{
+		fprintf(stderr,"%s: nowhere to put the camera\n",level);
+		free(wp);
+		cleanup(&r);
+		return 0;
+	}
+	spritetexture = texturefrompath(&r,SPRITE_TEXTURE);
+
+	n = o->numframes;
+	times = (double*)malloc(sizeof(double)*n);
+	for(i=-WARMUP_FRAMES;i<n;i++)
+	{
+		k = setcamera(&r,wp,numwaypoints,i < 0 ? 0 : i,n);
+		addbenchsprites(&r,wp,numwaypoints,k,spritetexture);
+
+		if(i == 0)
+			resetcounters(&r);	/* leave out the warm-up frames */
+
+		start = nanotime();
+		drawscene(&r);
+		if(i >= 0)
+		{
+			times[i] = 1.0e-6*(nanotime()-start);
+			total += times[i];
+		}
+		clearsprites(&r);
+	}
+	if(o->dumpfile)
+		dumpframe(&r,o->dumpfile);
+	reportthreads(&r);
+	reportcounters(&r,n);
+
+	qsort(times,n,sizeof(double),comparetimes);
+	res->frames = n;
+	res->mean = total/n;
+	res->p50 = times[n/2];
+	res->p99 = times[(int)(0.99*(n-1))];
+	res->max = times[n-1];
+	res->mpixels = (double)r.screen->w*r.screen->h*n/(1000.0*total);
+	res->mbytes = res->mpixels*r.screen->format->BytesPerPixel;
+
+	free(times);
+	free(wp);
+	cleanup(&r);
+	return 1;
+}
+
+void
+printresult ( char *name, benchresult_t *res )
+{
+	printf("%-24s %6i %8.3f %8.3f %8.3f %8.3f %9.1f %9.1f\n", name, res->frames,
+		res->mean, res->p50, res->p99, res->max, res->mpixels, res->mbytes);
+}
+
+int
+main ( int argc, char **argv )
+{
+	options_t o;
+	char **levels;
+	int i,numlevels=0;
+	benchresult_t *results;
+
+	defaultoptions(&o);
+	o.numframes = DEFAULT_BENCH_FRAMES;
+
+	levels = (char**)malloc(sizeof(char*)*argc);
+	for(i=1;i<argc;i++)
+	{
+		if(parseoption(&o,argc,argv,&i))
+			continue;
+		if(argv[i][0] == '-')
+		{
+			fprintf(stderr,"Unknown option %s\n", argv[i]);
+			fprintf(stderr,"Usage: %s " OPTIONS_USAGE " level...\n", argv[0]);
+			return 1;
+		}
+		levels[numlevels++] = argv[i];
+	}
+	if(!numlevels)
+	{
+		fprintf(stderr,"Usage: %s " OPTIONS_USAGE " level...\n", argv[0]);
+		return 1;
+	}
+	/* The benchmark never opens a window. */
+	o.headless = 1;
+	if(o.numframes <= 0)
+		o.numframes = DEFAULT_BENCH_FRAMES;
+
+	results = (benchresult_t*)malloc(sizeof(benchresult_t)*numlevels);
+	for(i=0;i<numlevels;i++)
+	{
+		if(!benchlevel(&o,levels[i],&results[i]))
+			return 1;
+	}
+
+	printf("\n%-24s %6s %8s %8s %8s %8s %9s %9s\n", "level", "frames",
+		"mean ms", "p50 ms", "p99 ms", "max ms", "Mpixel/s", "MB/s");
+	for(i=0;i<numlevels;i++)
+		printresult(levels[i],&results[i]);
+
+	free(results);
+	free(levels);
+	return 0;
+}
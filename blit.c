@@ -0,0 +1,244 @@
+/*
+ * Copyright (C) Matthew Earl
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+/* Copying between frame buffer layouts and sizes. */
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "blit.h"
+
+#define BLOCK_SIZE	8	/* pixels each side of a transposed block */
+#define TILE_ROWS	32	/* rows of a column read before moving across */
+
+static inline void
+transposeblock16 ( unsigned short *dst, int dstpitch,
+		const unsigned short *src, int srcpitch )
+{
+#ifdef __SSE2__
+	__m128i a0,a1,a2,a3,a4,a5,a6,a7;
+	__m128i b0,b1,b2,b3,b4,b5,b6,b7;
+
+	/* Eight columns of eight rows each. */
+	a0 = _mm_loadu_si128((const __m128i*)(src));
+	a1 = _mm_loadu_si128((const __m128i*)(src+srcpitch));
+	a2 = _mm_loadu_si128((const __m128i*)(src+2*srcpitch));
+	a3 = _mm_loadu_si128((const __m128i*)(src+3*srcpitch));
+	a4 = _mm_loadu_si128((const __m128i*)(src+4*srcpitch));
+	a5 = _mm_loadu_si128((const __m128i*)(src+5*srcpitch));
+	a6 = _mm_loadu_si128((const __m128i*)(src+6*srcpitch));
+	a7 = _mm_loadu_si128((const __m128i*)(src+7*srcpitch));
+
+	/* Interleave pairs of columns, then pairs of pairs, then halves. */
+	b0 = _mm_unpacklo_epi16(a0,a1);
+	b1 = _mm_unpackhi_epi16(a0,a1);
+	b2 = _mm_unpacklo_epi16(a2,a3);
+	b3 = _mm_unpackhi_epi16(a2,a3);
+	b4 = _mm_unpacklo_epi16(a4,a5);
+	b5 = _mm_unpackhi_epi16(a4,a5);
+	b6 = _mm_unpacklo_epi16(a6,a7);
+	b7 = _mm_unpackhi_epi16(a6,a7);
+
+	a0 = _mm_unpacklo_epi32(b0,b2);
+	a1 = _mm_unpackhi_epi32(b0,b2);
+	a2 = _mm_unpacklo_epi32(b1,b3);
+	a3 = _mm_unpackhi_epi32(b1,b3);
+	a4 = _mm_unpacklo_epi32(b4,b6);
+	a5 = _mm_unpackhi_epi32(b4,b6);
+	a6 = _mm_unpacklo_epi32(b5,b7);
+	a7 = _mm_unpackhi_epi32(b5,b7);
+
+	_mm_storeu_si128((__m128i*)(dst),_mm_unpacklo_epi64(a0,a4));
+	_mm_storeu_si128((__m128i*)(dst+dstpitch),_mm_unpackhi_epi64(a0,a4));
+	_mm_storeu_si128((__m128i*)(dst+2*dstpitch),_mm_unpacklo_epi64(a1,a5));
+	_mm_storeu_si128((__m128i*)(dst+3*dstpitch),_mm_unpackhi_epi64(a1,a5));
+	_mm_storeu_si128((__m128i*)(dst+4*dstpitch),_mm_unpacklo_epi64(a2,a6));
+	_mm_storeu_si128((__m128i*)(dst+5*dstpitch),_mm_unpackhi_epi64(a2,a6));
+	_mm_storeu_si128((__m128i*)(dst+6*dstpitch),_mm_unpacklo_epi64(a3,a7));
+	_mm_storeu_si128((__m128i*)(dst+7*dstpitch),_mm_unpackhi_epi64(a3,a7));
+#else
+	int x,y;
+
+	for(x=0;x<BLOCK_SIZE;x++)
+		for(y=0;y<BLOCK_SIZE;y++)
+			dst[y*dstpitch+x] = src[x*srcpitch+y];
+#endif
+}
+
+#ifdef __SSE2__
+static inline void
+transposequad32 ( unsigned int *dst, int dstpitch,
+		const unsigned int *src, int srcpitch )
+{
+	__m128i a0,a1,a2,a3,b0,b1,b2,b3;
+
+	a0 = _mm_loadu_si128((const __m128i*)(src));
+	a1 = _mm_loadu_si128((const __m128i*)(src+srcpitch));
+	a2 = _mm_loadu_si128((const __m128i*)(src+2*srcpitch));
+	a3 = _mm_loadu_si128((const __m128i*)(src+3*srcpitch));
+
+	b0 = _mm_unpacklo_epi32(a0,a1);
+	b1 = _mm_unpackhi_epi32(a0,a1);
+	b2 = _mm_unpacklo_epi32(a2,a3);
+	b3 = _mm_unpackhi_epi32(a2,a3);
+
+	_mm_storeu_si128((__m128i*)(dst),_mm_unpacklo_epi64(b0,b2));
+	_mm_storeu_si128((__m128i*)(dst+dstpitch),_mm_unpackhi_epi64(b0,b2));
+	_mm_storeu_si128((__m128i*)(dst+2*dstpitch),_mm_unpacklo_epi64(b1,b3));
+	_mm_storeu_si128((__m128i*)(dst+3*dstpitch),_mm_unpackhi_epi64(b1,b3));
+}
+#endif
+
+/* A 32-bit block is four 4x4 transposes, each quarter going to the
+ * opposite corner.
+ */
+static inline void
+transposeblock32 ( unsigned int *dst, int dstpitch,
+		const unsigned int *src, int srcpitch )
+{
+#ifdef __SSE2__
+	transposequad32(dst,dstpitch,src,srcpitch);
+	transposequad32(dst+4,dstpitch,src+4*srcpitch,srcpitch);
+	transposequad32(dst+4*dstpitch,dstpitch,src+4,srcpitch);
+	transposequad32(dst+4*dstpitch+4,dstpitch,src+4*srcpitch+4,srcpitch);
+#else
+	int x,y;
+
+	for(x=0;x<BLOCK_SIZE;x++)
+		for(y=0;y<BLOCK_SIZE;y++)
+			dst[y*dstpitch+x] = src[x*srcpitch+y];
+#endif
+}
+
+/* The frame is copied in tiles TILE_ROWS high, so that each cache line
+ * read from a column is used up before moving on to the next columns.
+ * Within a tile the copy is done in 8x8 blocks, with any ragged edges
+ * done a pixel at a time.
+ */
+void
+transposecolumns16 ( unsigned short *dst, int dstpitch,
+		const unsigned short *src, int srcpitch, int width, int y1, int y2 )
+{
+	int i,x,y,tile,tileend,blockwidth;
+
+	blockwidth = width - width%BLOCK_SIZE;
+	for(tile=y1;tile<y2;tile=tileend)
+	{
+		tileend = tile+TILE_ROWS;
+		if(tileend > y2)
+			tileend = y2;
+
+		for(x=0;x<blockwidth;x+=BLOCK_SIZE)
+		{
+			for(y=tile;y+BLOCK_SIZE<=tileend;y+=BLOCK_SIZE)
+				transposeblock16(dst+y*dstpitch+x,dstpitch,
+						src+x*srcpitch+y,srcpitch);
+			for(;y<tileend;y++)
+				for(i=x;i<x+BLOCK_SIZE;i++)
+					dst[y*dstpitch+i] = src[i*srcpitch+y];
+		}
+		for(y=tile;y<tileend;y++)
+			for(x=blockwidth;x<width;x++)
+				dst[y*dstpitch+x] = src[x*srcpitch+y];
+	}
+}
+
+/* scalerows16
+ *
+ * Nearest neighbour scaling. Neighbouring rows of dst mostly come from
+ * the same row of src, so each src row is scaled once and then copied.
+ */
+void
+scalerows16 ( unsigned short *dst, int dstpitch, int dstwidth, int dstheight,
+		const unsigned short *src, int srcpitch, int srcwidth, int srcheight,
+		int y1, int y2 )
+{
+	const unsigned short *row,*lastrow=NULL;
+	unsigned short *d;
+	unsigned int u,du;
+	int x,y;
+
+	du = ((unsigned int)srcwidth<<16)/dstwidth;
+	for(y=y1;y<y2;y++)
+	{
+		d = dst + y*dstpitch;
+		row = src + (y*srcheight/dstheight)*srcpitch;
+		if(row == lastrow)
+		{
+			memcpy(d,d-dstpitch,sizeof(unsigned short)*dstwidth);
+			continue;
+		}
+		lastrow = row;
+		for(x=0,u=du>>1;x<dstwidth;x++,u+=du)
+			d[x] = row[u>>16];
+	}
+}
+
+void
+transposecolumns32 ( unsigned int *dst, int dstpitch,
+		const unsigned int *src, int srcpitch, int width, int y1, int y2 )
+{
+	int i,x,y,tile,tileend,blockwidth;
+
+	blockwidth = width - width%BLOCK_SIZE;
+	for(tile=y1;tile<y2;tile=tileend)
+	{
+		tileend = tile+TILE_ROWS;
+		if(tileend > y2)
+			tileend = y2;
+
+		for(x=0;x<blockwidth;x+=BLOCK_SIZE)
+		{
+			for(y=tile;y+BLOCK_SIZE<=tileend;y+=BLOCK_SIZE)
+				transposeblock32(dst+y*dstpitch+x,dstpitch,
+						src+x*srcpitch+y,srcpitch);
+			for(;y<tileend;y++)
+				for(i=x;i<x+BLOCK_SIZE;i++)
+					dst[y*dstpitch+i] = src[i*srcpitch+y];
+		}
+		for(y=tile;y<tileend;y++)
+			for(x=blockwidth;x<width;x++)
+				dst[y*dstpitch+x] = src[x*srcpitch+y];
+	}
+}
+
+void
+scalerows32 ( unsigned int *dst, int dstpitch, int dstwidth, int dstheight,
+		const unsigned int *src, int srcpitch, int srcwidth, int srcheight,
+		int y1, int y2 )
+{
+	const unsigned int *row,*lastrow=NULL;
+	unsigned int *d;
+	unsigned int u,du;
+	int x,y;
+
+	du = ((unsigned int)srcwidth<<16)/dstwidth;
+	for(y=y1;y<y2;y++)
+	{
+		d = dst + y*dstpitch;
+		row = src + (y*srcheight/dstheight)*srcpitch;
+		if(row == lastrow)
+		{
+			memcpy(d,d-dstpitch,sizeof(unsigned int)*dstwidth);
+			continue;
+		}
+		lastrow = row;
+		for(x=0,u=du>>1;x<dstwidth;x++,u+=du)
+			d[x] = row[u>>16];
+	}
+}
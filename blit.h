@@ -0,0 +1,41 @@
+/*
+ * Copyright (C) Matthew Earl
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+#ifndef _BLIT_H_
+#define _BLIT_H_
+
+/* Copy rows y1..y2-1 of a width wide frame held a column at a time in src
+ * (column x starting at src+x*srcpitch) to the row-major dst (row y
+ * starting at dst+y*dstpitch). Pitches are in pixels.
+ */
+void transposecolumns16 ( unsigned short *dst, int dstpitch,
+		const unsigned short *src, int srcpitch, int width, int y1, int y2 );
+void transposecolumns32 ( unsigned int *dst, int dstpitch,
+		const unsigned int *src, int srcpitch, int width, int y1, int y2 );
+
+/* Fill rows y1..y2-1 of the dstwidth by dstheight row-major frame dst
+ * from the smaller row-major frame src, stretched to fit.
+ */
+void scalerows16 ( unsigned short *dst, int dstpitch, int dstwidth, int dstheight,
+		const unsigned short *src, int srcpitch, int srcwidth, int srcheight,
+		int y1, int y2 );
+void scalerows32 ( unsigned int *dst, int dstpitch, int dstwidth, int dstheight,
+		const unsigned int *src, int srcpitch, int srcwidth, int srcheight,
+		int y1, int y2 );
+
+#endif
@@ -0,0 +1,913 @@
+/*
+ * Copyright (C) Matthew Earl
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+/* Splitting platforms into convex pieces, for lvlc.
+ *
+ * edgeintersect tests every edge of the platform a ray is in, and the
+ * column cache can only guess a column's next edge in a convex platform,
+ * so large concave platforms are slow to cross. Each one is cut into
+ * convex pieces joined by new edges. The pieces keep the platform's
+ * heights, so the joins are never drawn or bumped into: rays, movement
+ * and line of sight pass straight through them as through any edge
+ * between platforms of the same height.
+ *
+ * A platform's holes are first joined to its outline by bridges, making
+ * one polygon. That is cut into triangles by clipping ears, and
+ * neighbouring triangles are merged again for as long as the result stays
+ * convex (Hertel and Mehlhorn), which leaves at most four times the
+ * fewest possible pieces. Platforms whose outline is not simple are left
+ * whole.
+ */
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "convex.h"
+
+#define MAX_SPLIT_POINTS	4096	/* larger platforms are left whole */
+#define OUTSIDE			-1	/* the platform outside the level */
+#define UNSET			-2
+
+typedef struct intlist_s
+{
+	int *items;
+	int count,allocated;
+} intlist_t;
+
+/* The level being split. Platforms and edges can be added. */
+typedef struct worklevel_s
+{
+	levelimage_t *in;
+	int numedges,allocatededges;
+	lvledge_t *edges;
+	int numplatforms,allocatedplatforms;
+	lvlplatform_t *platforms;	/* heights only */
+	intlist_t *platformedges;
+	intlist_t *vertedges;
+	int *firstout;		/* per vertex, for tracing outlines; -1 between uses */
+} worklevel_t;
+
+/* A platform's edge, directed so that the platform is on its left. */
+typedef struct halfedge_s
+{
+	int from,to;
+	int edge;
+} halfedge_t;
+
+/* The polygon being split. Point i is at level vertex verts[i], and
+ * edges[i] is the level edge from it to point i+1, or -1 for a bridge.
+ */
+typedef struct polygon_s
+{
+	intlist_t verts;
+	intlist_t edges;
+} polygon_t;
+
+typedef struct diagonal_s
+{
+	long long key;
+	int from,to,triangle;
+} diagonal_t;
+
+static void
+append ( intlist_t *l, int item )
+{
+	if(l->count == l->allocated)
+	{
+		l->allocated = l->allocated ? 2*l->allocated : 8;
+		l->items = (int*)realloc(l->items,sizeof(int)*l->allocated);
+	}
+	l->items[l->count++] = item;
+}
+
+static void
+freelist ( intlist_t *l )
+{
+	free(l->items);
+	l->items = NULL;
+	l->count = l->allocated = 0;
+}
+
+static lvlvert_t *
+vertpos ( worklevel_t *w, int v )
+{
+	return &w->in->verts[v];
+}
+
+/* Twice the signed area of abc; positive if it turns left at b. */
+static double
+turn ( lvlvert_t *a, lvlvert_t *b, lvlvert_t *c )
+{
+	return ((double)b->x-a->x)*((double)c->y-b->y) -
+		((double)b->y-a->y)*((double)c->x-b->x);
+}
+
+static int
+samepos ( lvlvert_t *a, lvlvert_t *b )
+{
+	return a->x == b->x && a->y == b->y;
+}
+
+/* Whether p is inside or on the triangle abc, which turns left. */
+static int
+intriangle ( lvlvert_t *a, lvlvert_t *b, lvlvert_t *c, lvlvert_t *p )
+{
+	return turn(a,b,p) >= 0.0 && turn(b,c,p) >= 0.0 && turn(c,a,p) >= 0.0;
+}
+
+/* Whether p is strictly inside the corner abc, which turns left. */
+static int
+incorner ( lvlvert_t *a, lvlvert_t *b, lvlvert_t *c, lvlvert_t *p )
+{
+	return turn(a,b,p) > 0.0 && turn(b,c,p) > 0.0;
+}
+
+static int
+addedge ( worklevel_t *w, int v0, int v1 )
+{
+	if(w->numedges == w->allocatededges)
+	{
+		w->allocatededges *= 2;
+		w->edges = (lvledge_t*)realloc(w->edges,sizeof(lvledge_t)*w->allocatededges);
+	}
+	w->edges[w->numedges].verts[0] = v0;
+	w->edges[w->numedges].verts[1] = v1;
+	w->edges[w->numedges].leftplat = UNSET;
+	w->edges[w->numedges].rightplat = UNSET;
+	return w->numedges++;
+}
+
+static int
+addplatform ( worklevel_t *w, lvlplatform_t *like )
+{
+	if(w->numplatforms == w->allocatedplatforms)
+	{
+		w->allocatedplatforms *= 2;
+		w->platforms = (lvlplatform_t*)realloc(w->platforms,
+				sizeof(lvlplatform_t)*w->allocatedplatforms);
+		w->platformedges = (intlist_t*)realloc(w->platformedges,
+				sizeof(intlist_t)*w->allocatedplatforms);
+	}
+	w->platforms[w->numplatforms] = *like;
+	memset(&w->platformedges[w->numplatforms],0,sizeof(intlist_t));
+	return w->numplatforms++;
+}
+
+/* Whether optimiseplatform would move p's floor or ceiling. Its pieces
+ * would not all get the same answer, so such platforms are left whole.
+ */
+static int
+wouldoptimise ( worklevel_t *w, int p )
+{
+	lvlplatform_t *pl=&w->platforms[p],*n;
+	lvledge_t *e;
+	int i,other,changefloor=1,changeceil=1;
+
+	for(i=0;i<w->platformedges[p].count;i++)
+	{
+		e = &w->edges[w->platformedges[p].items[i]];
+		other = e->leftplat != p ? e->leftplat : e->rightplat;
+		n = other == OUTSIDE ? &w->in->platforms[w->in->header->numplatforms] :
+				&w->platforms[other];
+		if(pl->floorheight <= n->ceilheight)
+			changefloor = 0;
+		if(pl->ceilheight >= n->floorheight)
+			changeceil = 0;
+	}
+	return changefloor || changeceil;
+}
+
+/* traceoutline
+ *
+ * Direct p's edges with p on their left and chain them into loops, each
+ * given by its first entry in order and its length. Fails if a vertex
+ * has two of them leaving it, or an edge has p on both sides.
+ */
+static int
+traceoutline ( worklevel_t *w, int p, halfedge_t *half, intlist_t *order,
+		intlist_t *loops )
+{
+	intlist_t *edges=&w->platformedges[p];
+	lvledge_t *e;
+	char *visited;
+	int i,j,k,start,ok=1;
+
+	for(i=0;i<edges->count;i++)
+	{
+		e = &w->edges[edges->items[i]];
+		if(e->leftplat == e->rightplat)
+			return 0;
+		half[i].edge = edges->items[i];
+		half[i].from = e->rightplat == p ? e->verts[0] : e->verts[1];
+		half[i].to = e->rightplat == p ? e->verts[1] : e->verts[0];
+	}
+	for(i=0;i<edges->count && ok;i++)
+	{
+		if(w->firstout[half[i].from] >= 0)
+			ok = 0;
+		w->firstout[half[i].from] = i;
+	}
+
+	visited = (char*)calloc(edges->count,1);
+	for(i=0;i<edges->count && ok;i++)
+	{
+		if(visited[i])
+			continue;
+		start = order->count;
+		j = i;
+		do
+		{
+			visited[j] = 1;
+			append(order,j);
+			k = w->firstout[half[j].to];
+			if(k < 0 || (visited[k] && k != i))
+			{
+				ok = 0;
+				break;
+			}
+			j = k;
+		} while(j != i);
+		append(loops,start);
+		append(loops,order->count-start);
+	}
+	free(visited);
+
+	for(i=0;i<edges->count;i++)
+		w->firstout[half[i].from] = -1;
+	return ok;
+}
+
+static double
+looparea ( worklevel_t *w, halfedge_t *half, int *loop, int n )
+{
+	lvlvert_t *a,*b;
+	double area=0.0;
+	int i;
+
+	for(i=0;i<n;i++)
+	{
+		a = vertpos(w,half[loop[i]].from);
+		b = vertpos(w,half[loop[i]].to);
+		area += (double)a->x*b->y - (double)b->x*a->y;
+	}
+	return area/2.0;
+}
+
+static float
+loopmaxx ( worklevel_t *w, halfedge_t *half, int *loop, int n )
+{
+	float x=vertpos(w,half[loop[0]].from)->x;
+	int i;
+
+	for(i=1;i<n;i++)
+		if(vertpos(w,half[loop[i]].from)->x > x)
+			x = vertpos(w,half[loop[i]].from)->x;
+	return x;
+}
+
+static int
+loopconvex ( worklevel_t *w, halfedge_t *half, int *loop, int n )
+{
+	int i;
+
+	for(i=0;i<n;i++)
+		if(turn(vertpos(w,half[loop[i]].from),vertpos(w,half[loop[i]].to),
+				vertpos(w,half[loop[(i+1)%n]].to)) < 0.0)
+			return 0;
+	return 1;
+}
+
+static lvlvert_t *
+pointpos ( worklevel_t *w, polygon_t *poly, int i )
+{
+	return vertpos(w,poly->verts.items[(i+poly->verts.count)%poly->verts.count]);
+}
+
+/* Whether p is inside the polygon's corner at point i. */
+static int
+inwedge ( worklevel_t *w, polygon_t *poly, int i, lvlvert_t *p )
+{
+	lvlvert_t *a=pointpos(w,poly,i-1),*b=pointpos(w,poly,i),*c=pointpos(w,poly,i+1);
+
+	if(turn(a,b,c) > 0.0)
+		return turn(a,b,p) > 0.0 && turn(b,c,p) > 0.0;
+	return turn(a,b,p) > 0.0 || turn(b,c,p) > 0.0;
+}
+
+/* bridgehole
+ *
+ * Join a hole to the polygon by a bridge from the hole's rightmost point
+ * to a point of the polygon it can see, found by casting a ray to the
+ * right and then looking for reflex points nearer the ray.
+ */
+static int
+bridgehole ( worklevel_t *w, polygon_t *poly, halfedge_t *half, int *loop, int n )
+{
+	lvlvert_t *m,*a,*b,*c,hit,*best;
+	polygon_t joined;
+	double x,bestx=0.0,dx,dy,cosine,bestcosine=-2.0,bestdist=0.0;
+	int i,k,mi=0,seg=-1,to;
+
+	for(i=1;i<n;i++)
+		if(vertpos(w,half[loop[i]].from)->x > vertpos(w,half[loop[mi]].from)->x)
+			mi = i;
+	m = vertpos(w,half[loop[mi]].from);
+
+	for(i=0;i<poly->verts.count;i++)
+	{
+		a = pointpos(w,poly,i);
+		b = pointpos(w,poly,i+1);
+		if((a->y > m->y) == (b->y > m->y))
+			continue;
+		x = a->x + ((double)m->y-a->y)*((double)b->x-a->x)/((double)b->y-a->y);
+		if(x >= m->x && (seg < 0 || x < bestx))
+		{
+			bestx = x;
+			seg = i;
+		}
+	}
+	if(seg < 0)
+		return 0;
+	a = pointpos(w,poly,seg);
+	b = pointpos(w,poly,seg+1);
+	to = a->x > b->x ? seg : (seg+1)%poly->verts.count;
+
+	/* Anything reflex in the triangle between m, the hit and the chosen
+	 * end could hide that end; the one nearest the ray's direction cannot.
+	 */
+	hit.x = (float)bestx;
+	hit.y = m->y;
+	best = pointpos(w,poly,to);
+	if(!samepos(&hit,best))
+	{
+		for(i=0;i<poly->verts.count;i++)
+		{
+			c = pointpos(w,poly,i);
+			if(i == to || samepos(c,m) ||
+					turn(pointpos(w,poly,i-1),c,pointpos(w,poly,i+1)) > 0.0)
+				continue;
+			if(!(turn(m,&hit,best) >= 0.0 ? intriangle(m,&hit,best,c) :
+					intriangle(m,best,&hit,c)))
+				continue;
+			dx = (double)c->x-m->x;
+			dy = (double)c->y-m->y;
+			cosine = dx/sqrt(dx*dx+dy*dy);
+			if(cosine > bestcosine || (cosine == bestcosine && dx*dx+dy*dy < bestdist))
+			{
+				bestcosine = cosine;
+				bestdist = dx*dx+dy*dy;
+				to = i;
+			}
+		}
+	}
+
+	/* Earlier bridges may have left several points at the chosen place;
+	 * the bridge must leave from the one whose corner faces m.
+	 */
+	best = pointpos(w,poly,to);
+	for(i=0;i<poly->verts.count;i++)
+		if(samepos(pointpos(w,poly,i),best) && inwedge(w,poly,i,m))
+		{
+			to = i;
+			break;
+		}
+
+	memset(&joined,0,sizeof(joined));
+	for(i=0;i<=to;i++)
+	{
+		append(&joined.verts,poly->verts.items[i]);
+		append(&joined.edges,i == to ? -1 : poly->edges.items[i]);
+	}
+	for(k=0;k<n;k++)
+	{
+		append(&joined.verts,half[loop[(mi+k)%n]].from);
+		append(&joined.edges,half[loop[(mi+k)%n]].edge);
+	}
+	append(&joined.verts,half[loop[mi]].from);
+	append(&joined.edges,-1);
+	for(i=to;i<poly->verts.count;i++)
+	{
+		append(&joined.verts,poly->verts.items[i]);
+		append(&joined.edges,poly->edges.items[i]);
+	}
+	freelist(&poly->verts);
+	freelist(&poly->edges);
+	*poly = joined;
+	return 1;
+}
+
+/* earclip
+ *
+ * Cut the polygon into triangles, three points each, all turning left.
+ */
+static int
+earclip ( worklevel_t *w, polygon_t *poly, intlist_t *triangles )
+{
+	lvlvert_t *a,*b,*c,*p;
+	int *prev,*next,n=poly->verts.count,left=n,i,j,tries=0,ear,ok=1;
+
+	prev = (int*)malloc(sizeof(int)*n);
+	next = (int*)malloc(sizeof(int)*n);
+	for(i=0;i<n;i++)
+	{
+		prev[i] = (i+n-1)%n;
+		next[i] = (i+1)%n;
+	}
+
+	i = 0;
+	while(left > 3)
+	{
+		a = pointpos(w,poly,prev[i]);
+		b = pointpos(w,poly,i);
+		c = pointpos(w,poly,next[i]);
+		ear = turn(a,b,c) > 0.0;
+		for(j=next[next[i]];ear && j!=prev[i];j=next[j])
+		{
+			p = pointpos(w,poly,j);
+
+			/* Where a bridge meets b, the polygon can leave b again
+			 * through the ear without a point inside it.
+			 */
+			if(samepos(p,b))
+			{
+				if(incorner(a,b,c,pointpos(w,poly,prev[j])) ||
+						incorner(a,b,c,pointpos(w,poly,next[j])))
+					ear = 0;
+				continue;
+			}
+			if(samepos(p,a) || samepos(p,c) ||
+					turn(pointpos(w,poly,prev[j]),p,pointpos(w,poly,next[j])) > 0.0)
+				continue;
+			if(intriangle(a,b,c,p))
+				ear = 0;
+		}
+		if(!ear)
+		{
+			i = next[i];
+			if(++tries > left)
+			{
+				ok = 0;
+				break;
+			}
+			continue;
+		}
+		append(triangles,prev[i]);
+		append(triangles,i);
+		append(triangles,next[i]);
+		next[prev[i]] = next[i];
+		prev[next[i]] = prev[i];
+		i = prev[i];
+		left--;
+		tries = 0;
+	}
+	if(ok)
+	{
+		append(triangles,prev[i]);
+		append(triangles,i);
+		append(triangles,next[i]);
+	}
+	free(prev);
+	free(next);
+	return ok;
+}
+
+static int
+comparediagonals ( const void *a, const void *b )
+{
+	const diagonal_t *x=(const diagonal_t*)a,*y=(const diagonal_t*)b;
+
+	if(x->key != y->key)
+		return x->key < y->key ? -1 : 1;
+	return x->from - y->from;
+}
+
+static int
+findpiece ( int *owner, int t )
+{
+	while(owner[t] != t)
+		t = owner[t];
+	return t;
+}
+
+static int
+findside ( intlist_t *piece, int from, int to )
+{
+	int i;
+
+	for(i=0;i<piece->count;i++)
+		if(piece->items[i] == from && piece->items[(i+1)%piece->count] == to)
+			return i;
+	return -1;
+}
+
+/* mergepieces
+ *
+ * Remove each diagonal between two triangles if the pieces either side
+ * of it make a convex piece together. pieces[t] is the piece triangle t
+ * was merged into, if owner[t] is t.
+ */
+static void
+mergepieces ( worklevel_t *w, polygon_t *poly, intlist_t *triangles,
+		intlist_t *pieces, int *owner )
+{
+	diagonal_t *diagonals;
+	intlist_t merged,*p,*q;
+	int i,j,k,n=poly->verts.count,numtriangles=triangles->count/3;
+	int numdiagonals=0,from,to,ip,iq,pp,pq,x,y;
+
+	diagonals = (diagonal_t*)malloc(sizeof(diagonal_t)*triangles->count);
+	for(i=0;i<numtriangles;i++)
+	{
+		memset(&pieces[i],0,sizeof(intlist_t));
+		for(j=0;j<3;j++)
+		{
+			from = triangles->items[3*i+j];
+			to = triangles->items[3*i+(j+1)%3];
+			append(&pieces[i],from);
+			if(to == (from+1)%n)
+				continue;
+			diagonals[numdiagonals].key = (long long)(from < to ? from : to)*n +
+					(from < to ? to : from);
+			diagonals[numdiagonals].from = from;
+			diagonals[numdiagonals].to = to;
+			diagonals[numdiagonals].triangle = i;
+			numdiagonals++;
+		}
+		owner[i] = i;
+	}
+	qsort(diagonals,numdiagonals,sizeof(diagonal_t),comparediagonals);
+
+	for(i=0;i+1<numdiagonals;i++)
+	{
+		if(diagonals[i].key != diagonals[i+1].key)
+			continue;
+		x = diagonals[i].from;
+		y = diagonals[i].to;
+		pp = findpiece(owner,diagonals[i].triangle);
+		pq = findpiece(owner,diagonals[i+1].triangle);
+		i++;
+		if(pp == pq)
+			continue;
+		p = &pieces[pp];
+		q = &pieces[pq];
+		ip = findside(p,x,y);
+		iq = findside(q,y,x);
+		if(ip < 0 || iq < 0)
+			continue;
+
+		/* y, round p to x, then round q back to just before y. */
+		memset(&merged,0,sizeof(merged));
+		for(k=1;k<=p->count;k++)
+			append(&merged,p->items[(ip+k)%p->count]);
+		for(k=2;k<q->count;k++)
+			append(&merged,q->items[(iq+k)%q->count]);
+		j = p->count-1;
+		if(turn(pointpos(w,poly,merged.items[j-1]),pointpos(w,poly,x),
+				pointpos(w,poly,merged.items[j+1])) < 0.0 ||
+				turn(pointpos(w,poly,merged.items[merged.count-1]),pointpos(w,poly,y),
+				pointpos(w,poly,merged.items[1])) < 0.0)
+		{
+			freelist(&merged);
+			continue;
+		}
+		freelist(p);
+		freelist(q);
+		*p = merged;
+		owner[pq] = pp;
+	}
+	free(diagonals);
+}
+
+static double
+piecearea ( worklevel_t *w, polygon_t *poly, intlist_t *piece )
+{
+	lvlvert_t *a,*b;
+	double area=0.0;
+	int i;
+
+	for(i=0;i<piece->count;i++)
+	{
+		a = pointpos(w,poly,piece->items[i]);
+		b = pointpos(w,poly,piece->items[(i+1)%piece->count]);
+		area += (double)a->x*b->y - (double)b->x*a->y;
+	}
+	return area/2.0;
+}
+
+/* usepieces
+ *
+ * Make each piece a platform, the first taking over p, and join them
+ * with new edges where they meet away from p's own edges.
+ */
+static int
+usepieces ( worklevel_t *w, int p, polygon_t *poly, intlist_t *pieces, int *owner,
+		int numtriangles )
+{
+	intlist_t portals,*piece,*edges;
+	lvlplatform_t like=w->platforms[p];
+	lvledge_t *e;
+	int i,j,k,from,to,v0,v1,plat,edge,n=poly->verts.count,count=0;
+
+	memset(&portals,0,sizeof(portals));
+	for(i=0;i<numtriangles;i++)
+	{
+		if(owner[i] != i)
+			continue;
+		piece = &pieces[i];
+		plat = count++ ? addplatform(w,&like) : p;
+		edges = &w->platformedges[plat];
+		if(plat == p)
+			edges->count = 0;
+		for(j=0;j<piece->count;j++)
+		{
+			from = piece->items[j];
+			to = piece->items[(j+1)%piece->count];
+			if(to == (from+1)%n && poly->edges.items[from] >= 0)
+			{
+				edge = poly->edges.items[from];
+				e = &w->edges[edge];
+				if(e->rightplat == p)
+					e->rightplat = plat;
+				else
+					e->leftplat = plat;
+				append(edges,edge);
+				continue;
+			}
+
+			/* A bridge or a diagonal: the piece is on its left. */
+			v0 = poly->verts.items[from];
+			v1 = poly->verts.items[to];
+			edge = -1;
+			for(k=0;k<portals.count;k++)
+			{
+				e = &w->edges[portals.items[k]];
+				if(e->verts[0] == v1 && e->verts[1] == v0 && e->leftplat == UNSET)
+				{
+					edge = portals.items[k];
+					e->leftplat = plat;
+					break;
+				}
+			}
+			if(edge < 0)
+			{
+				edge = addedge(w,v0,v1);
+				w->edges[edge].rightplat = plat;
+				append(&portals,edge);
+				append(&w->vertedges[v0],edge);
+				append(&w->vertedges[v1],edge);
+			}
+			append(edges,edge);
+		}
+	}
+	for(k=0;k<portals.count;k++)
+		if(w->edges[portals.items[k]].leftplat == UNSET)
+			fprintf(stderr,"platform %i: join %i has one side\n",p,portals.items[k]);
+	freelist(&portals);
+	return count;
+}
+
+/* splitplatform
+ *
+ * Returns the number of pieces p was split into, or 0 if it was left
+ * whole.
+ */
+static int
+splitplatform ( worklevel_t *w, int p )
+{
+	intlist_t order,loops,triangles,*pieces=NULL;
+	halfedge_t *half;
+	polygon_t poly;
+	double area,outline=0.0,total=0.0;
+	int i,j,outer=-1,numpoints,*owner=NULL,split=0;
+
+	if(w->platforms[p].ceilheight <= w->platforms[p].floorheight || wouldoptimise(w,p))
+		return 0;
+
+	memset(&order,0,sizeof(order));
+	memset(&loops,0,sizeof(loops));
+	memset(&triangles,0,sizeof(triangles));
+	memset(&poly,0,sizeof(poly));
+	half = (halfedge_t*)malloc(sizeof(halfedge_t)*w->platformedges[p].count);
+	if(!traceoutline(w,p,half,&order,&loops))
+		goto done;
+
+	/* One outline going anticlockwise, and any number of holes. */
+	numpoints = 0;
+	for(i=0;i<loops.count;i+=2)
+	{
+		area = looparea(w,half,&order.items[loops.items[i]],loops.items[i+1]);
+		if(area > 0.0)
+		{
+			if(outer >= 0)
+				goto done;
+			outer = i;
+		}
+		outline += area;
+		numpoints += loops.items[i+1]+2;
+	}
+	if(outer < 0 || numpoints > MAX_SPLIT_POINTS)
+		goto done;
+	if(loops.count == 2 &&
+			loopconvex(w,half,&order.items[loops.items[0]],loops.items[1]))
+		goto done;
+
+	for(i=0;i<loops.items[outer+1];i++)
+	{
+		j = order.items[loops.items[outer]+i];
+		append(&poly.verts,half[j].from);
+		append(&poly.edges,half[j].edge);
+	}
+	/* Holes from right to left, so that no bridge crosses a hole yet to
+	 * be joined.
+	 */
+	while(loops.count > 2)
+	{
+		for(i=0,j=-1;i<loops.count;i+=2)
+		{
+			if(i == outer)
+				continue;
+			if(j < 0 || loopmaxx(w,half,&order.items[loops.items[i]],loops.items[i+1]) >
+					loopmaxx(w,half,&order.items[loops.items[j]],loops.items[j+1]))
+				j = i;
+		}
+		if(!bridgehole(w,&poly,half,&order.items[loops.items[j]],loops.items[j+1]))
+			goto done;
+		loops.items[j] = loops.items[loops.count-2];
+		loops.items[j+1] = loops.items[loops.count-1];
+		if(outer == loops.count-2)
+			outer = j;
+		loops.count -= 2;
+	}
+
+	if(!earclip(w,&poly,&triangles))
+		goto done;
+	pieces = (intlist_t*)malloc(sizeof(intlist_t)*(triangles.count/3));
+	owner = (int*)malloc(sizeof(int)*(triangles.count/3));
+	mergepieces(w,&poly,&triangles,pieces,owner);
+
+	/* The pieces must cover the platform exactly once. */
+	for(i=0;i<triangles.count/3;i++)
+		if(owner[i] == i)
+			total += piecearea(w,&poly,&pieces[i]);
+	if(fabs(total-outline) > 1e-6*fabs(outline) + 1e-3)
+		fprintf(stderr,"platform %i: pieces cover %g of %g, left whole\n",p,total,outline);
+	else
+		split = usepieces(w,p,&poly,pieces,owner,triangles.count/3);
+	for(i=0;i<triangles.count/3;i++)
+		if(owner[i] == i)
+			freelist(&pieces[i]);
+
+done:
+	free(pieces);
+	free(owner);
+	free(half);
+	freelist(&order);
+	freelist(&loops);
+	freelist(&triangles);
+	freelist(&poly.verts);
+	freelist(&poly.edges);
+	return split;
+}
+
+/* splitplatforms
+ *
+ * Write in into out with its concave platforms split. The first piece of
+ * a platform keeps its place and the others are put after the level's
+ * platforms, and the edges joining pieces after its edges. Returns the
+ * number of platforms split, and the pieces they were split into, or -1
+ * if out could not be allocated.
+ */
+int
+splitplatforms ( levelimage_t *in, levelimage_t *out, int *pieces )
+{
+	lvlheader_t *h=in->header,counts;
+	worklevel_t w;
+	lvlplatform_t *p;
+	lvlvert_t *v;
+	lvledge_t *e;
+	intlist_t *list;
+	int i,j,n,split=0,numplatforms=h->numplatforms,ok=0;
+
+	memset(&w,0,sizeof(w));
+	w.in = in;
+	w.numedges = h->numedges;
+	w.allocatededges = h->numedges+16;
+	w.edges = (lvledge_t*)malloc(sizeof(lvledge_t)*w.allocatededges);
+	for(i=0;i<h->numedges;i++)
+	{
+		w.edges[i] = in->edges[i];
+		if(w.edges[i].leftplat == numplatforms)
+			w.edges[i].leftplat = OUTSIDE;
+		if(w.edges[i].rightplat == numplatforms)
+			w.edges[i].rightplat = OUTSIDE;
+	}
+	w.numplatforms = numplatforms;
+	w.allocatedplatforms = numplatforms+16;
+	w.platforms = (lvlplatform_t*)malloc(sizeof(lvlplatform_t)*w.allocatedplatforms);
+	w.platformedges = (intlist_t*)calloc(w.allocatedplatforms,sizeof(intlist_t));
+	for(i=0;i<numplatforms;i++)
+	{
+		w.platforms[i] = in->platforms[i];
+		for(j=0;j<in->platforms[i].numedges;j++)
+			append(&w.platformedges[i],in->edgerefs[in->platforms[i].firstedge+j]);
+	}
+	w.vertedges = (intlist_t*)calloc(h->numverts+1,sizeof(intlist_t));
+	w.firstout = (int*)malloc(sizeof(int)*(h->numverts+1));
+	for(i=0;i<h->numverts;i++)
+	{
+		for(j=0;j<in->verts[i].numedges;j++)
+			append(&w.vertedges[i],in->edgerefs[in->verts[i].firstedge+j]);
+		w.firstout[i] = -1;
+	}
+
+	*pieces = 0;
+	for(i=0;i<numplatforms;i++)
+	{
+		n = splitplatform(&w,i);
+		if(n)
+		{
+			split++;
+			*pieces += n;
+		}
+	}
+
+	memset(&counts,0,sizeof(counts));
+	counts.numverts = h->numverts;
+	counts.numedges = w.numedges;
+	counts.numplatforms = w.numplatforms;
+	counts.numedgerefs = in->platforms[numplatforms].numedges;
+	for(i=0;i<w.numplatforms;i++)
+		counts.numedgerefs += w.platformedges[i].count;
+	for(i=0;i<h->numverts;i++)
+		counts.numedgerefs += w.vertedges[i].count;
+	counts.sizex = h->sizex;
+	counts.sizey = h->sizey;
+	if(!newlevelimage(out,&counts))
+		goto done;
+
+	n = 0;
+	for(i=0;i<=w.numplatforms;i++)
+	{
+		p = &out->platforms[i];
+		*p = i < w.numplatforms ? w.platforms[i] : in->platforms[numplatforms];
+		p->firstedge = n;
+		p->convex = 0;
+		if(i < w.numplatforms)
+		{
+			list = &w.platformedges[i];
+			memcpy(&out->edgerefs[n],list->items,sizeof(int32_t)*list->count);
+			p->numedges = list->count;
+		} else
+			memcpy(&out->edgerefs[n],&in->edgerefs[in->platforms[numplatforms].firstedge],
+					sizeof(int32_t)*p->numedges);
+		n += p->numedges;
+	}
+	for(i=0;i<h->numverts;i++)
+	{
+		v = &out->verts[i];
+		list = &w.vertedges[i];
+		v->x = in->verts[i].x;
+		v->y = in->verts[i].y;
+		v->firstedge = n;
+		v->numedges = list->count;
+		memcpy(&out->edgerefs[n],list->items,sizeof(int32_t)*list->count);
+		n += list->count;
+	}
+	for(i=0;i<w.numedges;i++)
+	{
+		e = &out->edges[i];
+		*e = w.edges[i];
+		if(e->leftplat == OUTSIDE)
+			e->leftplat = w.numplatforms;
+		if(e->rightplat == OUTSIDE)
+			e->rightplat = w.numplatforms;
+	}
+	ok = 1;
+
+done:
+	for(i=0;i<w.numplatforms;i++)
+		freelist(&w.platformedges[i]);
+	for(i=0;i<h->numverts;i++)
+		freelist(&w.vertedges[i]);
+	free(w.edges);
+	free(w.platforms);
+	free(w.platformedges);
+	free(w.vertedges);
+	free(w.firstout);
+	return ok ? split : -1;
+}
@@ -0,0 +1,300 @@
+/*
+ * Copyright (C) Matthew Earl
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+/* The parts of the renderer that write pixels, for one pixel format.
+ *
+ * This file is included by raycaster.c once for each format, with PIXEL
+ * defined as the type of a pixel, PIXELFUNC(f) giving the name of f for
+ * the format, and FLOORKERNEL the floor loop to use. Textures are held in
+ * the same format as the screen.
+ */
+
+/* Address of pixel (x,y) in the frame being drawn. */
+static inline PIXEL *
+PIXELFUNC(framepixel) ( raycaster_t *r, int x, int y )
+{
+	return (PIXEL*)r->pixels + x*r->xstep + y*r->ystep;
+}
+
+void
+PIXELFUNC(drawvertline) ( raycaster_t *r, float g1, float g2, int x, int re, int g, int b )
+{
+	PIXEL *pixel;
+	int p1,p2,t,y;
+	p1 = gradtopixel(g1);
+	p2 = gradtopixel(g2);
+	if(p2 < p1)
+	{
+		t=p1;
+		p1=p2;
+		p2=t;
+	}
+	if(p1 < 0)
+		p1 = 0;
+	else if(p1 > r->height-1)
+		p1 = r->height-1;
+	if(p2 < 0)
+		p2 = 0;
+	else if(p2 > r->height-1)
+		p2 = r->height-1;
+
+	pixel = PIXELFUNC(framepixel)(r,x,p1);
+	for(y=p1;y<p2;y++)
+	{
+		*pixel = SDL_MapRGB(r->screen->format, re,g,b);
+		pixel += r->ystep;
+	}
+}
+
+/* drawwall
+ *
+ * Draw a piece of a wall, between gradients g1 and g2
+ */
+void
+PIXELFUNC(drawwall) ( raycaster_t *r, intersection_t *in, float g1, float g2, int x )
+{
+	PIXEL *pixel,*tpixel;
+	int p1,p2,y,tx,ty,i,h1,h2,level;
+	texture_t *t=in->edge->texture;
+	
+	p1 = gradtopixel(g1);
+	p2 = gradtopixel(g2);
+	if(p2 == p1)
+		return;
+
+	/* Clamp p1,p2 and the corresponding values of h1,h2 to the screen.
+	 */
+	if(p1 < 0)
+		p1 = 0;
+
+	if(p2 > r->height-1)
+		p2 = r->height-1;
+
+	h1 = (int)(PRECISION_PRODUCT * (r->eyelevel + pixeltograd[p1] * in->distance));
+	h2 = (int)(PRECISION_PRODUCT * (r->eyelevel + pixeltograd[p2] * in->distance));
+
+	/* A pixel of wall is distance*step texels high. */
+	level = miplevel(r,t,in->distance*fabsf(pixeltogradcoefficent));
+	t = mipmap(t,level);
+	h1 >>= level;
+	h2 >>= level;
+
+	tx = (((int)in->texoffset)>>level)&(t->widthmask);
+	i = ((h2-h1)/(p2-p1)) & t->heightmasksmallshift;
+	ty = h1 & t->heightmasksmallshift;
+	pixel = PIXELFUNC(framepixel)(r,x,p1);
+	tpixel = (PIXEL*)t->pixels + (tx<<t->log2height);
+	COUNT(wallpixels,p2-p1);
+	for(y=p1;y<p2;y++)
+	{
+		*pixel = tpixel[ty>>PRECISION_BITS];
+
+		/* Recalculate the vertical texture pixel `ty`. Most of the time do this by
+		 * adding on a constant but periodically do an expensive recalculation. This is
+		 * to mitigate acculated rounding errors in the increment value `i`.
+		 */
+		if ((y & 0xF) == 0)
+			ty = ((h2 * (y - p1) + h1 * (p2 - y)) / (p2 - p1)) & t->heightmasksmallshift;
+		else
+			ty = (ty+i)&(t->heightmasksmallshift);
+		pixel += r->ystep;
+	}
+}
+
+
+/* drawfloor
+ *
+ * h is the distance the floor is above or below current eye level
+ *   it is required for correct texture mapping
+ */
+void
+PIXELFUNC(drawfloor) ( raycaster_t *r, platform_t *p, float h,
+		vector2d_t *dir, float g1, float g2, int x )
+{
+	PIXEL *pixel;
+	int p1,p2,y,end,level;
+	int hdirx,hdiry,ox,oy;
+	texture_t *t=p->texture;
+	float height=fabsf(h),low,high;
+	
+	p1 = gradtopixel(g1);
+	p2 = gradtopixel(g2);
+	
+	if(p1 < 0)
+		p1 = 0;
+	
+	if(p2 > r->height-1)
+		p2 = r->height-1;
+	
+	if(p2 <= p1)
+		return;
+
+	pixel = PIXELFUNC(framepixel)(r,x,p1);
+	hdirx = (int)(dir->x*h*PRECISION_PRODUCT);
+	hdiry = (int)(dir->y*h*PRECISION_PRODUCT);
+	ox = ((int)r->viewpos.x)<<DOUBLE_PRECISION_BITS;
+	oy = ((int)r->viewpos.y)<<DOUBLE_PRECISION_BITS;
+	
+	COUNT(floorpixels,p2-p1);
+
+	/* The mip level changes with the distance of each row, so the column
+	 * is drawn in runs of rows that share a level.
+	 */
+	for(y=p1;y<p2;y=end)
+	{
+		level = miplevel(r,t,height*pixelfootprint[y]);
+		low = level ? (float)(1<<level) : 0.0f;
+		high = level < t->nummips && !r->options.nomips ? (float)(2<<level) : INFINITY;
+		for(end=y+1;end<p2;end++)
+		{
+			if(height*pixelfootprint[end] < low || height*pixelfootprint[end] >= high)
+				break;
+		}
+		FLOORKERNEL(pixel,r->ystep,mipmap(t,level),hdirx>>level,hdiry>>level,
+				ox>>level,oy>>level,&invpixeltogradint[y],end-y);
+		pixel += (end-y)*r->ystep;
+	}
+}
+
+void
+PIXELFUNC(drawspan) ( raycaster_t *r, spansetup_t *s, int y, int x1, int x2 )
+{
+	PIXEL *pixel,*texels;
+	texture_t *t;
+	long long u,v,du,dv;
+	int x,tx,ty,inv,ox,oy,level;
+
+	level = miplevel(r,s->t,s->height*pixelfootprint[y]);
+	t = mipmap(s->t,level);
+	texels = (PIXEL*)t->pixels;
+
+	inv = invpixeltogradint[y];
+	u = ((s->hx0 + s->hxstep*x1)*inv)>>level;
+	v = ((s->hy0 + s->hystep*x1)*inv)>>level;
+	du = (s->hxstep*inv)>>level;
+	dv = (s->hystep*inv)>>level;
+	ox = s->ox>>level;
+	oy = s->oy>>level;
+
+	pixel = PIXELFUNC(framepixel)(r,x1,y);
+	for(x=x1;x<=x2;x++)
+	{
+		tx = ((int)(u>>SPAN_FRACTION_BITS)+ox)&(t->widthmaskshift);
+		ty = ((int)(v>>SPAN_FRACTION_BITS)+oy)&(t->heightmaskshift);
+
+		*pixel = texels[texelindex(t,tx>>DOUBLE_PRECISION_BITS,ty>>DOUBLE_PRECISION_BITS)];
+		pixel += r->xstep;
+
+		u += du;
+		v += dv;
+	}
+}
+
+void
+PIXELFUNC(drawsprite) ( raycaster_t *r, spriteref_t *ref, vector2d_t *dir, int x )
+{
+	float sprmingrad,sprmaxgrad,mingr,maxgr;
+	int i,y,k,n,k1,k2,top,bottom;
+	sprite_t *s=ref->sprite;
+	int p1,p2,p1b,p2b,ty,tx,h1=s->heights[0],h2=s->heights[1];
+	PIXEL *pixel,*tpixel;
+	texture_t *t=s->texture;
+	texrun_t *run,*lastrun;
+	
+	sprmingrad = (s->heights[0]-r->eyelevel)/ref->dist;
+	sprmaxgrad = (s->heights[1]-r->eyelevel)/ref->dist;
+
+	p1b = gradtopixel(sprmaxgrad);
+	p2b = gradtopixel(sprmingrad);
+	
+	if(sprmingrad > ref->mingrad)
+	{
+		mingr = sprmingrad;
+		p2 = p2b;
+	} else
+	{
+		mingr = ref->mingrad;
+		p2 = gradtopixel(mingr);
+	}
+	
+	if(sprmaxgrad < ref->maxgrad)
+	{
+		maxgr = sprmaxgrad;
+		p1 = p1b;
+	} else
+	{
+		maxgr = ref->maxgrad;
+		p1 = gradtopixel(maxgr);
+	}
+
+	if(p1 < 0)
+		p1 = 0;
+	if(p2 > r->height-1)
+		p2 = r->height-1;
+	
+	tx = ((int)ref->texoffset)%(t->widthmask);
+	tpixel = (PIXEL*)t->pixels + (tx<<t->log2height);
+	ty = ((((p1-p1b)*(h2-h1))<<PRECISION_BITS)/
+			(p2b-p1b))&(t->heightmasksmallshift);
+	i = ((h2-h1)<<PRECISION_BITS)/(p2b-p1b);
+	lastrun = &t->runs[t->firstrun[tx+1]];
+
+	/* Only the opaque runs of the column are drawn. The screen is gone
+	 * down in stretches that end where the texture repeats, so that ty
+	 * needs no masking within a stretch.
+	 */
+	for(y=p1;y<p2;y+=n)
+	{
+		n = i > 0 ? ((t->height<<PRECISION_BITS)-ty+i-1)/i : p2-y;
+		if(n > p2-y)
+			n = p2-y;
+
+		for(run=&t->runs[t->firstrun[tx]];run<lastrun;run++)
+		{
+			/* Pixels k1..k2-1 of the stretch show this run. */
+			top = run->start<<PRECISION_BITS;
+			bottom = run->end<<PRECISION_BITS;
+			if(bottom <= ty)
+				continue;
+			k1 = top <= ty ? 0 : (i > 0 ? (top-ty+i-1)/i : n);
+			k2 = i > 0 ? (bottom-ty+i-1)/i : n;
+			if(k1 >= n)
+				break;
+			if(k2 > n)
+				k2 = n;
+
+			COUNT(spritepixels,k2-k1);
+			pixel = PIXELFUNC(framepixel)(r,x,y+k1);
+			for(k=k1;k<k2;k++)
+			{
+				*pixel = tpixel[(ty+k*i)>>PRECISION_BITS];
+				pixel += r->ystep;
+			}
+		}
+		ty = (ty+n*i)&(t->heightmasksmallshift);
+	}
+}
+
+pixelops_t PIXELFUNC(pixelops) =
+{
+	sizeof(PIXEL),
+	PIXELFUNC(drawwall),
+	PIXELFUNC(drawfloor),
+	PIXELFUNC(drawspan),
+	PIXELFUNC(drawsprite)
+};
@@ -0,0 +1,175 @@
+/*
+ * Copyright (C) Matthew Earl
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+/* A uniform grid over the level, for finding the platform a point is in.
+ *
+ * Each cell lists every platform whose bounding box overlaps it, in the
+ * order of the level's platform array, so a point need only be tested
+ * against the platforms of the cell it falls in.
+ */
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "grid.h"
+#include "threads.h"
+
+#define GRID_CELLS_PER_PLATFORM	2
+#define GRID_MAX_SIDE		1024	/* cells along each side */
+#define GRID_MARGIN		1.0f	/* units around the level's vertices */
+
+static void
+platformbounds ( platform_t *p, vector2d_t *min, vector2d_t *max )
+{
+	vector2d_t *v;
+	int i,j;
+
+	*min = p->edges[0]->verts[0]->pos;
+	*max = *min;
+	for(i=0;i<p->numedges;i++)
+	{
+		for(j=0;j<2;j++)
+		{
+			v = &p->edges[i]->verts[j]->pos;
+			min->x = fminf(min->x,v->x);
+			min->y = fminf(min->y,v->y);
+			max->x = fmaxf(max->x,v->x);
+			max->y = fmaxf(max->y,v->y);
+		}
+	}
+}
+
+/* The cells covered by the box min..max, clamped to the grid. */
+static void
+cellrange ( level_t *l, vector2d_t *min, vector2d_t *max,
+		int *x1, int *y1, int *x2, int *y2 )
+{
+	*x1 = (int)((min->x-l->gridorigin.x)/l->gridcell);
+	*y1 = (int)((min->y-l->gridorigin.y)/l->gridcell);
+	*x2 = (int)((max->x-l->gridorigin.x)/l->gridcell);
+	*y2 = (int)((max->y-l->gridorigin.y)/l->gridcell);
+	if(*x1 < 0) *x1 = 0;
+	if(*y1 < 0) *y1 = 0;
+	if(*x2 > l->gridwidth-1) *x2 = l->gridwidth-1;
+	if(*y2 > l->gridheight-1) *y2 = l->gridheight-1;
+}
+
+void
+buildgrid ( level_t *l )
+{
+	vector2d_t min,max,pmin,pmax,*v;
+	long long start;
+	int i,x,y,x1,y1,x2,y2,cells,total;
+	int *fill;
+
+	start = nanotime();
+	l->gridstart = NULL;
+	l->gridplatforms = NULL;
+	l->gridwidth = l->gridheight = 0;
+	if(!l->numverts || !l->numplatforms)
+		return;
+
+	min = max = l->verts[0].pos;
+	for(i=1;i<l->numverts;i++)
+	{
+		v = &l->verts[i].pos;
+		min.x = fminf(min.x,v->x);
+		min.y = fminf(min.y,v->y);
+		max.x = fmaxf(max.x,v->x);
+		max.y = fmaxf(max.y,v->y);
+	}
+	l->gridorigin.x = min.x - GRID_MARGIN;
+	l->gridorigin.y = min.y - GRID_MARGIN;
+	max.x += GRID_MARGIN;
+	max.y += GRID_MARGIN;
+
+	/* Square cells, about GRID_CELLS_PER_PLATFORM of them per platform. */
+	l->gridcell = sqrtf((max.x-l->gridorigin.x)*(max.y-l->gridorigin.y)/
+			(GRID_CELLS_PER_PLATFORM*l->numplatforms));
+	if((max.x-l->gridorigin.x)/l->gridcell > GRID_MAX_SIDE)
+		l->gridcell = (max.x-l->gridorigin.x)/GRID_MAX_SIDE;
+	if((max.y-l->gridorigin.y)/l->gridcell > GRID_MAX_SIDE)
+		l->gridcell = (max.y-l->gridorigin.y)/GRID_MAX_SIDE;
+	l->gridwidth = (int)((max.x-l->gridorigin.x)/l->gridcell)+1;
+	l->gridheight = (int)((max.y-l->gridorigin.y)/l->gridcell)+1;
+	cells = l->gridwidth*l->gridheight;
+
+	/* Count the platforms in each cell, then fill the cells in a second
+	 * pass, platform by platform so each cell's list stays in order.
+	 */
+	l->gridstart = (int*)calloc(cells+1,sizeof(int));
+	for(i=0;i<l->numplatforms;i++)
+	{
+		platformbounds(&l->platforms[i],&pmin,&pmax);
+		cellrange(l,&pmin,&pmax,&x1,&y1,&x2,&y2);
+		for(y=y1;y<=y2;y++)
+			for(x=x1;x<=x2;x++)
+				l->gridstart[x+y*l->gridwidth+1]++;
+	}
+	for(i=0;i<cells;i++)
+		l->gridstart[i+1] += l->gridstart[i];
+	total = l->gridstart[cells];
+
+	l->gridplatforms = (int*)malloc(sizeof(int)*(total ? total : 1));
+	fill = (int*)malloc(sizeof(int)*cells);
+	for(i=0;i<cells;i++)
+		fill[i] = l->gridstart[i];
+	for(i=0;i<l->numplatforms;i++)
+	{
+		platformbounds(&l->platforms[i],&pmin,&pmax);
+		cellrange(l,&pmin,&pmax,&x1,&y1,&x2,&y2);
+		for(y=y1;y<=y2;y++)
+			for(x=x1;x<=x2;x++)
+				l->gridplatforms[fill[x+y*l->gridwidth]++] = i;
+	}
+	free(fill);
+
+	printf("grid: %ix%i cells, %.1f platforms per cell, %.1f ms\n",
+		l->gridwidth, l->gridheight, (float)total/cells,
+		1.0e-6*(nanotime()-start));
+}
+
+void
+freegrid ( level_t *l )
+{
+	free(l->gridstart);
+	free(l->gridplatforms);
+	l->gridstart = NULL;
+	l->gridplatforms = NULL;
+}
+
+/* gridcandidates
+ *
+ * The numbers of the platforms which might contain v. Sets *count to
+ * the number of them; a point off the grid has none.
+ */
+int *
+gridcandidates ( level_t *l, vector2d_t *v, int *count )
+{
+	int x,y,c;
+
+	*count = 0;
+	if(!l->gridstart)
+		return NULL;
+	x = (int)floorf((v->x-l->gridorigin.x)/l->gridcell);
+	y = (int)floorf((v->y-l->gridorigin.y)/l->gridcell);
+	if(x < 0 || y < 0 || x >= l->gridwidth || y >= l->gridheight)
+		return NULL;
+	c = x+y*l->gridwidth;
+	*count = l->gridstart[c+1]-l->gridstart[c];
+	return &l->gridplatforms[l->gridstart[c]];
+}
@@ -0,0 +1,677 @@
+/*
+ * Copyright (C) Matthew Earl
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+/* Inner loops of the renderer, with vector versions chosen at startup to
+ * suit the CPU. The scalar versions are kept as the reference.
+ */
+#include <stdio.h>
+#include <string.h>
+#include "kernels.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define X86_KERNELS
+#include <immintrin.h>
+#endif
+
+void
+drawfloorscalar ( unsigned short *pixel, int step, texture_t *t,
+		int hdirx, int hdiry, int ox, int oy, const int *inv, int n )
+{
+	const unsigned short *texels=(const unsigned short*)t->pixels;
+	int y,tx,ty;
+
+	for(y=0;y<n;y++)
+	{
+		tx = (hdirx*inv[y]+ox)&(t->widthmaskshift);
+		ty = (hdiry*inv[y]+oy)&(t->heightmaskshift);
+
+		*pixel = texels[texelindex(t,tx>>DOUBLE_PRECISION_BITS,ty>>DOUBLE_PRECISION_BITS)];
+
+		pixel += step;
+	}
+}
+
+void
+drawfloor32scalar ( unsigned int *pixel, int step, texture_t *t,
+		int hdirx, int hdiry, int ox, int oy, const int *inv, int n )
+{
+	const unsigned int *texels=(const unsigned int*)t->pixels;
+	int y,tx,ty;
+
+	for(y=0;y<n;y++)
+	{
+		tx = (hdirx*inv[y]+ox)&(t->widthmaskshift);
+		ty = (hdiry*inv[y]+oy)&(t->heightmaskshift);
+
+		*pixel = texels[texelindex(t,tx>>DOUBLE_PRECISION_BITS,ty>>DOUBLE_PRECISION_BITS)];
+
+		pixel += step;
+	}
+}
+
+int
+intersectedgesscalar ( edgearrays_t *a, vector2d_t *origin, vector2d_t *dir,
+		float *dist )
+{
+	float d,num,t,px,py,proj,mindist=0.0f;
+	int i,best=-1;
+
+	for(i=0;i<a->count;i++)
+	{
+		d = dir->x*a->normalx[i] + dir->y*a->normaly[i];
+		if(d*a->side[i] <= 0.0f)
+			continue;
+
+		/* Only going forwards from origin. */
+		num = a->planedist[i] - (origin->x*a->normalx[i] + origin->y*a->normaly[i]);
+		if((num <= 0.0f) != (d < 0.0f))
+			continue;
+
+		t = num/d;
+		px = dir->x*t + origin->x;
+		py = dir->y*t + origin->y;
+		proj = px*a->linex[i] + py*a->liney[i];
+		if(proj < a->projmin[i] || proj > a->projmax[i])
+			continue;
+
+		if(best < 0 || t < mindist)
+		{
+			mindist = t;
+			best = i;
+		}
+	}
+	*dist = mindist;
+	return best;
+}
+
+void
+intersectpacketscalar ( edgearrays_t *a, vector2d_t *origins, vector2d_t *dirs,
+		int *edges, float *dists )
+{
+	int i;
+
+	for(i=0;i<PACKET_SIZE;i++)
+		edges[i] = intersectedgesscalar(a,&origins[i],&dirs[i],&dists[i]);
+}
+
+/* exitsthroughedge
+ *
+ * Whether the ray leaves through edge i at least margin from either end,
+ * setting *dist as intersectedgesscalar would. In a convex platform no
+ * other edge can then be nearer, so the other edges need not be tested.
+ */
+int
+exitsthroughedge ( edgearrays_t *a, int i, vector2d_t *origin,
+		vector2d_t *dir, float margin, float *dist )
+{
+	float d,num,t,px,py,proj;
+
+	d = dir->x*a->normalx[i] + dir->y*a->normaly[i];
+	if(d*a->side[i] <= 0.0f)
+		return 0;
+	num = a->planedist[i] - (origin->x*a->normalx[i] + origin->y*a->normaly[i]);
+	if((num <= 0.0f) != (d < 0.0f))
+		return 0;
+
+	t = num/d;
+	px = dir->x*t + origin->x;
+	py = dir->y*t + origin->y;
+	proj = px*a->linex[i] + py*a->liney[i];
+	if(proj < a->projmin[i]+margin || proj > a->projmax[i]-margin)
+		return 0;
+	*dist = t;
+	return 1;
+}
+
+static int
+alwayssupported ( void )
+{
+	return 1;
+}
+
+#ifdef X86_KERNELS
+
+/* SSE2 has no 32-bit multiply keeping the low halves, so make one from
+ * two 32x32->64 multiplies.
+ */
+static inline __attribute__((target("sse2"))) __m128i
+mullo32sse2 ( __m128i a, __m128i b )
+{
+	__m128i even,odd;
+
+	even = _mm_mul_epu32(a,b);
+	odd = _mm_mul_epu32(_mm_srli_epi64(a,32),_mm_srli_epi64(b,32));
+	return _mm_unpacklo_epi32(_mm_shuffle_epi32(even,_MM_SHUFFLE(0,0,2,0)),
+			_mm_shuffle_epi32(odd,_MM_SHUFFLE(0,0,2,0)));
+}
+
+/* texelindex for four texels at a time. shift is log2height. */
+static inline __attribute__((target("sse2"))) __m128i
+texelindexsse2 ( texture_t *t, __m128i x, __m128i y, __m128i shift )
+{
+	__m128i mask;
+
+	if(!t->tiled)
+		return _mm_add_epi32(y,_mm_sll_epi32(x,shift));
+	mask = _mm_set1_epi32(TILE_MASK);
+	return _mm_or_si128(_mm_or_si128(_mm_and_si128(y,mask),
+			_mm_slli_epi32(_mm_and_si128(x,mask),TILE_BITS)),
+			_mm_or_si128(_mm_slli_epi32(_mm_andnot_si128(mask,y),TILE_BITS),
+			_mm_sll_epi32(_mm_andnot_si128(mask,x),shift)));
+}
+
+/* Four texel addresses at a time; SSE2 has no gather so the loads
+ * themselves are scalar.
+ */
+__attribute__((target("sse2"))) void
+drawfloorsse2 ( unsigned short *pixel, int step, texture_t *t,
+		int hdirx, int hdiry, int ox, int oy, const int *inv, int n )
+{
+	__m128i hx,hy,vox,voy,wmask,hmask,shift,vinv,tx,ty,index;
+	const unsigned short *texels=(const unsigned short*)t->pixels;
+	int indices[4] __attribute__((aligned(16)));
+	int y;
+
+	hx = _mm_set1_epi32(hdirx);
+	hy = _mm_set1_epi32(hdiry);
+	vox = _mm_set1_epi32(ox);
+	voy = _mm_set1_epi32(oy);
+	wmask = _mm_set1_epi32(t->widthmaskshift);
+	hmask = _mm_set1_epi32(t->heightmaskshift);
+	shift = _mm_cvtsi32_si128(t->log2height);
+
+	for(y=0;y+4<=n;y+=4)
+	{
+		vinv = _mm_loadu_si128((const __m128i*)(inv+y));
+		tx = _mm_and_si128(_mm_add_epi32(mullo32sse2(hx,vinv),vox),wmask);
+		ty = _mm_and_si128(_mm_add_epi32(mullo32sse2(hy,vinv),voy),hmask);
+		index = texelindexsse2(t,_mm_srli_epi32(tx,DOUBLE_PRECISION_BITS),
+				_mm_srli_epi32(ty,DOUBLE_PRECISION_BITS),shift);
+		_mm_store_si128((__m128i*)indices,index);
+
+		pixel[0] = texels[indices[0]];
+		pixel[step] = texels[indices[1]];
+		pixel[2*step] = texels[indices[2]];
+		pixel[3*step] = texels[indices[3]];
+		pixel += 4*step;
+	}
+	drawfloorscalar(pixel,step,t,hdirx,hdiry,ox,oy,inv+y,n-y);
+}
+
+__attribute__((target("sse2"))) void
+drawfloor32sse2 ( unsigned int *pixel, int step, texture_t *t,
+		int hdirx, int hdiry, int ox, int oy, const int *inv, int n )
+{
+	__m128i hx,hy,vox,voy,wmask,hmask,shift,vinv,tx,ty,index;
+	const unsigned int *texels=(const unsigned int*)t->pixels;
+	int indices[4] __attribute__((aligned(16)));
+	int y;
+
+	hx = _mm_set1_epi32(hdirx);
+	hy = _mm_set1_epi32(hdiry);
+	vox = _mm_set1_epi32(ox);
+	voy = _mm_set1_epi32(oy);
+	wmask = _mm_set1_epi32(t->widthmaskshift);
+	hmask = _mm_set1_epi32(t->heightmaskshift);
+	shift = _mm_cvtsi32_si128(t->log2height);
+
+	for(y=0;y+4<=n;y+=4)
+	{
+		vinv = _mm_loadu_si128((const __m128i*)(inv+y));
+		tx = _mm_and_si128(_mm_add_epi32(mullo32sse2(hx,vinv),vox),wmask);
+		ty = _mm_and_si128(_mm_add_epi32(mullo32sse2(hy,vinv),voy),hmask);
+		index = texelindexsse2(t,_mm_srli_epi32(tx,DOUBLE_PRECISION_BITS),
+				_mm_srli_epi32(ty,DOUBLE_PRECISION_BITS),shift);
+		_mm_store_si128((__m128i*)indices,index);
+
+		pixel[0] = texels[indices[0]];
+		pixel[step] = texels[indices[1]];
+		pixel[2*step] = texels[indices[2]];
+		pixel[3*step] = texels[indices[3]];
+		pixel += 4*step;
+	}
+	drawfloor32scalar(pixel,step,t,hdirx,hdiry,ox,oy,inv+y,n-y);
+}
+
+/* Pick the nearest of the edges set in mask, the first on a tie as in the
+ * scalar version.
+ */
+static inline void
+nearestedge ( int mask, int first, float *t, int *best, float *mindist )
+{
+	int i;
+
+	for(i=0;mask;i++,mask>>=1)
+	{
+		if(!(mask&1))
+			continue;
+		if(*best < 0 || t[i] < *mindist)
+		{
+			*mindist = t[i];
+			*best = first+i;
+		}
+	}
+}
+
+/* Four edges at a time. */
+__attribute__((target("sse2"))) int
+intersectedgessse2 ( edgearrays_t *a, vector2d_t *origin, vector2d_t *dir,
+		float *dist )
+{
+	__m128 dx,dy,ox,oy,zero,nx,ny,d,num,t,proj,valid;
+	float times[4] __attribute__((aligned(16)));
+	float mindist=0.0f;
+	int i,mask,best=-1;
+
+	dx = _mm_set1_ps(dir->x);
+	dy = _mm_set1_ps(dir->y);
+	ox = _mm_set1_ps(origin->x);
+	oy = _mm_set1_ps(origin->y);
+	zero = _mm_setzero_ps();
+
+	for(i=0;i<a->count;i+=4)
+	{
+		nx = _mm_load_ps(a->normalx+i);
+		ny = _mm_load_ps(a->normaly+i);
+		d = _mm_add_ps(_mm_mul_ps(dx,nx),_mm_mul_ps(dy,ny));
+		valid = _mm_cmpgt_ps(_mm_mul_ps(d,_mm_load_ps(a->side+i)),zero);
+
+		num = _mm_sub_ps(_mm_load_ps(a->planedist+i),
+				_mm_add_ps(_mm_mul_ps(ox,nx),_mm_mul_ps(oy,ny)));
+		valid = _mm_andnot_ps(_mm_xor_ps(_mm_cmple_ps(num,zero),_mm_cmplt_ps(d,zero)),valid);
+		if(!_mm_movemask_ps(valid))
+			continue;
+
+		t = _mm_div_ps(num,d);
+		proj = _mm_add_ps(
+			_mm_mul_ps(_mm_add_ps(_mm_mul_ps(dx,t),ox),_mm_load_ps(a->linex+i)),
+			_mm_mul_ps(_mm_add_ps(_mm_mul_ps(dy,t),oy),_mm_load_ps(a->liney+i)));
+		valid = _mm_and_ps(valid,_mm_cmpge_ps(proj,_mm_load_ps(a->projmin+i)));
+		valid = _mm_and_ps(valid,_mm_cmple_ps(proj,_mm_load_ps(a->projmax+i)));
+
+		mask = _mm_movemask_ps(valid);
+		if(mask)
+		{
+			_mm_store_ps(times,t);
+			nearestedge(mask,i,times,&best,&mindist);
+		}
+	}
+	*dist = mindist;
+	return best;
+}
+
+/* Four rays at a time, against one edge at a time. */
+__attribute__((target("sse2"))) void
+intersectpacketsse2 ( edgearrays_t *a, vector2d_t *origins, vector2d_t *dirs,
+		int *edges, float *dists )
+{
+	__m128 dx,dy,ox,oy,zero,nx,ny,d,num,t,proj,valid,better,best,found;
+	__m128i bestedge;
+	int i;
+
+	dx = _mm_set_ps(dirs[3].x,dirs[2].x,dirs[1].x,dirs[0].x);
+	dy = _mm_set_ps(dirs[3].y,dirs[2].y,dirs[1].y,dirs[0].y);
+	ox = _mm_set_ps(origins[3].x,origins[2].x,origins[1].x,origins[0].x);
+	oy = _mm_set_ps(origins[3].y,origins[2].y,origins[1].y,origins[0].y);
+	zero = _mm_setzero_ps();
+	best = zero;
+	found = zero;
+	bestedge = _mm_set1_epi32(-1);
+
+	for(i=0;i<a->count;i++)
+	{
+		if(a->side[i] == 0.0f)
+			continue;
+		nx = _mm_set1_ps(a->normalx[i]);
+		ny = _mm_set1_ps(a->normaly[i]);
+		d = _mm_add_ps(_mm_mul_ps(dx,nx),_mm_mul_ps(dy,ny));
+		valid = _mm_cmpgt_ps(_mm_mul_ps(d,_mm_set1_ps(a->side[i])),zero);
+
+		num = _mm_sub_ps(_mm_set1_ps(a->planedist[i]),
+				_mm_add_ps(_mm_mul_ps(ox,nx),_mm_mul_ps(oy,ny)));
+		valid = _mm_andnot_ps(_mm_xor_ps(_mm_cmple_ps(num,zero),_mm_cmplt_ps(d,zero)),valid);
+		if(!_mm_movemask_ps(valid))
+			continue;
+
+		t = _mm_div_ps(num,d);
+		proj = _mm_add_ps(
+			_mm_mul_ps(_mm_add_ps(_mm_mul_ps(dx,t),ox),_mm_set1_ps(a->linex[i])),
+			_mm_mul_ps(_mm_add_ps(_mm_mul_ps(dy,t),oy),_mm_set1_ps(a->liney[i])));
+		valid = _mm_and_ps(valid,_mm_cmpge_ps(proj,_mm_set1_ps(a->projmin[i])));
+		valid = _mm_and_ps(valid,_mm_cmple_ps(proj,_mm_set1_ps(a->projmax[i])));
+
+		/* Take the edge for rays with nothing yet or something further. */
+		better = _mm_and_ps(valid,_mm_or_ps(_mm_cmpeq_ps(found,zero),_mm_cmplt_ps(t,best)));
+		best = _mm_or_ps(_mm_and_ps(better,t),_mm_andnot_ps(better,best));
+		bestedge = _mm_or_si128(_mm_and_si128(_mm_castps_si128(better),_mm_set1_epi32(i)),
+				_mm_andnot_si128(_mm_castps_si128(better),bestedge));
+		found = _mm_or_ps(found,valid);
+	}
+	_mm_storeu_ps(dists,best);
+	_mm_storeu_si128((__m128i*)edges,bestedge);
+}
+
+static int
+sse2supported ( void )
+{
+	return __builtin_cpu_supports("sse2");
+}
+
+static inline __attribute__((target("avx2"))) __m256i
+texelindexavx2 ( texture_t *t, __m256i x, __m256i y, __m128i shift )
+{
+	__m256i mask;
+
+	if(!t->tiled)
+		return _mm256_add_epi32(y,_mm256_sll_epi32(x,shift));
+	mask = _mm256_set1_epi32(TILE_MASK);
+	return _mm256_or_si256(_mm256_or_si256(_mm256_and_si256(y,mask),
+			_mm256_slli_epi32(_mm256_and_si256(x,mask),TILE_BITS)),
+			_mm256_or_si256(_mm256_slli_epi32(_mm256_andnot_si256(mask,y),TILE_BITS),
+			_mm256_sll_epi32(_mm256_andnot_si256(mask,x),shift)));
+}
+
+/* Eight texels at a time with a gather. Each lane gathers 32 bits from a
+ * 16-bit texel address, so it reads one texel past the one it wants;
+ * textures are padded to allow for this.
+ */
+__attribute__((target("avx2"))) void
+drawflooravx2 ( unsigned short *pixel, int step, texture_t *t,
+		int hdirx, int hdiry, int ox, int oy, const int *inv, int n )
+{
+	__m256i hx,hy,vox,voy,wmask,hmask,lowhalf,vinv,tx,ty,index,texels;
+	__m128i shift,packed;
+	unsigned short out[8] __attribute__((aligned(16)));
+	int y,i;
+
+	hx = _mm256_set1_epi32(hdirx);
+	hy = _mm256_set1_epi32(hdiry);
+	vox = _mm256_set1_epi32(ox);
+	voy = _mm256_set1_epi32(oy);
+	wmask = _mm256_set1_epi32(t->widthmaskshift);
+	hmask = _mm256_set1_epi32(t->heightmaskshift);
+	lowhalf = _mm256_set1_epi32(0xffff);
+	shift = _mm_cvtsi32_si128(t->log2height);
+
+	for(y=0;y+8<=n;y+=8)
+	{
+		vinv = _mm256_loadu_si256((const __m256i*)(inv+y));
+		tx = _mm256_and_si256(_mm256_add_epi32(_mm256_mullo_epi32(hx,vinv),vox),wmask);
+		ty = _mm256_and_si256(_mm256_add_epi32(_mm256_mullo_epi32(hy,vinv),voy),hmask);
+		index = texelindexavx2(t,_mm256_srli_epi32(tx,DOUBLE_PRECISION_BITS),
+				_mm256_srli_epi32(ty,DOUBLE_PRECISION_BITS),shift);
+
+		texels = _mm256_i32gather_epi32((const int*)t->pixels,index,2);
+		texels = _mm256_and_si256(texels,lowhalf);
+
+		/* Pack to 16 bits; packus works within each 128-bit lane. */
+		texels = _mm256_packus_epi32(texels,texels);
+		texels = _mm256_permute4x64_epi64(texels,_MM_SHUFFLE(3,1,2,0));
+		packed = _mm256_castsi256_si128(texels);
+
+		if(step == 1)
+			_mm_storeu_si128((__m128i*)pixel,packed);
+		else
+		{
+			_mm_store_si128((__m128i*)out,packed);
+			for(i=0;i<8;i++)
+				pixel[i*step] = out[i];
+		}
+		pixel += 8*step;
+	}
+	drawfloorscalar(pixel,step,t,hdirx,hdiry,ox,oy,inv+y,n-y);
+}
+
+/* With 32-bit texels the gather loads exactly the texels wanted and they
+ * go to the frame as they are, with no masking or packing.
+ */
+__attribute__((target("avx2"))) void
+drawfloor32avx2 ( unsigned int *pixel, int step, texture_t *t,
+		int hdirx, int hdiry, int ox, int oy, const int *inv, int n )
+{
+	__m256i hx,hy,vox,voy,wmask,hmask,vinv,tx,ty,index,texels;
+	__m128i shift;
+	unsigned int out[8] __attribute__((aligned(32)));
+	int y,i;
+
+	hx = _mm256_set1_epi32(hdirx);
+	hy = _mm256_set1_epi32(hdiry);
+	vox = _mm256_set1_epi32(ox);
+	voy = _mm256_set1_epi32(oy);
+	wmask = _mm256_set1_epi32(t->widthmaskshift);
+	hmask = _mm256_set1_epi32(t->heightmaskshift);
+	shift = _mm_cvtsi32_si128(t->log2height);
+
+	for(y=0;y+8<=n;y+=8)
+	{
+		vinv = _mm256_loadu_si256((const __m256i*)(inv+y));
+		tx = _mm256_and_si256(_mm256_add_epi32(_mm256_mullo_epi32(hx,vinv),vox),wmask);
+		ty = _mm256_and_si256(_mm256_add_epi32(_mm256_mullo_epi32(hy,vinv),voy),hmask);
+		index = texelindexavx2(t,_mm256_srli_epi32(tx,DOUBLE_PRECISION_BITS),
+				_mm256_srli_epi32(ty,DOUBLE_PRECISION_BITS),shift);
+
+		texels = _mm256_i32gather_epi32((const int*)t->pixels,index,4);
+
+		if(step == 1)
+			_mm256_storeu_si256((__m256i*)pixel,texels);
+		else
+		{
+			_mm256_store_si256((__m256i*)out,texels);
+			for(i=0;i<8;i++)
+				pixel[i*step] = out[i];
+		}
+		pixel += 8*step;
+	}
+	drawfloor32scalar(pixel,step,t,hdirx,hdiry,ox,oy,inv+y,n-y);
+}
+
+/* Eight edges at a time. */
+__attribute__((target("avx2"))) int
+intersectedgesavx2 ( edgearrays_t *a, vector2d_t *origin, vector2d_t *dir,
+		float *dist )
+{
+	__m256 dx,dy,ox,oy,zero,nx,ny,d,num,t,proj,valid;
+	float times[8] __attribute__((aligned(32)));
+	float mindist=0.0f;
+	int i,mask,best=-1;
+
+	dx = _mm256_set1_ps(dir->x);
+	dy = _mm256_set1_ps(dir->y);
+	ox = _mm256_set1_ps(origin->x);
+	oy = _mm256_set1_ps(origin->y);
+	zero = _mm256_setzero_ps();
+
+	for(i=0;i<a->count;i+=8)
+	{
+		nx = _mm256_load_ps(a->normalx+i);
+		ny = _mm256_load_ps(a->normaly+i);
+		d = _mm256_add_ps(_mm256_mul_ps(dx,nx),_mm256_mul_ps(dy,ny));
+		valid = _mm256_cmp_ps(_mm256_mul_ps(d,_mm256_load_ps(a->side+i)),zero,_CMP_GT_OQ);
+
+		num = _mm256_sub_ps(_mm256_load_ps(a->planedist+i),
+				_mm256_add_ps(_mm256_mul_ps(ox,nx),_mm256_mul_ps(oy,ny)));
+		valid = _mm256_andnot_ps(_mm256_xor_ps(_mm256_cmp_ps(num,zero,_CMP_LE_OQ),
+					_mm256_cmp_ps(d,zero,_CMP_LT_OQ)),valid);
+		if(!_mm256_movemask_ps(valid))
+			continue;
+
+		t = _mm256_div_ps(num,d);
+		proj = _mm256_add_ps(
+			_mm256_mul_ps(_mm256_add_ps(_mm256_mul_ps(dx,t),ox),_mm256_load_ps(a->linex+i)),
+			_mm256_mul_ps(_mm256_add_ps(_mm256_mul_ps(dy,t),oy),_mm256_load_ps(a->liney+i)));
+		valid = _mm256_and_ps(valid,_mm256_cmp_ps(proj,_mm256_load_ps(a->projmin+i),_CMP_GE_OQ));
+		valid = _mm256_and_ps(valid,_mm256_cmp_ps(proj,_mm256_load_ps(a->projmax+i),_CMP_LE_OQ));
+
+		mask = _mm256_movemask_ps(valid);
+		if(mask)
+		{
+			_mm256_store_ps(times,t);
+			nearestedge(mask,i,times,&best,&mindist);
+		}
+	}
+	*dist = mindist;
+	return best;
+}
+
+/* Four rays against two edges at a time: the low half of each register
+ * tests the rays against an even edge and the high half against the odd
+ * edge after it. The halves' nearest edges are merged at the end, the
+ * lower edge winning a tie as it would in intersectedgesscalar.
+ */
+__attribute__((target("avx2"))) void
+intersectpacketavx2 ( edgearrays_t *a, vector2d_t *origins, vector2d_t *dirs,
+		int *edges, float *dists )
+{
+	__m256 dx,dy,ox,oy,zero,nx,ny,side,d,num,t,proj,valid,better,best,found;
+	__m256i bestedge,edge;
+	float times[8] __attribute__((aligned(32)));
+	int hits[8] __attribute__((aligned(32)));
+	int i,j;
+
+	dx = _mm256_setr_ps(dirs[0].x,dirs[1].x,dirs[2].x,dirs[3].x,
+			dirs[0].x,dirs[1].x,dirs[2].x,dirs[3].x);
+	dy = _mm256_setr_ps(dirs[0].y,dirs[1].y,dirs[2].y,dirs[3].y,
+			dirs[0].y,dirs[1].y,dirs[2].y,dirs[3].y);
+	ox = _mm256_setr_ps(origins[0].x,origins[1].x,origins[2].x,origins[3].x,
+			origins[0].x,origins[1].x,origins[2].x,origins[3].x);
+	oy = _mm256_setr_ps(origins[0].y,origins[1].y,origins[2].y,origins[3].y,
+			origins[0].y,origins[1].y,origins[2].y,origins[3].y);
+	zero = _mm256_setzero_ps();
+	best = zero;
+	found = zero;
+	bestedge = _mm256_set1_epi32(-1);
+
+	/* count is a multiple of EDGE_BATCH, so edges come in pairs. */
+	for(i=0;i<a->count;i+=2)
+	{
+		if(a->side[i] == 0.0f && a->side[i+1] == 0.0f)
+			continue;
+		side = _mm256_setr_m128(_mm_set1_ps(a->side[i]),_mm_set1_ps(a->side[i+1]));
+		nx = _mm256_setr_m128(_mm_set1_ps(a->normalx[i]),_mm_set1_ps(a->normalx[i+1]));
+		ny = _mm256_setr_m128(_mm_set1_ps(a->normaly[i]),_mm_set1_ps(a->normaly[i+1]));
+		d = _mm256_add_ps(_mm256_mul_ps(dx,nx),_mm256_mul_ps(dy,ny));
+		valid = _mm256_cmp_ps(_mm256_mul_ps(d,side),zero,_CMP_GT_OQ);
+
+		num = _mm256_sub_ps(_mm256_setr_m128(_mm_set1_ps(a->planedist[i]),
+					_mm_set1_ps(a->planedist[i+1])),
+				_mm256_add_ps(_mm256_mul_ps(ox,nx),_mm256_mul_ps(oy,ny)));
+		valid = _mm256_andnot_ps(_mm256_xor_ps(_mm256_cmp_ps(num,zero,_CMP_LE_OQ),
+					_mm256_cmp_ps(d,zero,_CMP_LT_OQ)),valid);
+		if(!_mm256_movemask_ps(valid))
+			continue;
+
+		t = _mm256_div_ps(num,d);
+		proj = _mm256_add_ps(
+			_mm256_mul_ps(_mm256_add_ps(_mm256_mul_ps(dx,t),ox),
+				_mm256_setr_m128(_mm_set1_ps(a->linex[i]),_mm_set1_ps(a->linex[i+1]))),
+			_mm256_mul_ps(_mm256_add_ps(_mm256_mul_ps(dy,t),oy),
+				_mm256_setr_m128(_mm_set1_ps(a->liney[i]),_mm_set1_ps(a->liney[i+1]))));
+		valid = _mm256_and_ps(valid,_mm256_cmp_ps(proj,_mm256_setr_m128(
+				_mm_set1_ps(a->projmin[i]),_mm_set1_ps(a->projmin[i+1])),_CMP_GE_OQ));
+		valid = _mm256_and_ps(valid,_mm256_cmp_ps(proj,_mm256_setr_m128(
+				_mm_set1_ps(a->projmax[i]),_mm_set1_ps(a->projmax[i+1])),_CMP_LE_OQ));
+
+		/* Take the edge for rays with nothing yet or something further. */
+		better = _mm256_and_ps(valid,_mm256_or_ps(_mm256_cmp_ps(found,zero,_CMP_EQ_OQ),
+				_mm256_cmp_ps(t,best,_CMP_LT_OQ)));
+		best = _mm256_blendv_ps(best,t,better);
+		edge = _mm256_setr_m128i(_mm_set1_epi32(i),_mm_set1_epi32(i+1));
+		bestedge = _mm256_blendv_epi8(bestedge,edge,_mm256_castps_si256(better));
+		found = _mm256_or_ps(found,valid);
+	}
+
+	_mm256_store_ps(times,best);
+	_mm256_store_si256((__m256i*)hits,bestedge);
+	for(j=0;j<PACKET_SIZE;j++)
+	{
+		if(hits[j+4] >= 0 && (hits[j] < 0 || times[j+4] < times[j] ||
+				(times[j+4] == times[j] && hits[j+4] < hits[j])))
+		{
+			edges[j] = hits[j+4];
+			dists[j] = times[j+4];
+		} else
+		{
+			edges[j] = hits[j];
+			dists[j] = times[j];
+		}
+	}
+}
+
+static int
+avx2supported ( void )
+{
+	return __builtin_cpu_supports("avx2");
+}
+
+#endif
+
+/* Best first. */
+static kernel_t kernels[] =
+{
+#ifdef X86_KERNELS
+	{"avx2",drawflooravx2,drawfloor32avx2,intersectedgesavx2,intersectpacketavx2,
+			avx2supported},
+	{"sse2",drawfloorsse2,drawfloor32sse2,intersectedgessse2,intersectpacketsse2,
+			sse2supported},
+#endif
+	{"scalar",drawfloorscalar,drawfloor32scalar,intersectedgesscalar,intersectpacketscalar,
+			alwayssupported},
+	{NULL,NULL,NULL,NULL,NULL,NULL}
+};
+
+floorkernel_t floorkernel=drawfloorscalar;
+floorkernel32_t floorkernel32=drawfloor32scalar;
+edgekernel_t edgekernel=intersectedgesscalar;
+packetkernel_t packetkernel=intersectpacketscalar;
+
+/* selectkernels
+ *
+ * Use the kernels called name, or the best the CPU supports if name is
+ * NULL. Returns the name of the kernels in use.
+ */
+char *
+selectkernels ( char *name )
+{
+	kernel_t *k;
+
+#ifdef X86_KERNELS
+	__builtin_cpu_init();
+#endif
+	for(k=kernels;k->name;k++)
+	{
+		if(name ? strcmp(name,k->name) != 0 : !k->supported())
+			continue;
+		if(!k->supported())
+		{
+			fprintf(stderr,"%s kernels are not supported on this CPU, using scalar\n",name);
+			break;
+		}
+		floorkernel = k->drawfloor;
+		floorkernel32 = k->drawfloor32;
+		edgekernel = k->intersectedges;
+		packetkernel = k->intersectpacket;
+		return k->name;
+	}
+	if(!k->name)
+		fprintf(stderr,"No kernels called %s, using scalar\n",name);
+	floorkernel = drawfloorscalar;
+	floorkernel32 = drawfloor32scalar;
+	edgekernel = intersectedgesscalar;
+	packetkernel = intersectpacketscalar;
+	return "scalar";
+}
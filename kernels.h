@@ -0,0 +1,67 @@
+/*
+ * Copyright (C) Matthew Earl
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+#ifndef _KERNELS_H_
+#define _KERNELS_H_
+
+#include "raycaster.h"
+
+/* Draw n pixels of a floor or ceiling down a column, starting at pixel and
+ * moving step pixels each time. inv holds invpixeltogradint for each row.
+ * Texture coordinates are (hdir*inv+o) in DOUBLE_PRECISION_BITS fixed point.
+ */
+typedef void (*floorkernel_t) ( unsigned short *pixel, int step, texture_t *t,
+		int hdirx, int hdiry, int ox, int oy, const int *inv, int n );
+typedef void (*floorkernel32_t) ( unsigned int *pixel, int step, texture_t *t,
+		int hdirx, int hdiry, int ox, int oy, const int *inv, int n );
+
+/* Find the nearest edge in a through which the ray origin+t*dir leaves
+ * the platform. Returns its index and sets *dist to t, or returns -1.
+ */
+typedef int (*edgekernel_t) ( edgearrays_t *a, vector2d_t *origin,
+		vector2d_t *dir, float *dist );
+
+/* The same for PACKET_SIZE rays at once, each with its own origin. Sets
+ * edges[i] to -1 for rays that leave through no edge.
+ */
+typedef void (*packetkernel_t) ( edgearrays_t *a, vector2d_t *origins,
+		vector2d_t *dirs, int *edges, float *dists );
+
+typedef struct kernel_s
+{
+	char *name;
+	floorkernel_t drawfloor;
+	floorkernel32_t drawfloor32;
+	edgekernel_t intersectedges;
+	packetkernel_t intersectpacket;
+	int (*supported) ( void );
+} kernel_t;
+
+/* The vector kernels may read one texel past the end of a texture. */
+#define TEXTURE_PADDING	1
+
+extern floorkernel_t floorkernel;
+extern floorkernel32_t floorkernel32;
+extern edgekernel_t edgekernel;
+extern packetkernel_t packetkernel;
+
+char *selectkernels ( char *name );
+int exitsthroughedge ( edgearrays_t *a, int i, vector2d_t *origin,
+		vector2d_t *dir, float margin, float *dist );
+
+#endif
@@ -0,0 +1,433 @@
+/*
+ * Copyright (C) Matthew Earl
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+/* Turning a level file into a level_t, and back again.
+ *
+ * A level straight from an editor has only its vertices, edges, platforms
+ * and heights; the edges' directions, the heights adjusted to cut
+ * overdraw, the potentially visible sets and the grid are all worked out
+ * here. lvlc saves the lot, so that levels it has written need none of
+ * that work when they are loaded.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "level.h"
+#include "pvs.h"
+#include "grid.h"
+
+#define CONVEX_EPSILON	0.001f
+
+static void
+convertedge ( level_t *l, lvledge_t *le, lvledgegeom_t *lg, edge_t *e )
+{
+	int i;
+	
+	e->texture = NULL;
+	for(i=0;i<2;i++)
+		e->verts[i] = &l->verts[le->verts[i]];
+	if(le->leftplat == l->numplatforms)
+		e->leftplat = &l->infplatform;
+	else
+		e->leftplat = &l->platforms[le->leftplat];
+		
+	if(le->rightplat == l->numplatforms)
+		e->rightplat = &l->infplatform;
+	else
+		e->rightplat = &l->platforms[le->rightplat];
+
+	if(lg)
+	{
+		e->line.x = lg->linex;
+		e->line.y = lg->liney;
+		e->normal.x = lg->normalx;
+		e->normal.y = lg->normaly;
+		e->planedist = lg->planedist;
+		return;
+	}
+	vectorsubtract(&e->verts[1]->pos,&e->verts[0]->pos,&e->line);
+	vectornormalise(&e->line,&e->line);
+	vectorrot90(&e->line,&e->normal);
+	e->planedist = dotproduct(&e->normal,&e->verts[0]->pos);
+}
+
+static void
+convertvert ( level_t *l, lvlvert_t *lv, vert_t *v )
+{
+	v->pos.x = lv->x;
+	v->pos.y = lv->y;
+	v->numedges = lv->numedges;
+	v->edges = &l->edgerefs[lv->firstedge];
+}
+
+/* The edge arrays of a platform of numedges edges are padded to a whole
+ * number of batches.
+ */
+static int
+edgearraycount ( int numedges )
+{
+	return (numedges+EDGE_BATCH-1)/EDGE_BATCH*EDGE_BATCH;
+}
+
+/* buildedgearrays
+ *
+ * Copy what edgeintersect needs to know about each of the platform's
+ * edges into the platform's edge arrays, which are laid out from *data
+ * on, and, if findconvex is set, note whether the platform is convex.
+ * *data is left after the arrays.
+ */
+static void
+buildedgearrays ( platform_t *p, float **data, int findconvex )
+{
+	edgearrays_t *a=&p->edgearrays;
+	edge_t *e;
+	vector2d_t *v;
+	float p0,p1;
+	int i,j,k,n;
+
+	n = edgearraycount(p->numedges);
+	a->count = n;
+	a->data = *data;
+	*data += 8*n;
+	a->normalx = a->data;
+	a->normaly = a->data+n;
+	a->linex = a->data+2*n;
+	a->liney = a->data+3*n;
+	a->planedist = a->data+4*n;
+	a->projmin = a->data+5*n;
+	a->projmax = a->data+6*n;
+	a->side = a->data+7*n;
+
+	for(i=0;i<p->numedges;i++)
+	{
+		e = p->edges[i];
+		a->normalx[i] = e->normal.x;
+		a->normaly[i] = e->normal.y;
+		a->linex[i] = e->line.x;
+		a->liney[i] = e->line.y;
+		a->planedist[i] = dotproduct(&e->verts[0]->pos,&e->normal);
+		p0 = dotproduct(&e->verts[0]->pos,&e->line);
+		p1 = dotproduct(&e->verts[1]->pos,&e->line);
+		a->projmin[i] = p0 < p1 ? p0 : p1;
+		a->projmax[i] = p0 < p1 ? p1 : p0;
+		if(e->leftplat != p)
+			a->side[i] = -1.0f;
+		else if(e->rightplat != p)
+			a->side[i] = 1.0f;
+		else
+			printf("Edge %i of platform has it on both sides\n",i);
+	}
+	if(!findconvex)
+		return;
+
+	/* Convex if no vertex is in front of any edge. */
+	p->convex = 1;
+	for(i=0;i<p->numedges;i++)
+		for(j=0;j<p->numedges;j++)
+			for(k=0;k<2;k++)
+			{
+				v = &p->edges[j]->verts[k]->pos;
+				if(a->side[i]*(v->x*a->normalx[i] + v->y*a->normaly[i]
+						- a->planedist[i]) > CONVEX_EPSILON)
+					p->convex = 0;
+			}
+}
+
+static void
+convertplatform ( level_t *l, lvlplatform_t *lp, platform_t *p, int baked, float **data )
+{
+	p->ceilheight = lp->ceilheight;
+	p->floorheight = lp->floorheight;
+
+	p->numedges = lp->numedges;
+	p->edges = &l->edgerefs[lp->firstedge];
+	p->texture = NULL;
+	p->allocatedsprites = 0;
+	p->sprites = NULL;
+	p->numsprites = 0;
+	p->convex = lp->convex;
+	buildedgearrays(p,data,!baked);
+}
+
+static void
+optimiseplatform ( level_t *l, platform_t *p )
+{
+	int i,changeceil=1,changefloor=1,firstfloor=1,firstceil=1;
+	platform_t *n; /* Neighbouring platform. */
+	float highest=0.0f,lowest=0.0f;
+
+	/* If the platform's floor is higher than all its neighbours' ceilings then
+	 * set the platform's floor height to the maximum of its neighbours
+	 * ceilings. This is to minimise overdraw.
+	 *
+	 * Do similar if the platform's ceiling is lower than all of its
+	 * neighbours' floors.
+	 */
+	for(i=0;i<p->numedges;i++)
+	{
+		if(p->edges[i]->leftplat != p)
+			n = p->edges[i]->leftplat;
+		else
+			n = p->edges[i]->rightplat;
+		if(p->floorheight > n->ceilheight)
+		{
+			if(firstfloor || n->ceilheight > highest)
+				highest = n->ceilheight;
+			firstfloor = 0;
+		} else 
+		{
+			changefloor = 0;
+		}
+		
+		if(p->ceilheight < n->floorheight)
+		{
+			if(firstceil || n->floorheight < lowest)
+				lowest = n->floorheight;
+			firstceil = 0;
+		} else
+		{
+			changeceil = 0;
+		}
+	}
+	if(changefloor)
+		p->floorheight = highest+1.0f;	
+	if(changeceil)
+		p->ceilheight = lowest-1.0f;
+}
+
+/* The pvs and grid are used where they lie in the file, which the level
+ * then keeps open; nothing writes to them once they are built.
+ */
+static void
+pvsfromimage ( level_t *l, levelimage_t *img )
+{
+	l->pvswords = img->header->pvswords;
+	l->pvs = (unsigned int*)img->pvs;
+}
+
+static void
+gridfromimage ( level_t *l, levelimage_t *img )
+{
+	lvlheader_t *h=img->header;
+
+	l->gridorigin.x = h->gridoriginx;
+	l->gridorigin.y = h->gridoriginy;
+	l->gridcell = h->gridcell;
+	l->gridwidth = h->gridwidth;
+	l->gridheight = h->gridheight;
+	l->gridstart = (int*)img->gridstart;
+	l->gridplatforms = (int*)img->gridplatforms;
+}
+
+/* buildlevel
+ *
+ * Fill in l from a level file, working out whatever the file does not
+ * hold. The indices in the file become pointers, and the platforms' and
+ * vertices' lists of edges all share one array, in the order of the
+ * file's edge index table. The edges, platforms, vertices, that array
+ * and the platforms' edge arrays are all carved from l->block. Textures
+ * are left for the caller. The pvs and grid are worked out on pool, if
+ * the file does not hold them, only where flags asks for them; if it
+ * does, l takes img over, leaving the caller's closelevelimage nothing
+ * to do, and freelevel closes it.
+ */
+int
+buildlevel ( level_t *l, levelimage_t *img, threadpool_t *pool, int flags )
+{
+	lvlheader_t *h=img->header;
+	float *data;
+	size_t floats,size;
+	int i,baked=h->flags & LEVEL_BAKED;
+
+	l->numedges = h->numedges;
+	l->numplatforms = h->numplatforms;
+	l->numverts = h->numverts;
+	l->numedgerefs = h->numedgerefs;
+	l->size.x = h->sizex;
+	l->size.y = h->sizey;
+	
+	memset(&l->image,0,sizeof(l->image));
+
+	/* The edge arrays go first, as the edge kernels need them aligned;
+	 * each platform's take up whole batches, so whatever follows is
+	 * aligned too.
+	 */
+	floats = 0;
+	for(i=0;i<=l->numplatforms;i++)
+		floats += 8*edgearraycount(img->platforms[i].numedges);
+	size = sizeof(float)*floats + sizeof(edge_t)*l->numedges
+		+ sizeof(platform_t)*l->numplatforms + sizeof(vert_t)*l->numverts
+		+ sizeof(edge_t*)*l->numedgerefs;
+	if(posix_memalign(&l->block,sizeof(float)*EDGE_BATCH,size))
+	{
+		l->block = NULL;
+		fprintf(stderr,"Could not allocate level\n");
+		return 0;
+	}
+	memset(l->block,0,sizeof(float)*floats);
+	data = (float*)l->block;
+	l->edges = (edge_t*)(data+floats);
+	l->platforms = (platform_t*)(l->edges+l->numedges);
+	l->verts = (vert_t*)(l->platforms+l->numplatforms);
+	l->edgerefs = (edge_t**)(l->verts+l->numverts);
+
+	for(i=0;i<l->numedgerefs;i++)
+		l->edgerefs[i] = &l->edges[img->edgerefs[i]];
+	for(i=0;i<l->numverts;i++)
+		convertvert(l,&img->verts[i],&l->verts[i]);	
+	for(i=0;i<l->numedges;i++)
+		convertedge(l,&img->edges[i],baked ? &img->edgegeom[i] : NULL,&l->edges[i]);
+	for(i=0;i<l->numplatforms;i++)
+		convertplatform(l,&img->platforms[i],&l->platforms[i],baked,&data);	
+	convertplatform(l,&img->platforms[l->numplatforms],&l->infplatform,baked,&data);
+
+	if(!baked)
+	{
+		for(i=0;i<l->numplatforms;i++)
+			optimiseplatform(l,&l->platforms[i]);	
+		optimiseplatform(l,&l->infplatform);
+	}
+
+	if(h->flags & LEVEL_PVS)
+		pvsfromimage(l,img);
+	else if(flags & LEVEL_PVS)
+		buildpvs(l,pool,PVS_BUDGET);
+	if(h->flags & LEVEL_GRID)
+		gridfromimage(l,img);
+	else if(flags & LEVEL_GRID)
+		buildgrid(l);
+
+	if(h->flags & (LEVEL_PVS|LEVEL_GRID))
+	{
+		l->image = *img;
+		img->data = NULL;
+		img->header = NULL;
+	}
+	return 1;
+}
+
+void
+freelevel ( level_t *l )
+{
+	/* Only what was worked out at load was allocated. */
+	if(l->image.data)
+	{
+		if(l->image.header->flags & LEVEL_PVS)
+			l->pvs = NULL;
+		if(l->image.header->flags & LEVEL_GRID)
+		{
+			l->gridstart = NULL;
+			l->gridplatforms = NULL;
+		}
+	}
+	free(l->block);
+	freepvs(l);
+	freegrid(l);
+	closelevelimage(&l->image);
+}
+
+static int
+platformnumber ( level_t *l, platform_t *p )
+{
+	return p == &l->infplatform ? l->numplatforms : (int)(p - l->platforms);
+}
+
+static void
+bakeplatform ( level_t *l, platform_t *p, lvlplatform_t *lp )
+{
+	lp->ceilheight = p->ceilheight;
+	lp->floorheight = p->floorheight;
+	lp->firstedge = p->edges - l->edgerefs;
+	lp->numedges = p->numedges;
+	lp->convex = p->convex;
+}
+
+/* bakelevel
+ *
+ * Write a loaded level into a new image along with everything that was
+ * worked out from it, and the pvs and grid if flags asks for them.
+ */
+int
+bakelevel ( level_t *l, levelimage_t *img, int flags )
+{
+	lvlheader_t counts;
+	edge_t *e;
+	int i,cells=0;
+
+	memset(&counts,0,sizeof(counts));
+	counts.flags = LEVEL_BAKED | (flags & (LEVEL_PVS|LEVEL_GRID));
+	if(!l->pvs)
+		counts.flags &= ~LEVEL_PVS;
+	if(!l->gridstart)
+		counts.flags &= ~LEVEL_GRID;
+	counts.numverts = l->numverts;
+	counts.numedges = l->numedges;
+	counts.numplatforms = l->numplatforms;
+	counts.numedgerefs = l->numedgerefs;
+	counts.sizex = l->size.x;
+	counts.sizey = l->size.y;
+	if(counts.flags & LEVEL_PVS)
+		counts.pvswords = l->pvswords;
+	if(counts.flags & LEVEL_GRID)
+	{
+		counts.gridoriginx = l->gridorigin.x;
+		counts.gridoriginy = l->gridorigin.y;
+		counts.gridcell = l->gridcell;
+		counts.gridwidth = l->gridwidth;
+		counts.gridheight = l->gridheight;
+		cells = l->gridwidth*l->gridheight;
+		counts.numgridplatforms = l->gridstart[cells];
+	}
+	if(!newlevelimage(img,&counts))
+		return 0;
+
+	for(i=0;i<l->numverts;i++)
+	{
+		img->verts[i].x = l->verts[i].pos.x;
+		img->verts[i].y = l->verts[i].pos.y;
+		img->verts[i].firstedge = l->verts[i].edges - l->edgerefs;
+		img->verts[i].numedges = l->verts[i].numedges;
+	}
+	for(i=0;i<l->numedges;i++)
+	{
+		e = &l->edges[i];
+		img->edges[i].verts[0] = e->verts[0] - l->verts;
+		img->edges[i].verts[1] = e->verts[1] - l->verts;
+		img->edges[i].leftplat = platformnumber(l,e->leftplat);
+		img->edges[i].rightplat = platformnumber(l,e->rightplat);
+		img->edgegeom[i].linex = e->line.x;
+		img->edgegeom[i].liney = e->line.y;
+		img->edgegeom[i].normalx = e->normal.x;
+		img->edgegeom[i].normaly = e->normal.y;
+		img->edgegeom[i].planedist = e->planedist;
+	}
+	for(i=0;i<l->numplatforms;i++)
+		bakeplatform(l,&l->platforms[i],&img->platforms[i]);
+	bakeplatform(l,&l->infplatform,&img->platforms[l->numplatforms]);
+	for(i=0;i<l->numedgerefs;i++)
+		img->edgerefs[i] = l->edgerefs[i] - l->edges;
+
+	if(counts.flags & LEVEL_PVS)
+		memcpy(img->pvs,l->pvs,sizeof(unsigned int)*(l->numplatforms+1)*l->pvswords);
+	if(counts.flags & LEVEL_GRID)
+	{
+		memcpy(img->gridstart,l->gridstart,sizeof(int)*(cells+1));
+		memcpy(img->gridplatforms,l->gridplatforms,sizeof(int)*counts.numgridplatforms);
+	}
+	return 1;
+}
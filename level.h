@@ -0,0 +1,29 @@
+/*
+ * Copyright (C) Matthew Earl
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+#ifndef _LEVEL_H_
+#define _LEVEL_H_
+
+#include "raycaster.h"
+#include "levelfile.h"
+
+int buildlevel ( level_t *l, levelimage_t *img, threadpool_t *pool, int flags );
+void freelevel ( level_t *l );
+int bakelevel ( level_t *l, levelimage_t *img, int flags );
+
+#endif
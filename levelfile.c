@@ -0,0 +1,505 @@
+/*
+ * Copyright (C) Matthew Earl
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+/* Reading and writing level files. Files in the current format are mapped
+ * and checked, and then used in place; files in the original format, which
+ * were written a structure at a time, are rearranged into the same layout
+ * in memory so that the rest of the loader only sees the one kind.
+ */
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "levelfile.h"
+
+/* The original format: a header, the edges, each platform followed by its
+ * edge indices, the edge indices of the platform outside the level, and
+ * each vertex followed by its edge indices.
+ */
+typedef struct v1platform_s
+{
+	float ceilheight,floorheight;
+	int32_t numedges;
+	uint32_t dummy;
+} v1platform_t;
+
+typedef struct v1header_s
+{
+	int32_t numedges;
+	uint32_t dummy1;
+	int32_t numplatforms;
+	uint32_t dummy2;
+	v1platform_t infplatform;
+	int32_t numverts;
+	uint32_t dummy3;
+	float sizex,sizey;
+} v1header_t;
+
+typedef struct v1edge_s
+{
+	int32_t vertrefs[2];
+	int32_t leftplatref,rightplatref;	/* -1 for outside the level */
+} v1edge_t;
+
+typedef struct v1vert_s
+{
+	float x,y;
+	int32_t numedges;
+	uint32_t dummy;
+} v1vert_t;
+
+static uint32_t
+alignoffset ( uint32_t offset )
+{
+	return (offset+LEVEL_ALIGN-1) & ~(LEVEL_ALIGN-1);
+}
+
+/* Point the image's sections at where the header says they are. */
+static void
+findsections ( levelimage_t *img )
+{
+	char *base=(char*)img->data;
+	lvlheader_t *h;
+
+	img->header = h = (lvlheader_t*)base;
+	img->verts = (lvlvert_t*)(base+h->vertoffset);
+	img->edges = (lvledge_t*)(base+h->edgeoffset);
+	img->platforms = (lvlplatform_t*)(base+h->platformoffset);
+	img->edgerefs = (int32_t*)(base+h->edgerefoffset);
+	img->edgegeom = h->flags & LEVEL_BAKED ? (lvledgegeom_t*)(base+h->edgegeomoffset) : NULL;
+	img->pvs = h->flags & LEVEL_PVS ? (uint32_t*)(base+h->pvsoffset) : NULL;
+	img->gridstart = h->flags & LEVEL_GRID ? (int32_t*)(base+h->gridstartoffset) : NULL;
+	img->gridplatforms = h->flags & LEVEL_GRID ?
+			(int32_t*)(base+h->gridplatformoffset) : NULL;
+}
+
+/* Place a section of size bytes at *end, moving *end past it. */
+static uint32_t
+placesection ( uint32_t *end, uint64_t size )
+{
+	uint32_t offset=*end;
+
+	*end = alignoffset(offset+size);
+	return offset;
+}
+
+/* newlevelimage
+ *
+ * Allocate a zeroed image laid out for the counts, flags and sizes given
+ * in counts, which is copied to its header.
+ */
+int
+newlevelimage ( levelimage_t *img, lvlheader_t *counts )
+{
+	lvlheader_t h=*counts;
+	uint32_t end;
+
+	h.magic = LEVEL_MAGIC;
+	h.version = LEVEL_VERSION;
+	end = alignoffset(sizeof(lvlheader_t));
+	h.vertoffset = placesection(&end,sizeof(lvlvert_t)*(uint64_t)h.numverts);
+	h.edgeoffset = placesection(&end,sizeof(lvledge_t)*(uint64_t)h.numedges);
+	h.platformoffset = placesection(&end,
+			sizeof(lvlplatform_t)*((uint64_t)h.numplatforms+1));
+	h.edgerefoffset = placesection(&end,sizeof(int32_t)*(uint64_t)h.numedgerefs);
+	h.edgegeomoffset = h.pvsoffset = h.gridstartoffset = h.gridplatformoffset = 0;
+	if(h.flags & LEVEL_BAKED)
+		h.edgegeomoffset = placesection(&end,
+				sizeof(lvledgegeom_t)*(uint64_t)h.numedges);
+	if(h.flags & LEVEL_PVS)
+		h.pvsoffset = placesection(&end,sizeof(uint32_t)*
+				((uint64_t)h.numplatforms+1)*h.pvswords);
+	if(h.flags & LEVEL_GRID)
+	{
+		h.gridstartoffset = placesection(&end,sizeof(int32_t)*
+				((uint64_t)h.gridwidth*h.gridheight+1));
+		h.gridplatformoffset = placesection(&end,
+				sizeof(int32_t)*(uint64_t)h.numgridplatforms);
+	}
+	h.filesize = end;
+
+	img->size = h.filesize;
+	img->mapped = 0;
+	img->data = calloc(1,img->size);
+	if(!img->data)
+		return 0;
+	memcpy(img->data,&h,sizeof(h));
+	findsections(img);
+	return 1;
+}
+
+/* Whether count entries of size bytes at offset are aligned and lie
+ * inside the file.
+ */
+static int
+sectionfits ( lvlheader_t *h, uint32_t offset, size_t size, int64_t count )
+{
+	return !(offset % LEVEL_ALIGN) && count >= 0 &&
+			offset + size*(uint64_t)count <= h->filesize;
+}
+
+/* Check that every section lies inside the file and that every index is in
+ * range, so that nothing read from the file can lead outside it.
+ */
+static int
+checkimage ( levelimage_t *img, char *filename )
+{
+	lvlheader_t *h=img->header;
+	int64_t cells=0;
+	int i,j;
+
+	if(h->flags & LEVEL_GRID)
+		cells = (int64_t)h->gridwidth*h->gridheight;
+	if(img->size < sizeof(lvlheader_t) || h->filesize > img->size ||
+			h->numverts < 0 || h->numedges < 0 || h->numplatforms < 0 ||
+			h->numedgerefs < 0 ||
+			!sectionfits(h,h->vertoffset,sizeof(lvlvert_t),h->numverts) ||
+			!sectionfits(h,h->edgeoffset,sizeof(lvledge_t),h->numedges) ||
+			!sectionfits(h,h->platformoffset,sizeof(lvlplatform_t),
+				(int64_t)h->numplatforms+1) ||
+			!sectionfits(h,h->edgerefoffset,sizeof(int32_t),h->numedgerefs) ||
+			(h->flags & LEVEL_BAKED &&
+				!sectionfits(h,h->edgegeomoffset,sizeof(lvledgegeom_t),
+					h->numedges)) ||
+			(h->flags & LEVEL_PVS &&
+				(h->pvswords != (h->numplatforms+32)/32 ||
+				!sectionfits(h,h->pvsoffset,sizeof(uint32_t),
+					((int64_t)h->numplatforms+1)*h->pvswords))) ||
+			(h->flags & LEVEL_GRID &&
+				(h->gridwidth < 0 || h->gridheight < 0 ||
+				h->numgridplatforms < 0 ||
+				!sectionfits(h,h->gridstartoffset,sizeof(int32_t),cells+1) ||
+				!sectionfits(h,h->gridplatformoffset,sizeof(int32_t),
+					h->numgridplatforms))))
+	{
+		fprintf(stderr,"%s: sections do not fit in the file\n",filename);
+		return 0;
+	}
+
+	for(i=0;i<h->numverts;i++)
+	{
+		if(img->verts[i].firstedge < 0 || img->verts[i].numedges < 0 ||
+				img->verts[i].firstedge > h->numedgerefs - img->verts[i].numedges)
+		{
+			fprintf(stderr,"%s: vertex %i has bad edges\n",filename,i);
+			return 0;
+		}
+	}
+	for(i=0;i<h->numedges;i++)
+	{
+		for(j=0;j<2;j++)
+		{
+			if(img->edges[i].verts[j] < 0 || img->edges[i].verts[j] >= h->numverts)
+			{
+				fprintf(stderr,"%s: edge %i has a bad vertex\n",filename,i);
+				return 0;
+			}
+		}
+		if(img->edges[i].leftplat < 0 || img->edges[i].leftplat > h->numplatforms ||
+				img->edges[i].rightplat < 0 ||
+				img->edges[i].rightplat > h->numplatforms)
+		{
+			fprintf(stderr,"%s: edge %i has a bad platform\n",filename,i);
+			return 0;
+		}
+	}
+	for(i=0;i<=h->numplatforms;i++)
+	{
+		if(img->platforms[i].firstedge < 0 || img->platforms[i].numedges < 1 ||
+				img->platforms[i].firstedge >
+					h->numedgerefs - img->platforms[i].numedges)
+		{
+			fprintf(stderr,"%s: platform %i has bad edges\n",filename,i);
+			return 0;
+		}
+	}
+	for(i=0;i<h->numedgerefs;i++)
+	{
+		if(img->edgerefs[i] < 0 || img->edgerefs[i] >= h->numedges)
+		{
+			fprintf(stderr,"%s: bad edge index %i\n",filename,i);
+			return 0;
+		}
+	}
+
+	if(h->flags & LEVEL_GRID)
+	{
+		if(img->gridstart[0] != 0 || img->gridstart[cells] != h->numgridplatforms)
+		{
+			fprintf(stderr,"%s: bad grid\n",filename);
+			return 0;
+		}
+		for(i=0;i<cells;i++)
+		{
+			if(img->gridstart[i+1] < img->gridstart[i])
+			{
+				fprintf(stderr,"%s: bad grid cell %i\n",filename,i);
+				return 0;
+			}
+		}
+		for(i=0;i<h->numgridplatforms;i++)
+		{
+			if(img->gridplatforms[i] < 0 || img->gridplatforms[i] >= h->numplatforms)
+			{
+				fprintf(stderr,"%s: bad grid platform %i\n",filename,i);
+				return 0;
+			}
+		}
+	}
+	return 1;
+}
+
+/* Take the edge indices following a platform or vertex in a version 1
+ * file, returning the position after them or NULL if they run off the end.
+ */
+static char *
+readv1edgerefs ( char *p, char *end, int numedges, levelimage_t *img,
+		int32_t *fill, int32_t *first )
+{
+	if(numedges < 0 || (size_t)(end-p) < sizeof(int32_t)*(size_t)numedges)
+		return NULL;
+	if(img)
+	{
+		*first = *fill;
+		memcpy(&img->edgerefs[*fill],p,sizeof(int32_t)*numedges);
+	}
+	*fill += numedges;
+	return p + sizeof(int32_t)*numedges;
+}
+
+/* Walk a version 1 file, counting the edge indices if img is NULL and
+ * otherwise filling in img, which has room for them.
+ */
+static int
+walkv1 ( char *data, size_t size, levelimage_t *img, int *numedgerefs )
+{
+	v1header_t h;
+	v1edge_t e;
+	v1platform_t pl;
+	v1vert_t v;
+	char *p=data,*end=data+size;
+	int32_t fill=0,first=0;
+	int i,outside;
+
+	if(size < sizeof(h))
+		return 0;
+	memcpy(&h,p,sizeof(h));
+	p += sizeof(h);
+	if(h.numedges < 0 || h.numplatforms < 0 || h.numverts < 0 ||
+			(size_t)(end-p) < sizeof(v1edge_t)*(size_t)h.numedges)
+		return 0;
+	outside = h.numplatforms;
+
+	if(img)
+	{
+		img->header->sizex = h.sizex;
+		img->header->sizey = h.sizey;
+	}
+	for(i=0;i<h.numedges;i++,p+=sizeof(e))
+	{
+		if(!img)
+			continue;
+		memcpy(&e,p,sizeof(e));
+		img->edges[i].verts[0] = e.vertrefs[0];
+		img->edges[i].verts[1] = e.vertrefs[1];
+		img->edges[i].leftplat = e.leftplatref == -1 ? outside : e.leftplatref;
+		img->edges[i].rightplat = e.rightplatref == -1 ? outside : e.rightplatref;
+	}
+
+	for(i=0;i<h.numplatforms;i++)
+	{
+		if((size_t)(end-p) < sizeof(pl))
+			return 0;
+		memcpy(&pl,p,sizeof(pl));
+		p = readv1edgerefs(p+sizeof(pl),end,pl.numedges,img,&fill,&first);
+		if(!p)
+			return 0;
+		if(img)
+		{
+			img->platforms[i].ceilheight = pl.ceilheight;
+			img->platforms[i].floorheight = pl.floorheight;
+			img->platforms[i].firstedge = first;
+			img->platforms[i].numedges = pl.numedges;
+		}
+	}
+
+	p = readv1edgerefs(p,end,h.infplatform.numedges,img,&fill,&first);
+	if(!p)
+		return 0;
+	if(img)
+	{
+		img->platforms[outside].ceilheight = h.infplatform.ceilheight;
+		img->platforms[outside].floorheight = h.infplatform.floorheight;
+		img->platforms[outside].firstedge = first;
+		img->platforms[outside].numedges = h.infplatform.numedges;
+	}
+
+	for(i=0;i<h.numverts;i++)
+	{
+		if((size_t)(end-p) < sizeof(v))
+			return 0;
+		memcpy(&v,p,sizeof(v));
+		p = readv1edgerefs(p+sizeof(v),end,v.numedges,img,&fill,&first);
+		if(!p)
+			return 0;
+		if(img)
+		{
+			img->verts[i].x = v.x;
+			img->verts[i].y = v.y;
+			img->verts[i].firstedge = first;
+			img->verts[i].numedges = v.numedges;
+		}
+	}
+
+	*numedgerefs = fill;
+	return 1;
+}
+
+static int
+readv1 ( levelimage_t *img, char *data, size_t size, char *filename )
+{
+	v1header_t h;
+	lvlheader_t counts;
+	int numedgerefs;
+
+	if(!walkv1(data,size,NULL,&numedgerefs))
+	{
+		fprintf(stderr,"%s: file is truncated\n",filename);
+		return 0;
+	}
+	memcpy(&h,data,sizeof(h));
+	memset(&counts,0,sizeof(counts));
+	counts.numverts = h.numverts;
+	counts.numedges = h.numedges;
+	counts.numplatforms = h.numplatforms;
+	counts.numedgerefs = numedgerefs;
+	if(!newlevelimage(img,&counts))
+	{
+		fprintf(stderr,"%s: could not allocate level\n",filename);
+		return 0;
+	}
+	walkv1(data,size,img,&numedgerefs);
+	if(!checkimage(img,filename))
+	{
+		closelevelimage(img);
+		return 0;
+	}
+	return 1;
+}
+
+/* openlevelimage
+ *
+ * Map filename and, if it is in the current format, use it in place;
+ * otherwise read it as a version 1 file.
+ */
+int
+openlevelimage ( levelimage_t *img, char *filename )
+{
+	struct stat st;
+	void *data;
+	int fd,ok;
+
+	memset(img,0,sizeof(levelimage_t));
+	fd = open(filename,O_RDONLY);
+	if(fd < 0)
+	{
+		printf("Could not open file %s\n", filename);
+		return 0;
+	}
+	if(fstat(fd,&st) || st.st_size < (off_t)sizeof(uint32_t))
+	{
+		fprintf(stderr,"%s: not a level\n",filename);
+		close(fd);
+		return 0;
+	}
+	data = mmap(NULL,st.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+	close(fd);
+	if(data == MAP_FAILED)
+	{
+		perror(filename);
+		return 0;
+	}
+
+	if(*(uint32_t*)data == LEVEL_MAGIC)
+	{
+		if(st.st_size < (off_t)sizeof(lvlheader_t))
+		{
+			fprintf(stderr,"%s: file is truncated\n",filename);
+			munmap(data,st.st_size);
+			return 0;
+		}
+		img->data = data;
+		img->size = st.st_size;
+		img->mapped = 1;
+		findsections(img);
+		if(img->header->version != LEVEL_VERSION)
+		{
+			fprintf(stderr,"%s: level version %u, expected %u; rebuild it with lvlc\n",
+				filename,img->header->version,LEVEL_VERSION);
+			closelevelimage(img);
+			return 0;
+		}
+		if(!checkimage(img,filename))
+		{
+			closelevelimage(img);
+			return 0;
+		}
+		return 1;
+	}
+
+	ok = readv1(img,(char*)data,st.st_size,filename);
+	munmap(data,st.st_size);
+	return ok;
+}
+
+int
+writelevelimage ( levelimage_t *img, char *filename )
+{
+	FILE *f;
+	size_t written;
+
+	f = fopen(filename,"wb");
+	if(!f)
+	{
+		perror(filename);
+		return 0;
+	}
+	written = fwrite(img->data,1,img->header->filesize,f);
+	if(fclose(f) || written != img->header->filesize)
+	{
+		fprintf(stderr,"%s: write failed\n",filename);
+		return 0;
+	}
+	return 1;
+}
+
+void
+closelevelimage ( levelimage_t *img )
+{
+	if(!img->data)
+		return;
+	if(img->mapped)
+		munmap(img->data,img->size);
+	else
+		free(img->data);
+	img->data = NULL;
+	img->header = NULL;
+}
@@ -0,0 +1,130 @@
+/*
+ * Copyright (C) Matthew Earl
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+#ifndef _LEVELFILE_H_
+#define _LEVELFILE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Current level files are laid out so that they can be mapped and used
+ * where they lie. A header gives the byte offset of each section from the
+ * start of the file, and everything refers to everything else by index:
+ * vertices and edges of edges, platforms of edges, and edges of platforms
+ * and vertices through one shared table of edge indices. The platform
+ * section has numplatforms+1 entries, the last being the platform outside
+ * the level. Every field is 32 bits, little endian.
+ *
+ * Files written by lvlc also hold what the game would otherwise work out
+ * at startup, as flagged in the header.
+ *
+ * The magic only marks a file as being in this mappable family, which
+ * started at version 2, and stays the same as the layout changes. The
+ * version field is what decides whether a file can be read.
+ */
+#define LEVEL_MAGIC		0x324c5652	/* "RVL2" */
+#define LEVEL_VERSION		3
+#define LEVEL_ALIGN		8	/* alignment of each section */
+
+#define LEVEL_BAKED	1	/* edge geometry, final heights, convexity */
+#define LEVEL_PVS	2	/* potentially visible sets */
+#define LEVEL_GRID	4	/* grid of platforms */
+
+typedef struct lvlheader_s
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t filesize;
+	uint32_t flags;
+	int32_t numverts;
+	int32_t numedges;
+	int32_t numplatforms;	/* not counting the one outside the level */
+	int32_t numedgerefs;
+	float sizex,sizey;
+	uint32_t vertoffset;
+	uint32_t edgeoffset;
+	uint32_t platformoffset;
+	uint32_t edgerefoffset;
+
+	uint32_t edgegeomoffset;	/* LEVEL_BAKED: numedges lvledgegeom_t */
+
+	/* LEVEL_PVS: pvswords words for each platform, as level_t's pvs. */
+	int32_t pvswords;
+	uint32_t pvsoffset;
+
+	/* LEVEL_GRID: as level_t's grid, with platforms given by index. */
+	float gridoriginx,gridoriginy,gridcell;
+	int32_t gridwidth,gridheight;
+	int32_t numgridplatforms;
+	uint32_t gridstartoffset;	/* gridwidth*gridheight+1 int32_t */
+	uint32_t gridplatformoffset;	/* numgridplatforms int32_t */
+	uint32_t pad;
+} lvlheader_t;
+
+typedef struct lvlvert_s
+{
+	float x,y;
+	int32_t firstedge,numedges;	/* in the edge index table */
+} lvlvert_t;
+
+typedef struct lvledge_s
+{
+	int32_t verts[2];
+	int32_t leftplat,rightplat;	/* numplatforms for outside the level */
+} lvledge_t;
+
+typedef struct lvledgegeom_s
+{
+	float linex,liney;
+	float normalx,normaly;
+	float planedist;
+} lvledgegeom_t;
+
+typedef struct lvlplatform_s
+{
+	float ceilheight,floorheight;
+	int32_t firstedge,numedges;	/* in the edge index table */
+	int32_t convex;			/* if LEVEL_BAKED */
+} lvlplatform_t;
+
+/* A level file in memory. Current files are mapped; version 1 files are
+ * read and rearranged into the same layout.
+ */
+typedef struct levelimage_s
+{
+	lvlheader_t *header;
+	lvlvert_t *verts;
+	lvledge_t *edges;
+	lvlplatform_t *platforms;
+	int32_t *edgerefs;
+	lvledgegeom_t *edgegeom;
+	uint32_t *pvs;
+	int32_t *gridstart;
+	int32_t *gridplatforms;
+
+	void *data;
+	size_t size;
+	int mapped;
+} levelimage_t;
+
+int newlevelimage ( levelimage_t *img, lvlheader_t *counts );
+int openlevelimage ( levelimage_t *img, char *filename );
+int writelevelimage ( levelimage_t *img, char *filename );
+void closelevelimage ( levelimage_t *img );
+
+#endif
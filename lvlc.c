@@ -0,0 +1,474 @@
+/*
+ * Copyright (C) Matthew Earl
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+/* Level compiler. Reads a level in any format the game can load, tidies
+ * it up and writes it in the current format along with everything the
+ * game would otherwise work out each time it loaded it.
+ *
+ * Collinear edges which meet at a vertex of nothing else and divide the
+ * same platforms are merged, so long as the join falls where the wall
+ * texture repeats. Platforms are put in the order of a Morton curve
+ * through their centres, and edges and vertices in the order the
+ * platforms first use them, so that neighbours in the level are
+ * neighbours in memory. With -convex, concave platforms are also split
+ * into convex pieces; see convex.c.
+ */
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "convex.h"
+#include "level.h"
+#include "pvs.h"
+
+#define TEXTURE_REPEAT	64.0	/* units along a wall after which its texture repeats */
+#define MORTON_BITS	16
+
+typedef struct platformkey_s
+{
+	uint32_t key;
+	int index;
+} platformkey_t;
+
+static int
+findedge ( int *into, int e )
+{
+	while(into[e] != e)
+		e = into[e];
+	return e;
+}
+
+/* Whether a, v, c lie in a straight line in that order, with the join at v
+ * leaving the texture on the far side of it where it was.
+ */
+static int
+canmergeat ( lvlvert_t *a, lvlvert_t *v, lvlvert_t *c )
+{
+	double x1=v->x-a->x,y1=v->y-a->y,x2=c->x-v->x,y2=c->y-v->y;
+
+	return x1*y2 - y1*x2 == 0.0 && x1*x2 + y1*y2 > 0.0 &&
+			fmod(sqrt(x1*x1 + y1*y1),TEXTURE_REPEAT) == 0.0;
+}
+
+/* mergeedges
+ *
+ * Merge edges across every vertex that allows it, in edges, a copy of the
+ * image's edges. into[e] is set to the edge that e was merged into, or e,
+ * and the vertices merged away are cleared in used.
+ */
+static int
+mergeedges ( levelimage_t *img, lvledge_t *edges, int *into, char *used )
+{
+	lvlvert_t *v;
+	int i,a,b,first,second,merged=0;
+
+	for(i=0;i<img->header->numverts;i++)
+	{
+		v = &img->verts[i];
+		if(v->numedges != 2)
+			continue;
+		a = findedge(into,img->edgerefs[v->firstedge]);
+		b = findedge(into,img->edgerefs[v->firstedge+1]);
+		if(a == b)
+			continue;
+		if(edges[a].verts[1] == i && edges[b].verts[0] == i)
+		{
+			first = a;
+			second = b;
+		} else if(edges[b].verts[1] == i && edges[a].verts[0] == i)
+		{
+			first = b;
+			second = a;
+		} else
+			continue;
+		if(edges[first].leftplat != edges[second].leftplat ||
+				edges[first].rightplat != edges[second].rightplat ||
+				!canmergeat(&img->verts[edges[first].verts[0]],v,
+					&img->verts[edges[second].verts[1]]))
+			continue;
+
+		edges[first].verts[1] = edges[second].verts[1];
+		into[second] = first;
+		used[i] = 0;
+		merged++;
+	}
+	return merged;
+}
+
+static uint32_t
+spreadbits ( uint32_t x )
+{
+	x = (x | (x<<8)) & 0x00ff00ff;
+	x = (x | (x<<4)) & 0x0f0f0f0f;
+	x = (x | (x<<2)) & 0x33333333;
+	x = (x | (x<<1)) & 0x55555555;
+	return x;
+}
+
+static int
+comparekeys ( const void *a, const void *b )
+{
+	const platformkey_t *x=(const platformkey_t*)a,*y=(const platformkey_t*)b;
+
+	if(x->key != y->key)
+		return x->key < y->key ? -1 : 1;
+	return x->index - y->index;
+}
+
+/* The platforms in Morton order of the average of their edges' first
+ * vertices. order[k] is the platform to put k'th.
+ */
+static void
+platformorder ( levelimage_t *img, int *order )
+{
+	lvlheader_t *h=img->header;
+	platformkey_t *keys;
+	lvlplatform_t *p;
+	lvlvert_t *v;
+	float minx=0.0f,miny=0.0f,maxx=0.0f,maxy=0.0f,x,y,scale;
+	int i,j;
+
+	for(i=0;i<h->numverts;i++)
+	{
+		v = &img->verts[i];
+		if(!i || v->x < minx) minx = v->x;
+		if(!i || v->y < miny) miny = v->y;
+		if(!i || v->x > maxx) maxx = v->x;
+		if(!i || v->y > maxy) maxy = v->y;
+	}
+	scale = ((1<<MORTON_BITS)-1)/fmaxf(fmaxf(maxx-minx,maxy-miny),1.0f);
+
+	keys = (platformkey_t*)malloc(sizeof(platformkey_t)*(h->numplatforms+1));
+	for(i=0;i<h->numplatforms;i++)
+	{
+		p = &img->platforms[i];
+		x = y = 0.0f;
+		for(j=0;j<p->numedges;j++)
+		{
+			v = &img->verts[img->edges[img->edgerefs[p->firstedge+j]].verts[0]];
+			x += v->x;
+			y += v->y;
+		}
+		x = (x/p->numedges - minx)*scale;
+		y = (y/p->numedges - miny)*scale;
+		keys[i].key = spreadbits((uint32_t)x) | (spreadbits((uint32_t)y)<<1);
+		keys[i].index = i;
+	}
+	qsort(keys,h->numplatforms,sizeof(platformkey_t),comparekeys);
+	for(i=0;i<h->numplatforms;i++)
+		order[i] = keys[i].index;
+	free(keys);
+}
+
+/* Copy a list of edge indices, following merges, dropping repeats and
+ * renumbering. Returns the length of the new list; dst may be NULL to
+ * only count it.
+ */
+static int
+copyedgerefs ( int32_t *src, int count, int *into, int *newedge,
+		int *mark, int stamp, int32_t *dst )
+{
+	int i,e,n=0;
+
+	for(i=0;i<count;i++)
+	{
+		e = findedge(into,src[i]);
+		if(mark[e] == stamp)
+			continue;
+		mark[e] = stamp;
+		if(dst)
+			dst[n] = newedge[e];
+		n++;
+	}
+	return n;
+}
+
+/* rebuildimage
+ *
+ * Write in into out with the merges and the new order applied: platforms
+ * in order (or as they were if order is NULL), edges in the order those
+ * platforms first list them and vertices in the order those edges first
+ * use them.
+ */
+static int
+rebuildimage ( levelimage_t *in, lvledge_t *edges, int *into, char *used,
+		int *order, levelimage_t *out )
+{
+	lvlheader_t *h=in->header,counts;
+	lvlplatform_t *p,*np;
+	lvlvert_t *v,*nv;
+	int *newplat,*newedge,*newvert,*oldvert,*mark,*plats;
+	int i,j,e,k,n,numedges=0,numverts=0,numrefs=0,stamp=0,ok=0;
+
+	newplat = (int*)malloc(sizeof(int)*(h->numplatforms+1));
+	plats = (int*)malloc(sizeof(int)*(h->numplatforms+1));
+	newedge = (int*)malloc(sizeof(int)*(h->numedges ? h->numedges : 1));
+	mark = (int*)malloc(sizeof(int)*(h->numedges ? h->numedges : 1));
+	newvert = (int*)malloc(sizeof(int)*(h->numverts ? h->numverts : 1));
+	oldvert = (int*)malloc(sizeof(int)*(h->numverts ? h->numverts : 1));
+
+	for(i=0;i<h->numplatforms;i++)
+		plats[i] = order ? order[i] : i;
+	plats[h->numplatforms] = h->numplatforms;
+	for(i=0;i<=h->numplatforms;i++)
+		newplat[plats[i]] = i;
+
+	for(i=0;i<h->numedges;i++)
+	{
+		newedge[i] = -1;
+		mark[i] = -1;
+	}
+	if(order)
+	{
+		for(i=0;i<=h->numplatforms;i++)
+		{
+			p = &in->platforms[plats[i]];
+			for(j=0;j<p->numedges;j++)
+			{
+				e = findedge(into,in->edgerefs[p->firstedge+j]);
+				if(newedge[e] < 0)
+					newedge[e] = numedges++;
+			}
+		}
+	} else
+	{
+		for(i=0;i<h->numedges;i++)
+			if(into[i] == i)
+				newedge[i] = numedges++;
+	}
+
+	for(i=0;i<h->numverts;i++)
+		newvert[i] = -1;
+	if(order)
+	{
+		for(i=0;i<h->numedges;i++)
+			if(newedge[i] >= 0)
+				mark[newedge[i]] = i;
+		for(i=0;i<numedges;i++)
+			for(j=0;j<2;j++)
+			{
+				k = edges[mark[i]].verts[j];
+				if(newvert[k] < 0)
+					newvert[k] = numverts++;
+			}
+		for(i=0;i<h->numedges;i++)
+			mark[i] = -1;
+	} else
+	{
+		for(i=0;i<h->numverts;i++)
+			if(used[i])
+				newvert[i] = numverts++;
+	}
+	for(i=0;i<h->numverts;i++)
+		if(newvert[i] >= 0)
+			oldvert[newvert[i]] = i;
+
+	for(i=0;i<=h->numplatforms;i++)
+	{
+		p = &in->platforms[i];
+		numrefs += copyedgerefs(&in->edgerefs[p->firstedge],p->numedges,
+				into,newedge,mark,stamp++,NULL);
+	}
+	for(i=0;i<numverts;i++)
+	{
+		v = &in->verts[oldvert[i]];
+		numrefs += copyedgerefs(&in->edgerefs[v->firstedge],v->numedges,
+				into,newedge,mark,stamp++,NULL);
+	}
+
+	memset(&counts,0,sizeof(counts));
+	counts.numverts = numverts;
+	counts.numedges = numedges;
+	counts.numplatforms = h->numplatforms;
+	counts.numedgerefs = numrefs;
+	counts.sizex = h->sizex;
+	counts.sizey = h->sizey;
+	if(!newlevelimage(out,&counts))
+		goto done;
+
+	n = 0;
+	for(i=0;i<=h->numplatforms;i++)
+	{
+		p = &in->platforms[plats[i]];
+		np = &out->platforms[i];
+		np->ceilheight = p->ceilheight;
+		np->floorheight = p->floorheight;
+		np->firstedge = n;
+		np->numedges = copyedgerefs(&in->edgerefs[p->firstedge],p->numedges,
+				into,newedge,mark,stamp++,&out->edgerefs[n]);
+		n += np->numedges;
+	}
+	for(i=0;i<numverts;i++)
+	{
+		v = &in->verts[oldvert[i]];
+		nv = &out->verts[i];
+		nv->x = v->x;
+		nv->y = v->y;
+		nv->firstedge = n;
+		nv->numedges = copyedgerefs(&in->edgerefs[v->firstedge],v->numedges,
+				into,newedge,mark,stamp++,&out->edgerefs[n]);
+		n += nv->numedges;
+	}
+	for(i=0;i<h->numedges;i++)
+	{
+		if(newedge[i] < 0)
+			continue;
+		out->edges[newedge[i]].verts[0] = newvert[edges[i].verts[0]];
+		out->edges[newedge[i]].verts[1] = newvert[edges[i].verts[1]];
+		out->edges[newedge[i]].leftplat = newplat[edges[i].leftplat];
+		out->edges[newedge[i]].rightplat = newplat[edges[i].rightplat];
+	}
+	ok = 1;
+
+done:
+	free(newplat);
+	free(plats);
+	free(newedge);
+	free(mark);
+	free(newvert);
+	free(oldvert);
+	return ok;
+}
+
+/* tidyimage
+ *
+ * Rebuild in as out, merging edges if merge is set and putting the
+ * platforms in Morton order if reorder is.
+ */
+static int
+tidyimage ( levelimage_t *in, int merge, int reorder, levelimage_t *out, int *merged )
+{
+	lvledge_t *edges;
+	char *used;
+	int i,*into,*order=NULL,ok;
+
+	edges = (lvledge_t*)malloc(sizeof(lvledge_t)*(in->header->numedges+1));
+	into = (int*)malloc(sizeof(int)*(in->header->numedges+1));
+	used = (char*)malloc(in->header->numverts+1);
+	memcpy(edges,in->edges,sizeof(lvledge_t)*in->header->numedges);
+	for(i=0;i<in->header->numedges;i++)
+		into[i] = i;
+	memset(used,1,in->header->numverts);
+	if(merge)
+		*merged = mergeedges(in,edges,into,used);
+	if(reorder)
+	{
+		order = (int*)malloc(sizeof(int)*(in->header->numplatforms+1));
+		platformorder(in,order);
+	}
+	ok = rebuildimage(in,edges,into,used,order,out);
+	if(!ok)
+		fprintf(stderr,"Could not allocate level\n");
+	free(edges);
+	free(into);
+	free(used);
+	free(order);
+	return ok;
+}
+
+void
+usage ( char *name )
+{
+	fprintf(stderr,"Usage: %s [-nomerge] [-noreorder] [-convex] [-nopvs] [-nogrid] in.lvl out.lvl\n",
+		name);
+}
+
+int
+main ( int argc, char **argv )
+{
+	levelimage_t img,tidied,baked;
+	level_t l;
+	threadpool_t pool;
+	char *in=NULL,*out=NULL;
+	int i,merge=1,convex=0,reorder=1,flags=LEVEL_PVS|LEVEL_GRID;
+	int merged=0,split=0,pieces=0,ok;
+
+	for(i=1;i<argc;i++)
+	{
+		if(!strcmp(argv[i],"-nomerge"))
+			merge = 0;
+		else if(!strcmp(argv[i],"-convex"))
+			convex = 1;
+		else if(!strcmp(argv[i],"-noreorder"))
+			reorder = 0;
+		else if(!strcmp(argv[i],"-nopvs"))
+			flags &= ~LEVEL_PVS;
+		else if(!strcmp(argv[i],"-nogrid"))
+			flags &= ~LEVEL_GRID;
+		else if(argv[i][0] == '-')
+		{
+			usage(argv[0]);
+			return 1;
+		} else if(!in)
+			in = argv[i];
+		else if(!out)
+			out = argv[i];
+		else
+		{
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if(!out)
+	{
+		usage(argv[0]);
+		return 1;
+	}
+
+	/* Merge before splitting, as the joins between pieces would stop
+	 * edges merging, and order the pieces along with everything else.
+	 */
+	if(!openlevelimage(&img,in))
+		return 1;
+	if(!tidyimage(&img,merge,!convex && reorder,&tidied,&merged))
+		return 1;
+	closelevelimage(&img);
+	if(convex)
+	{
+		split = splitplatforms(&tidied,&img,&pieces);
+		if(split < 0)
+		{
+			fprintf(stderr,"Could not allocate level\n");
+			return 1;
+		}
+		closelevelimage(&tidied);
+		if(!tidyimage(&img,0,reorder,&tidied,NULL))
+			return 1;
+		closelevelimage(&img);
+	}
+
+	memset(&l,0,sizeof(l));
+	startthreadpool(&pool,numcpus());
+	ok = buildlevel(&l,&tidied,&pool,flags & ~LEVEL_PVS);
+	if(ok && (flags & LEVEL_PVS))
+		buildpvs(&l,&pool,0);	/* however long it takes */
+	ok = ok && bakelevel(&l,&baked,flags);
+	stopthreadpool(&pool);
+	if(!ok)
+		return 1;
+	closelevelimage(&tidied);
+	freelevel(&l);
+
+	if(!writelevelimage(&baked,out))
+		return 1;
+	printf("%s: %i vertices, %i edges (%i merged), %i platforms (%i split into %i), "
+		"%u bytes\n", out, baked.header->numverts, baked.header->numedges, merged,
+		baked.header->numplatforms, split, pieces, baked.header->filesize);
+	closelevelimage(&baked);
+	return 0;
+}
@@ -0,0 +1,72 @@
+/*
+ * Copyright (C) Matthew Earl
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+#include <stdio.h>
+#include "raycaster.h"
+#include "world.h"
+
+int
+parseoptions ( options_t *o, int argc, char **argv )
+{
+	int i;
+
+	defaultoptions(o);
+	for(i=1;i<argc;i++)
+	{
+		if(parseoption(o,argc,argv,&i))
+			continue;
+		if(argv[i][0] == '-')
+		{
+			fprintf(stderr,"Unknown option %s\n", argv[i]);
+			fprintf(stderr,"Usage: %s " OPTIONS_USAGE " [level]\n", argv[0]);
+			return 0;
+		}
+		o->level = argv[i];
+	}
+
+	/* Without a window there is no way to quit, so default to one frame. */
+	if(o->headless && !o->numframes)
+		o->numframes = 1;
+	return 1;
+}
+
+int
+main ( int argc, char **argv )
+{
+	options_t o;
+	raycaster_t r;
+	world_t w;
+
+	printf("Copyright Notice: This program is licensed under the GNU General Public License\nSee COPYING for details\n\n");
+
+	if(!parseoptions(&o,argc,argv))
+		return 1;
+	if(!initraycaster(&r,&o))
+		return 1;
+	initworld(&w,&r);
+	if(!addentity(&w, "type=spawn\\coords=384 384\\angle=0"))
+		return 0;
+	if(!addentity(&w, "type=monster\\coords=300 300\\angle=90"))
+		return 0;
+	
+	renderloop(&r,&w);
+	
+	cleanup(&r);
+	freeworld(&w);
+	return 0;
+}
@@ -0,0 +1,309 @@
+/*
+ * Copyright (C) Matthew Earl
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+/* Reading and writing texture packs. A pack is mapped and checked once,
+ * after which the renderer points its textures into the mapping; see
+ * maptexture in raycaster.c. Packs are made by texpack.
+ */
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "packfile.h"
+
+#define PACK_MAX_SIZE	0x7fffffff
+
+static uint64_t
+alignpack ( uint64_t offset )
+{
+	return (offset+PACK_ALIGN-1) & ~(uint64_t)(PACK_ALIGN-1);
+}
+
+/* newtexpack
+ *
+ * Start an empty pack for textures in the format given by format's
+ * bytesperpixel, masks, padding and tilebits.
+ */
+int
+newtexpack ( texpack_t *pack, packheader_t *format )
+{
+	packheader_t h=*format;
+
+	memset(pack,0,sizeof(texpack_t));
+	h.magic = PACK_MAGIC;
+	h.version = PACK_VERSION;
+	h.numtextures = 0;
+	h.entryoffset = 0;
+	h.filesize = alignpack(sizeof(packheader_t));
+	memset(h.pad,0,sizeof(h.pad));
+
+	pack->allocatedsize = 1<<16;
+	pack->data = calloc(1,pack->allocatedsize);
+	if(!pack->data)
+		return 0;
+	memcpy(pack->data,&h,sizeof(h));
+	pack->header = (packheader_t*)pack->data;
+	pack->size = h.filesize;
+	return 1;
+}
+
+/* addpackdata
+ *
+ * Copy size bytes to the end of the pack, returning their offset, or 0
+ * if the pack would be too big.
+ */
+uint32_t
+addpackdata ( texpack_t *pack, void *data, size_t size )
+{
+	uint64_t offset=pack->size,end,n;
+	void *grown;
+
+	end = alignpack(offset+size);
+	if(end > PACK_MAX_SIZE)
+		return 0;
+	if(end > (uint64_t)pack->allocatedsize)
+	{
+		for(n=pack->allocatedsize;n < end;n*=2)
+			;
+		grown = realloc(pack->data,n);
+		if(!grown)
+			return 0;
+		memset((char*)grown+pack->allocatedsize,0,n-pack->allocatedsize);
+		pack->data = grown;
+		pack->header = (packheader_t*)grown;
+		pack->allocatedsize = n;
+	}
+	if(size)
+		memcpy((char*)pack->data+offset,data,size);
+	pack->size = end;
+	pack->header->filesize = end;
+	return offset;
+}
+
+/* Add a zeroed index entry, to be filled in before the pack is written. */
+packentry_t *
+addpackentry ( texpack_t *pack )
+{
+	packentry_t *e;
+	int n=pack->header->numtextures;
+
+	if(n == pack->allocatedentries)
+	{
+		pack->allocatedentries = n ? 2*n : 16;
+		pack->entries = (packentry_t*)realloc(pack->entries,
+				sizeof(packentry_t)*pack->allocatedentries);
+	}
+	e = &pack->entries[n];
+	memset(e,0,sizeof(*e));
+	pack->header->numtextures++;
+	return e;
+}
+
+/* The index goes after the texels, so the entries can be added as the
+ * textures are.
+ */
+int
+writetexpack ( texpack_t *pack, char *filename )
+{
+	FILE *f;
+	size_t written;
+	uint32_t offset;
+
+	offset = addpackdata(pack,pack->entries,
+			sizeof(packentry_t)*pack->header->numtextures);
+	if(!offset)
+	{
+		fprintf(stderr,"%s: too big for a texture pack\n",filename);
+		return 0;
+	}
+	pack->header->entryoffset = offset;
+
+	f = fopen(filename,"wb");
+	if(!f)
+	{
+		perror(filename);
+		return 0;
+	}
+	written = fwrite(pack->data,1,pack->header->filesize,f);
+	if(fclose(f) || written != pack->header->filesize)
+	{
+		fprintf(stderr,"%s: write failed\n",filename);
+		return 0;
+	}
+	return 1;
+}
+
+/* Whether count entries of size bytes at offset are aligned to align and
+ * lie inside the pack.
+ */
+static int
+fitsinpack ( packheader_t *h, uint32_t offset, uint32_t align, uint64_t size,
+		int64_t count )
+{
+	return offset && !(offset % align) && count >= 0 &&
+			offset + size*(uint64_t)count <= h->filesize;
+}
+
+/* Check that everything an entry refers to lies inside the pack and that
+ * its runs stay inside its columns, so that nothing read from the pack can
+ * lead outside it.
+ */
+static int
+checkentry ( packheader_t *h, char *base, packentry_t *e )
+{
+	packlevel_t *l;
+	int32_t *firstrun;
+	uint16_t *runs;
+	int i;
+
+	if(!memchr(e->name,0,PACK_NAME_LENGTH))
+		return 0;
+	if(e->numlevels < 1 || e->numlevels > PACK_MAX_LEVELS)
+		return 0;
+	for(i=0;i<e->numlevels;i++)
+	{
+		l = &e->levels[i];
+		if(l->width < 1 || l->height < 1 || l->width > 65535 || l->height > 65535)
+			return 0;
+		if(!fitsinpack(h,l->pixeloffset,PACK_ALIGN,h->bytesperpixel,
+				(int64_t)l->width*l->height+h->padding))
+			return 0;
+	}
+
+	l = &e->levels[0];
+	if(!fitsinpack(h,e->firstrunoffset,sizeof(int32_t),sizeof(int32_t),l->width+1) ||
+			!fitsinpack(h,e->runoffset,sizeof(uint16_t),2*sizeof(uint16_t),e->numruns))
+		return 0;
+	firstrun = (int32_t*)(base+e->firstrunoffset);
+	runs = (uint16_t*)(base+e->runoffset);
+	if(firstrun[0] != 0 || firstrun[l->width] != e->numruns)
+		return 0;
+	for(i=0;i<l->width;i++)
+	{
+		if(firstrun[i+1] < firstrun[i])
+			return 0;
+	}
+	for(i=0;i<e->numruns;i++)
+	{
+		if(runs[2*i] >= runs[2*i+1] || runs[2*i+1] > l->height)
+			return 0;
+	}
+	return 1;
+}
+
+int
+opentexpack ( texpack_t *pack, char *filename )
+{
+	struct stat st;
+	packheader_t *h;
+	void *data;
+	int fd,i;
+
+	memset(pack,0,sizeof(texpack_t));
+	fd = open(filename,O_RDONLY);
+	if(fd < 0)
+	{
+		perror(filename);
+		return 0;
+	}
+	if(fstat(fd,&st) || st.st_size < (off_t)sizeof(packheader_t))
+	{
+		fprintf(stderr,"%s: not a texture pack\n",filename);
+		close(fd);
+		return 0;
+	}
+	data = mmap(NULL,st.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+	close(fd);
+	if(data == MAP_FAILED)
+	{
+		perror(filename);
+		return 0;
+	}
+	pack->data = data;
+	pack->size = st.st_size;
+	pack->mapped = 1;
+	h = pack->header = (packheader_t*)data;
+
+	if(h->magic != PACK_MAGIC)
+	{
+		fprintf(stderr,"%s: not a texture pack\n",filename);
+		closetexpack(pack);
+		return 0;
+	}
+	if(h->version != PACK_VERSION)
+	{
+		fprintf(stderr,"%s: texture pack version %u, expected %u; rebuild it with texpack\n",
+			filename,h->version,PACK_VERSION);
+		closetexpack(pack);
+		return 0;
+	}
+	if(h->filesize != st.st_size || (h->bytesperpixel != 2 && h->bytesperpixel != 4) ||
+			!fitsinpack(h,h->entryoffset,sizeof(int64_t),sizeof(packentry_t),
+				h->numtextures))
+	{
+		fprintf(stderr,"%s: texture pack is damaged\n",filename);
+		closetexpack(pack);
+		return 0;
+	}
+	pack->entries = (packentry_t*)((char*)data+h->entryoffset);
+	for(i=0;i<h->numtextures;i++)
+	{
+		if(!checkentry(h,(char*)data,&pack->entries[i]))
+		{
+			fprintf(stderr,"%s: texture pack is damaged\n",filename);
+			closetexpack(pack);
+			return 0;
+		}
+	}
+	return 1;
+}
+
+packentry_t *
+findpacktexture ( texpack_t *pack, char *name, int tiled )
+{
+	int i;
+
+	if(!pack->data)
+		return NULL;
+	for(i=0;i<pack->header->numtextures;i++)
+	{
+		if(pack->entries[i].tiled == tiled && !strcmp(pack->entries[i].name,name))
+			return &pack->entries[i];
+	}
+	return NULL;
+}
+
+void
+closetexpack ( texpack_t *pack )
+{
+	if(!pack->data)
+		return;
+	if(pack->mapped)
+		munmap(pack->data,pack->size);
+	else
+	{
+		free(pack->data);
+		free(pack->entries);
+	}
+	pack->data = NULL;
+	pack->header = NULL;
+	pack->entries = NULL;
+}
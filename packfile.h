@@ -0,0 +1,92 @@
+/*
+ * Copyright (C) Matthew Earl
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+#ifndef _PACKFILE_H_
+#define _PACKFILE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* A texture pack holds textures already converted to one screen format,
+ * laid out as the renderer keeps them in memory, so that they can be
+ * mapped and drawn from where they lie. Each texture's index entry gives
+ * the byte offset of the texels of the texture and of each of its mips,
+ * and of its runs for drawing sprites. Every field is little endian.
+ */
+#define PACK_MAGIC		0x31505452	/* "RTP1" */
+#define PACK_VERSION		1
+#define PACK_ALIGN		64	/* alignment of each texture's texels */
+#define PACK_NAME_LENGTH	64
+#define PACK_MAX_LEVELS		16	/* the texture and its mips */
+
+typedef struct packheader_s
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t filesize;
+	uint32_t bytesperpixel;
+	uint32_t rmask,gmask,bmask;
+	uint32_t padding;	/* texels after each level's, as TEXTURE_PADDING */
+	uint32_t tilebits;	/* as TILE_BITS */
+	int32_t numtextures;
+	uint32_t entryoffset;	/* numtextures packentry_t */
+	uint32_t pad[5];
+} packheader_t;
+
+typedef struct packlevel_s
+{
+	int32_t width,height;
+	int32_t tiled;
+	uint32_t pixeloffset;	/* width*height+padding texels */
+} packlevel_t;
+
+typedef struct packentry_s
+{
+	char name[PACK_NAME_LENGTH];	/* as given to texturefrompath */
+	int64_t mtime,size;		/* of the file it was made from */
+	int32_t tiled;			/* made for floors under -tiled */
+	int32_t numlevels;
+	uint32_t firstrunoffset;	/* width+1 int32_t */
+	uint32_t runoffset;		/* numruns pairs of uint16_t, as texrun_t */
+	int32_t numruns;
+	uint32_t pad[3];
+	packlevel_t levels[PACK_MAX_LEVELS];
+} packentry_t;
+
+/* A texture pack in memory, either mapped from a file or being built. */
+typedef struct texpack_s
+{
+	packheader_t *header;
+	packentry_t *entries;
+
+	void *data;
+	size_t size;
+	int mapped;
+	size_t allocatedsize;		/* while being built */
+	int allocatedentries;
+} texpack_t;
+
+int newtexpack ( texpack_t *pack, packheader_t *format );
+uint32_t addpackdata ( texpack_t *pack, void *data, size_t size );
+packentry_t *addpackentry ( texpack_t *pack );
+int writetexpack ( texpack_t *pack, char *filename );
+int opentexpack ( texpack_t *pack, char *filename );
+packentry_t *findpacktexture ( texpack_t *pack, char *name, int tiled );
+void closetexpack ( texpack_t *pack );
+
+#endif
@@ -57,12 +57,25 @@ moveplayer ( raycaster_t *r, entity_t *p, vector2d_t *origin,
 {
 	intersection_t in;
 	vector2d_t temp,origviewpos;
-	platform_t *prevplat=p->currentplatform,*prevprevplat=NULL;;
+	platform_t *prevplat=p->currentplatform,*prevprevplat=NULL,*plat;
 	int headclip;
 	float pushextra;
 	
-	if(edgeintersect(r,p->currentplatform,dir,origin,0.0f,&in,NULL) == NULL)
+	/* Standing on the join between two pieces of a platform split by
+	 * lvlc -convex and heading into the other piece, the entity is now
+	 * in that piece. On any other edge it stays put, as the step and
+	 * ceiling checks below have been passed by.
+	 */
+	plat = p->currentplatform;
+	if(traceintersect(r,&plat,dir,origin,0.0f,&in) == NULL)
 		return;
+	if(plat != p->currentplatform)
+	{
+		if(plat->floorheight != p->currentplatform->floorheight ||
+				plat->ceilheight != p->currentplatform->ceilheight)
+			return;
+		p->currentplatform = prevplat = plat;
+	}
 	while(0<1)
 	{
 		if(dist <= in.distance)
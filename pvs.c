@@ -0,0 +1,584 @@
+/*
+ * Copyright (C) Matthew Earl
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+/* Potentially visible sets.
+ *
+ * For every platform, the set of platforms which can be seen from
+ * somewhere inside it. The sets are worked out in 2D by following lines
+ * of sight out through the portals (edges between platforms with a gap
+ * between floor and ceiling), narrowing the view at each portal. They
+ * are conservative: a platform may be in a set and still be hidden in
+ * practice, but one that can be seen is never left out.
+ */
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "pvs.h"
+#include "threads.h"
+
+#define PVS_EPSILON	0.01f
+#define BITS_PER_WORD	32
+#define PVS_MAX_STEPS	16384	/* steps per platform before giving up */
+
+/* State owned by one thread working out rows of the pvs. */
+typedef struct pvsflow_s
+{
+	level_t *l;
+	unsigned int *row;	/* set being filled in */
+	char *onstack;		/* edges already crossed by the current line */
+	int steps;		/* portals followed and platforms flooded out
+				 * to for the current platform */
+	int unseen;		/* platforms not yet in the row */
+
+	/* A point on each portal the current line has crossed, starting
+	 * with the source portal, and its normal pointing onwards.
+	 */
+	vector2d_t *pathpos,*pathnormal;
+	int depth;
+
+	platform_t **stack;	/* for flooding out */
+	int *reached;		/* platforms reached by a flood */
+	int stamp;		/* marks those reached by the current one */
+	int visible;		/* platforms in the rows done so far */
+} pvsflow_t;
+
+/* Platforms are shared out between the threads of the pool. */
+typedef struct pvsbuild_s
+{
+	level_t *l;
+	int numthreads;
+	long long budget;	/* steps before giving up, or 0 for no limit */
+	pvsflow_t flows[MAX_THREADS];
+	long long steps;	/* steps over every row */
+	int giveup;		/* steps has gone past budget */
+	workqueue_t queues[MAX_THREADS];
+} pvsbuild_t;
+
+int
+platformindex ( level_t *l, platform_t *p )
+{
+	if(p == &l->infplatform)
+		return l->numplatforms;
+	return p - l->platforms;
+}
+
+static void
+setbit ( unsigned int *row, int i )
+{
+	row[i/BITS_PER_WORD] |= 1u<<(i%BITS_PER_WORD);
+}
+
+static int
+testbit ( unsigned int *row, int i )
+{
+	return (row[i/BITS_PER_WORD]>>(i%BITS_PER_WORD))&1;
+}
+
+/* Put platform p in the set being filled in. */
+static void
+seeplatform ( pvsflow_t *f, platform_t *p )
+{
+	int i=platformindex(f->l,p);
+
+	if(testbit(f->row,i))
+		return;
+	setbit(f->row,i);
+	if(p != &f->l->infplatform)
+		f->unseen--;
+}
+
+/* The normal of edge e pointing into next. Edges are crossed into
+ * rightplat along the normal.
+ */
+static void
+portalnormal ( edge_t *e, platform_t *next, vector2d_t *normal )
+{
+	if(next == e->rightplat)
+		vectorcopy(normal,&e->normal);
+	else
+		vectorscale(&e->normal,-1.0f,normal);
+}
+
+/* Can anything be seen through the edge? */
+static int
+portalopen ( edge_t *e )
+{
+	float top,bottom;
+
+	if(e->leftplat == e->rightplat)
+		return 0;
+	top = e->leftplat->ceilheight < e->rightplat->ceilheight ?
+		e->leftplat->ceilheight : e->rightplat->ceilheight;
+	bottom = e->leftplat->floorheight > e->rightplat->floorheight ?
+		e->leftplat->floorheight : e->rightplat->floorheight;
+	return top > bottom;
+}
+
+/* Signed distance of v from the line through a and b, or 0 if a and b
+ * are too close together to make a line.
+ */
+static float
+sideofline ( vector2d_t *a, vector2d_t *b, vector2d_t *v )
+{
+	float dx,dy,length;
+
+	dx = b->x-a->x;
+	dy = b->y-a->y;
+	length = sqrtf(dx*dx + dy*dy);
+	if(length < PVS_EPSILON)
+		return 0.0f;
+	return ((v->y-a->y)*dx - (v->x-a->x)*dy)/length;
+}
+
+/* Cut the segment t down to the part on the same side of the line
+ * through a and b as keep. Returns 0 if none of it is left.
+ */
+static int
+clipsegment ( vector2d_t *t, vector2d_t *a, vector2d_t *b, vector2d_t *keep )
+{
+	float side,d0,d1;
+
+	side = sideofline(a,b,keep);
+	if(fabsf(side) < PVS_EPSILON)
+		return 1;
+	d0 = sideofline(a,b,&t[0]);
+	d1 = sideofline(a,b,&t[1]);
+	if(side < 0.0f)
+	{
+		d0 = -d0;
+		d1 = -d1;
+	}
+	if(d0 < -PVS_EPSILON && d1 < -PVS_EPSILON)
+		return 0;
+	if(d0 < 0.0f && d1 > 0.0f)
+		vectormidpoint(&t[0],&t[1],d0/(d0-d1),&t[0]);
+	else if(d1 < 0.0f && d0 > 0.0f)
+		vectormidpoint(&t[0],&t[1],d0/(d0-d1),&t[1]);
+	return 1;
+}
+
+/* Cut the target portal down to the part that a line through both the
+ * source and pass portals can reach. That part is bounded by the lines
+ * through an end of each portal which have the source and pass portals
+ * on opposite sides.
+ */
+static int
+clipbyseparators ( vector2d_t *source, vector2d_t *pass, vector2d_t *target )
+{
+	float ds,dp;
+	int i,j;
+
+	for(i=0;i<2;i++)
+	{
+		for(j=0;j<2;j++)
+		{
+			ds = sideofline(&source[i],&pass[j],&source[1-i]);
+			dp = sideofline(&source[i],&pass[j],&pass[1-j]);
+			if(fabsf(ds) < PVS_EPSILON || fabsf(dp) < PVS_EPSILON ||
+					(ds < 0.0f) == (dp < 0.0f))
+				continue;
+			if(!clipsegment(target,&source[i],&pass[j],&pass[1-j]))
+				return 0;
+		}
+	}
+	return 1;
+}
+
+/* How far v is in front of the line through a with the given normal.
+ * Written out rather than using vector.c, as the pvs spends most of its
+ * time here.
+ */
+static inline float
+infront ( vector2d_t *v, vector2d_t *a, vector2d_t *normal )
+{
+	return (v->x-a->x)*normal->x + (v->y-a->y)*normal->y;
+}
+
+/* Cut the segment t down to the part strictly on the side of the line
+ * through a which normal points to. Returns 0 if none of it is left.
+ */
+static int
+clipbeyond ( vector2d_t *t, vector2d_t *a, vector2d_t *normal )
+{
+	float d0,d1;
+
+	d0 = infront(&t[0],a,normal);
+	d1 = infront(&t[1],a,normal);
+	if(d0 < PVS_EPSILON && d1 < PVS_EPSILON)
+		return 0;
+	if(d0 < 0.0f)
+		vectormidpoint(&t[0],&t[1],d0/(d0-d1),&t[0]);
+	else if(d1 < 0.0f)
+		vectormidpoint(&t[0],&t[1],d0/(d0-d1),&t[1]);
+	return 1;
+}
+
+/* Whether some platform not yet in the set might be seen through
+ * pass, the way into p. Floods out from p through every portal that a
+ * line through both source and pass could reach, without narrowing
+ * the view at each one as flowthrough does, so each platform is only
+ * looked at once. Stops at the first platform not in the set.
+ */
+static int
+morebeyond ( pvsflow_t *f, platform_t *p, vector2d_t *source,
+		vector2d_t *pass, vector2d_t *passnormal )
+{
+	vector2d_t point[4],normal[4],line;
+	float slack[4],d0,d1,length;
+	platform_t *q;
+	edge_t *e;
+	int i,j,k,planes=0,n=0;
+
+	if(!f->unseen)
+		return 0;
+
+	/* The lines reach the far side of pass and of the source portal,
+	 * between the lines that separate the two.
+	 */
+	vectorcopy(&point[planes],&pass[0]);
+	vectorcopy(&normal[planes],passnormal);
+	slack[planes++] = PVS_EPSILON;
+	vectorcopy(&point[planes],&f->pathpos[0]);
+	vectorcopy(&normal[planes],&f->pathnormal[0]);
+	slack[planes++] = PVS_EPSILON;
+	for(i=0;pass != source && i<2;i++)
+	{
+		for(j=0;j<2;j++)
+		{
+			d0 = sideofline(&source[i],&pass[j],&source[1-i]);
+			d1 = sideofline(&source[i],&pass[j],&pass[1-j]);
+			if(fabsf(d0) < PVS_EPSILON || fabsf(d1) < PVS_EPSILON ||
+					(d0 < 0.0f) == (d1 < 0.0f))
+				continue;
+			vectorsubtract(&pass[j],&source[i],&line);
+			length = vectorlength(&line);
+			vectorrot90(&line,&normal[planes]);
+			vectorscale(&normal[planes],(d1 < 0.0f ? -1.0f : 1.0f)/length,
+					&normal[planes]);
+			vectorcopy(&point[planes],&source[i]);
+			slack[planes++] = -PVS_EPSILON;
+		}
+	}
+
+	f->stamp++;
+	f->reached[platformindex(f->l,p)] = f->stamp;
+	f->stack[n++] = p;
+	while(n)
+	{
+		/* Once out of steps the row falls back on seeeverything, so
+		 * stopping here leaves nothing out.
+		 */
+		if(++f->steps > PVS_MAX_STEPS)
+			return 0;
+		p = f->stack[--n];
+		for(i=0;i<p->numedges;i++)
+		{
+			e = p->edges[i];
+			if(!portalopen(e))
+				continue;
+			q = e->leftplat != p ? e->leftplat : e->rightplat;
+			if(f->reached[platformindex(f->l,q)] == f->stamp)
+				continue;
+			for(k=0;k<planes;k++)
+			{
+				d0 = infront(&e->verts[0]->pos,&point[k],&normal[k]);
+				d1 = infront(&e->verts[1]->pos,&point[k],&normal[k]);
+				if(d0 < slack[k] && d1 < slack[k])
+					break;
+			}
+			if(k < planes)
+				continue;
+			if(!testbit(f->row,platformindex(f->l,q)))
+				return 1;
+			f->reached[platformindex(f->l,q)] = f->stamp;
+			f->stack[n++] = q;
+		}
+	}
+	return 0;
+}
+
+/* Look on from platform p, having come in through pass, part of edge
+ * entered. passnormal points away from the platform before. source is
+ * the part of the source portal that can see all of pass.
+ */
+static void
+flowthrough ( pvsflow_t *f, platform_t *p, vector2d_t *source,
+		vector2d_t *pass, vector2d_t *passnormal, edge_t *entered )
+{
+	vector2d_t target[2],newsource[2],normal;
+	platform_t *next;
+	edge_t *e;
+	int i,j;
+
+	/* Wide open levels can have a great many ways through them; past a
+	 * point, buildpvsrow falls back on flooding out instead.
+	 */
+	if(++f->steps > PVS_MAX_STEPS || !f->unseen)
+		return;
+
+	for(i=0;i<p->numedges;i++)
+	{
+		e = p->edges[i];
+		if(e == entered || f->onstack[e - f->l->edges] || !portalopen(e))
+			continue;
+
+		/* A line of sight through pass only goes on forwards. */
+		vectorcopy(&target[0],&e->verts[0]->pos);
+		vectorcopy(&target[1],&e->verts[1]->pos);
+		if(!clipbeyond(target,&pass[0],passnormal))
+			continue;
+
+		/* ... and has to go through the source as well. */
+		vectorcopy(&newsource[0],&source[0]);
+		vectorcopy(&newsource[1],&source[1]);
+		if(pass != source && (!clipbyseparators(source,pass,target) ||
+				!clipbyseparators(target,pass,newsource)))
+			continue;
+
+		/* Being straight, it is beyond every portal it has gone
+		 * through. Rounding lets the clipping above drift, so this
+		 * keeps the view from spreading out sideways.
+		 */
+		for(j=0;j<f->depth-1;j++)
+			if(!clipbeyond(target,&f->pathpos[j],&f->pathnormal[j]))
+				break;
+		if(j < f->depth-1)
+			continue;
+
+		next = e->leftplat != p ? e->leftplat : e->rightplat;
+		seeplatform(f,next);
+		portalnormal(e,next,&normal);
+		if(!morebeyond(f,next,newsource,target,&normal))
+			continue;
+
+		/* A straight line crosses an edge at most once. */
+		f->onstack[e - f->l->edges] = 1;
+		vectorcopy(&f->pathpos[f->depth],&target[0]);
+		vectorcopy(&f->pathnormal[f->depth],&normal);
+		f->depth++;
+		flowthrough(f,next,newsource,target,&normal,e);
+		f->depth--;
+		f->onstack[e - f->l->edges] = 0;
+	}
+}
+
+/* Flood out from the far side of the portal through edge e into next,
+ * through every portal with some part in front of it, putting
+ * everything that might be seen through it in the set.
+ */
+static void
+seeeverything ( pvsflow_t *f, edge_t *e, platform_t *next )
+{
+	vector2d_t normal,target[2];
+	platform_t *p,*q;
+	edge_t *g;
+	int i,n=0;
+
+	portalnormal(e,next,&normal);
+	f->stamp++;
+	f->reached[platformindex(f->l,next)] = f->stamp;
+	f->stack[n++] = next;
+	while(n && f->unseen)
+	{
+		p = f->stack[--n];
+		for(i=0;i<p->numedges;i++)
+		{
+			g = p->edges[i];
+			if(g == e || !portalopen(g))
+				continue;
+			q = g->leftplat != p ? g->leftplat : g->rightplat;
+			if(f->reached[platformindex(f->l,q)] == f->stamp)
+				continue;
+			vectorcopy(&target[0],&g->verts[0]->pos);
+			vectorcopy(&target[1],&g->verts[1]->pos);
+			if(!clipbeyond(target,&e->verts[0]->pos,&normal))
+				continue;
+			seeplatform(f,q);
+			f->reached[platformindex(f->l,q)] = f->stamp;
+			f->stack[n++] = q;
+		}
+	}
+}
+
+static void
+buildpvsrow ( pvsflow_t *f, platform_t *p )
+{
+	vector2d_t source[2],normal;
+	platform_t *next;
+	edge_t *e;
+	int i;
+
+	f->steps = 0;
+	f->unseen = f->l->numplatforms;
+	seeplatform(f,p);
+	for(i=0;i<p->numedges;i++)
+	{
+		e = p->edges[i];
+		if(!portalopen(e))
+			continue;
+		next = e->leftplat != p ? e->leftplat : e->rightplat;
+		seeplatform(f,next);
+
+		vectorcopy(&source[0],&e->verts[0]->pos);
+		vectorcopy(&source[1],&e->verts[1]->pos);
+		portalnormal(e,next,&normal);
+		vectorcopy(&f->pathpos[0],&source[0]);
+		vectorcopy(&f->pathnormal[0],&normal);
+		f->depth = 1;
+
+		f->onstack[e - f->l->edges] = 1;
+		flowthrough(f,next,source,source,&normal,e);
+		f->onstack[e - f->l->edges] = 0;
+	}
+	/* Ran out of steps, so everything that might be seen through each
+	 * portal goes in.
+	 */
+	for(i=0;f->steps > PVS_MAX_STEPS && i<p->numedges;i++)
+	{
+		e = p->edges[i];
+		if(portalopen(e))
+			seeeverything(f,e,e->leftplat != p ? e->leftplat : e->rightplat);
+	}
+
+	/* Once every platform is in, searching stops without finding out
+	 * whether infplatform can be seen, so it goes in as well.
+	 */
+	if(!f->unseen)
+		seeplatform(f,&f->l->infplatform);
+}
+
+static void
+buildpvsjob ( void *data, int thread )
+{
+	pvsbuild_t *b=(pvsbuild_t*)data;
+	pvsflow_t *f=&b->flows[thread];
+	level_t *l=b->l;
+	int i,j;
+
+	while((i = nextworkitem(b->queues,b->numthreads,thread)) >= 0)
+	{
+		if(__atomic_load_n(&b->giveup,__ATOMIC_RELAXED))
+			continue;
+		f->row = &l->pvs[i*l->pvswords];
+		buildpvsrow(f,&l->platforms[i]);
+		for(j=0;j<l->numplatforms;j++)
+			f->visible += testbit(f->row,j);
+		if(__atomic_add_fetch(&b->steps,f->steps,__ATOMIC_RELAXED) > b->budget &&
+				b->budget)
+			__atomic_store_n(&b->giveup,1,__ATOMIC_RELAXED);
+	}
+}
+
+/* Run job over count items on the threads of the pool. */
+static void
+runpvsjob ( pvsbuild_t *b, threadpool_t *pool, threadjob_t job, int count )
+{
+	initworkqueues(b->queues,b->numthreads);
+	fillworkqueues(b->queues,b->numthreads,count);
+	if(b->numthreads > 1)
+		runthreadpool(pool,job,b);
+	else
+		job(b,0);
+	freeworkqueues(b->queues,b->numthreads);
+}
+
+/* buildpvs
+ *
+ * Work out the potentially visible set of every platform, a platform at
+ * a time on each thread of pool if it has been started. The view is
+ * never inside infplatform, so it is given a set with everything in it.
+ * If budget is not 0 and the sets take more than budget steps, the
+ * level is left without them, so that everything is drawn.
+ */
+void
+buildpvs ( level_t *l, threadpool_t *pool, long long budget )
+{
+	pvsbuild_t *b;
+	pvsflow_t *f;
+	long long start;
+	int i,n,visible=0;
+
+	start = nanotime();
+	n = l->numplatforms+1;
+	l->pvswords = (n+BITS_PER_WORD-1)/BITS_PER_WORD;
+	if(posix_memalign((void**)&b,sizeof(workqueue_t),sizeof(pvsbuild_t)))
+		return;
+	l->pvs = (unsigned int*)calloc(n*l->pvswords,sizeof(unsigned int));
+
+	b->l = l;
+	b->numthreads = pool && pool->workers ? pool->numthreads : 1;
+	b->budget = budget;
+	b->steps = 0;
+	b->giveup = 0;
+	for(i=0;i<b->numthreads;i++)
+	{
+		f = &b->flows[i];
+		f->l = l;
+		f->onstack = (char*)calloc(l->numedges,1);
+		f->reached = (int*)calloc(n,sizeof(int));
+		f->pathpos = (vector2d_t*)malloc(sizeof(vector2d_t)*l->numedges);
+		f->pathnormal = (vector2d_t*)malloc(sizeof(vector2d_t)*l->numedges);
+		f->stamp = 0;
+		f->stack = (platform_t**)malloc(sizeof(platform_t*)*n);
+		f->visible = 0;
+	}
+
+	runpvsjob(b,pool,buildpvsjob,l->numplatforms);
+
+	for(i=0;i<b->numthreads;i++)
+	{
+		f = &b->flows[i];
+		visible += f->visible;
+		free(f->onstack);
+		free(f->reached);
+		free(f->pathpos);
+		free(f->pathnormal);
+		free(f->stack);
+	}
+
+	if(b->giveup)
+	{
+		printf("pvs: gave up after %.1f ms; everything will be drawn\n",
+			1.0e-6*(nanotime()-start));
+		freepvs(l);
+	} else
+	{
+		memset(&l->pvs[l->numplatforms*l->pvswords],0xff,
+				sizeof(unsigned int)*l->pvswords);
+		printf("pvs: %.1f of %i platforms visible on average, %.1f ms\n",
+			l->numplatforms ? (float)visible/l->numplatforms : 0.0f,
+			l->numplatforms, 1.0e-6*(nanotime()-start));
+	}
+	free(b);
+}
+
+void
+freepvs ( level_t *l )
+{
+	free(l->pvs);
+	l->pvs = NULL;
+}
+
+int
+platformcanseeplatform ( level_t *l, platform_t *from, platform_t *to )
+{
+	if(!l->pvs || !from || !to)
+		return 1;
+	return testbit(&l->pvs[platformindex(l,from)*l->pvswords],platformindex(l,to));
+}
@@ -0,0 +1,40 @@
+/*
+ * Copyright (C) Matthew Earl
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+#ifndef _PVS_H_
+#define _PVS_H_
+
+#include "raycaster.h"
+#include "threads.h"
+
+/* Steps over the whole level before buildpvs gives up when the game
+ * works out a pvs as it loads a level. lvlc sets no limit.
+ */
+#define PVS_BUDGET	(1<<22)
+
+/* Platforms above which the game will not work out a pvs for a level
+ * that lvlc has not been run on.
+ */
+#define PVS_LOAD_LIMIT	1024
+
+int platformindex ( level_t *l, platform_t *p );
+void buildpvs ( level_t *l, threadpool_t *pool, long long budget );
+void freepvs ( level_t *l );
+int platformcanseeplatform ( level_t *l, platform_t *from, platform_t *to );
+
+#endif
@@ -21,86 +21,28 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <sys/stat.h>
 #include "raycaster.h"
 #include "world.h"
 #include "vector.h"
 #include "physics.h"
 #include "tga.h"
-
-#define SCREEN_WIDTH	1024
-#define SCREEN_HEIGHT	768
+#include "blit.h"
+#include "kernels.h"
+#include "pvs.h"
+#include "grid.h"
+#include "level.h"
 
 #define DEFAULT_LEVEL	"levels/out.lvl"
+#define DEFAULT_BATCH_SIZE	16	/* columns */
 
-#define PACKED	__attribute__((packed))
-
-/* Edge structure, as stored in the file. */
-typedef struct fedge_s
-{
-	int32_t vertrefs[2];
-	int32_t leftplatref,rightplatref;
-} PACKED fedge_t;
-
-/* Vector structure, as stored in the file. */
-typedef struct fvector2d_s
-{
-	float x,y;
-} PACKED fvector2d_t;
-
-/* Vertex structure, as stored in the file. */
-typedef struct fvert_s
-{
-	vector2d_t pos;
-	int32_t numedges;
-	uint32_t dummy;
-} PACKED fvert_t;
-
-/* Platform structure, as stored in the file. */
-typedef struct fplatform_s
-{
-	float ceilheight,floorheight;
-	int32_t numedges;
-	uint32_t dummy;
-} PACKED fplatform_t;
-
-/* Level structure, as stored in the file. */
-typedef struct levelfile_s
-{
-	int32_t numedges;
-	uint32_t dummy1;
-	
-	int32_t numplatforms;
-	uint32_t dummy2;
-	fplatform_t infplatform;
-	
-	int32_t numverts;
-	uint32_t dummy3;
-	vector2d_t size;
-} PACKED levelfile_t;
-
-/* Intermediate vertex structure, used when loading the level. */
-typedef struct ivert_s
-{
-	fvert_t f;
-	int32_t *edgerefs;
-} ivert_t;
-
-/* Intermediate platform structure, used when loading the level. */
-typedef struct iplatform_s
-{
-	fplatform_t f;
-	int32_t *edgerefs;
-} iplatform_t;
-
+#ifdef RENDER_COUNTERS
+__thread rendercounters_t threadcounters;
+#endif
 
 #define FINAL_FLOOR		1
 #define FINAL_CEILING		2
 
-#define PRECISION_BITS			8
-#define DOUBLE_PRECISION_BITS		(2*PRECISION_BITS)
-#define PRECISION_PRODUCT		((float)(1<<PRECISION_BITS))		/* 2^PRECISION_BITS */
-#define PRECISION_PRODUCT_SQUARE	(PRECISION_PRODUCT*PRECISION_PRODUCT) 	/* 2^DOUBLE_PRECISION_BITS */
-
 /**************************************************************/
 
 int
@@ -129,20 +71,24 @@ setlogdimensions ( texture_t *t )
 	return 1;
 }
 
-int
-loadtexture ( texture_t *t, raycaster_t *r, char *filename )
+unsigned int
+gettexturepixel ( raycaster_t *r, texture_t *t, int x, int y )
 {
-	byte *bpixel;
-	int x,y;
-	bitmap_t b;
+	if(r->screen->format->BytesPerPixel == 4)
+		return ((unsigned int*)t->pixels)[texelindex(t,x,y)];
+	return ((unsigned short*)t->pixels)[texelindex(t,x,y)];
+}
 
-	snprintf(t->path, sizeof(t->path), "textures/%s", filename);
-	t->pixels = NULL;
-	
-	if(!loadTGA(t->path,&b))
-		return 0;
-	t->width = b.width;
-	t->height = b.height;
+/* settexturesize
+ *
+ * Set the size of t and the masks that go with it. Returns 0 if either
+ * side is not a power of two.
+ */
+int
+settexturesize ( texture_t *t, int width, int height )
+{
+	t->width = width;
+	t->height = height;
 
 	t->widthmask = t->width-1;
 	t->heightmask = t->height-1;
@@ -152,294 +98,565 @@ loadtexture ( texture_t *t, raycaster_t *r, char *filename )
 
 	t->widthmasksmallshift = (t->width<<PRECISION_BITS)-1;
 	t->heightmasksmallshift = (t->height<<PRECISION_BITS)-1;
-	
-	if(!setlogdimensions(t))
-	{
-		printf("Bad texture size in %s, %ix%i\n", t->path,t->width,t->height);
-		freeTGA(&b);
-		return 0;
-	}
-	
-	t->pixels = (unsigned short*)malloc(sizeof(unsigned short)*b.width*b.height);
-	for(x=0;x<b.width;x++)
+
+	return setlogdimensions(t);
+}
+
+/* settexels
+ *
+ * Fill t with rgb, its texels as rows of red, green and blue bytes,
+ * converted to the screen's format and stored up-down first, or in
+ * tiles if t->tiled is set.
+ */
+void
+settexels ( raycaster_t *r, texture_t *t, byte *rgb )
+{
+	byte *c;
+	Uint32 colour;
+	int x,y,bytes;
+
+	bytes = r->screen->format->BytesPerPixel;
+	t->pixels = malloc(bytes*(t->width*t->height+TEXTURE_PADDING));
+	memset((byte*)t->pixels + bytes*t->width*t->height,0,bytes*TEXTURE_PADDING);
+	for(x=0;x<t->width;x++)
 	{
-		for(y=0;y<b.height;y++)
+		for(y=0;y<t->height;y++)
 		{
-			bpixel = (byte*)getPixel ( &b,x,y );
-			t->pixels[y+x*b.height] = 
-				SDL_MapRGB(r->screen->format,bpixel[2],bpixel[1],bpixel[0]);
+			c = &rgb[3*(x+y*t->width)];
+			colour = SDL_MapRGB(r->screen->format,c[0],c[1],c[2]);
+			if(bytes == 4)
+				((unsigned int*)t->pixels)[texelindex(t,x,y)] = colour;
+			else
+				((unsigned short*)t->pixels)[texelindex(t,x,y)] = colour;
 		}
 	}
-	freeTGA(&b);
-	return 1;
 }
 
-texture_t *
-allocatetexture ( level_t *l )
+/* buildmips
+ *
+ * Make t's mip chain from rgb, its texels as passed to settexels. Each
+ * level averages 2x2 blocks of the one before, until a side is 1 texel.
+ * rgb is overwritten.
+ */
+void
+buildmips ( raycaster_t *r, texture_t *t, byte *rgb )
 {
-	texture_t *new;
+	texture_t *prev,*mip;
+	byte *a,*b;
+	int i,x,y,c;
 
-	new = (texture_t*)malloc(sizeof(texture_t));
-	
-	new->next = NULL;
-	if(!l->lasttexture)
+	t->nummips = t->log2width < t->log2height ? t->log2width : t->log2height;
+	t->mips = NULL;
+	if(!t->nummips)
+		return;
+	t->mips = (texture_t*)malloc(sizeof(texture_t)*t->nummips);
+
+	for(i=0,prev=t;i<t->nummips;i++,prev=mip)
 	{
-		l->texturelist = l->lasttexture = new;
-		new->prev = NULL;
-		return new;
+		mip = &t->mips[i];
+		memset(mip,0,sizeof(*mip));
+		strcpy(mip->path,t->path);
+		settexturesize(mip,prev->width>>1,prev->height>>1);
+		mip->tiled = t->tiled && cantile(mip->width,mip->height);
+
+		/* Each row of the level is made in place over the first rows
+		 * of the level before, which have been read by then.
+		 */
+		for(y=0;y<mip->height;y++)
+		{
+			for(x=0;x<mip->width;x++)
+			{
+				a = &rgb[3*(2*x+2*y*prev->width)];
+				b = a + 3*prev->width;
+				for(c=0;c<3;c++)
+					rgb[3*(x+y*mip->width)+c] = (a[c]+a[c+3]+b[c]+b[c+3]+2)>>2;
+			}
+		}
+		settexels(r,mip,rgb);
 	}
-	l->lasttexture->next = new;
-	new->prev = l->lasttexture;
-	l->lasttexture = new;
-	
-	return new;
 }
 
-texture_t *
-texturefrompath ( raycaster_t *r, char *path )
+/* buildruns
+ *
+ * Find the runs of texels in each column of t that are not the
+ * transparent colour, for drawing sprites.
+ */
+void
+buildruns ( raycaster_t *r, texture_t *t )
 {
-	texture_t *t;
-	
-	for(t=r->level.texturelist;t;t=t->next)
+	Uint32 transpixel;
+	int x,y,n=0;
+
+	transpixel = SDL_MapRGB(r->screen->format,255,0,255);
+	t->firstrun = (int*)malloc(sizeof(int)*(t->width+1));
+	t->runs = (texrun_t*)malloc(sizeof(texrun_t)*t->width*((t->height+1)/2));
+	for(x=0;x<t->width;x++)
 	{
-		if(!strcmp(path,t->path))
-			return t;
+		t->firstrun[x] = n;
+		for(y=0;y<t->height;)
+		{
+			while(y < t->height && gettexturepixel(r,t,x,y) == transpixel)
+				y++;
+			if(y == t->height)
+				break;
+			t->runs[n].start = y;
+			while(y < t->height && gettexturepixel(r,t,x,y) != transpixel)
+				y++;
+			t->runs[n++].end = y;
+		}
 	}
-	printf("loading texture %s...\n", path);
-	t = allocatetexture ( &r->level );
-	if(!loadtexture( t, r, path ))
-		return NULL;
-	
-	return t;
+	t->firstrun[t->width] = n;
+	if(n)
+		t->runs = (texrun_t*)realloc(t->runs,sizeof(texrun_t)*n);
 }
 
-unsigned short
-gettexturepixel ( texture_t *t, int x, int y )
+/* getpackformat
+ *
+ * The format texels are converted to for this screen, as recorded in the
+ * header of a texture pack.
+ */
+void
+getpackformat ( raycaster_t *r, packheader_t *format )
 {
-	return t->pixels[y+(x<<t->log2height)];
+	memset(format,0,sizeof(*format));
+	format->bytesperpixel = r->screen->format->BytesPerPixel;
+	format->rmask = r->screen->format->Rmask;
+	format->gmask = r->screen->format->Gmask;
+	format->bmask = r->screen->format->Bmask;
+	format->padding = TEXTURE_PADDING;
+	format->tilebits = TILE_BITS;
 }
 
+/* openpack
+ *
+ * Map the texture pack given with -pack, or DEFAULT_PACK if there is one.
+ * A pack made for another screen format is not used.
+ */
 void
-freetexture ( texture_t *t )
+openpack ( raycaster_t *r )
 {
-	if(t->pixels)
+	packheader_t format,*h;
+
+	if(!r->options.pack)
 	{
-		free(t->pixels);
-		t->pixels = NULL;
+		if(access(DEFAULT_PACK,R_OK))
+			return;
+		r->options.pack = DEFAULT_PACK;
 	}
-	
-}
+	if(!opentexpack(&r->pack,r->options.pack))
+		return;
 
-/**************************************************************/
+	getpackformat(r,&format);
+	h = r->pack.header;
+	if(h->bytesperpixel != format.bytesperpixel || h->rmask != format.rmask ||
+			h->gmask != format.gmask || h->bmask != format.bmask ||
+			h->padding != format.padding || h->tilebits != format.tilebits)
+	{
+		printf("%s is for a %i bpp screen, not using it\n", r->options.pack,
+			8*h->bytesperpixel);
+		closetexpack(&r->pack);
+		return;
+	}
+	printf("using texture pack %s\n", r->options.pack);
+}
 
+/* maptexture
+ *
+ * Point t and its mips at their texels and runs in the texture pack, if
+ * the pack holds the texture and was made from the file as it is now.
+ * Only the array of mips is allocated.
+ */
 int
-startsdl( raycaster_t *r )
+maptexture ( texture_t *t, raycaster_t *r, char *filename )
 {
-	if(SDL_Init(SDL_INIT_VIDEO | SDL_INIT_TIMER) == -1)
+	packentry_t *e;
+	packlevel_t *l;
+	texture_t *level;
+	struct stat st;
+	char *base=(char*)r->pack.data;
+	int i,tiled,wanttiled=t->tiled;
+
+	e = findpacktexture(&r->pack,filename,wanttiled);
+	if(!e)
+		return 0;
+	if(stat(t->path,&st) || st.st_mtime != e->mtime || st.st_size != e->size)
 	{
-		printf("Failed to start SDL\n");
+		printf("%s has changed since %s was made\n", t->path, r->options.pack);
 		return 0;
 	}
-	
-	r->screen = SDL_SetVideoMode(SCREEN_WIDTH, SCREEN_HEIGHT, 16, SDL_HWSURFACE|SDL_HWPALETTE);
-	if(!r->screen)
+
+	t->nummips = e->numlevels-1;
+	if(t->nummips)
+		t->mips = (texture_t*)calloc(t->nummips,sizeof(texture_t));
+	for(i=0;i<e->numlevels;i++)
 	{
-		fprintf(stderr, "Unable to set video: %s\n", SDL_GetError());
+		l = &e->levels[i];
+		level = i ? &t->mips[i-1] : t;
+		tiled = wanttiled && cantile(l->width,l->height);
+		if(!settexturesize(level,l->width,l->height) || l->tiled != tiled ||
+				(i && (l->width != t->width>>i || l->height != t->height>>i)))
+			break;
+		if(i)
+			strcpy(level->path,t->path);
+		level->tiled = tiled;
+		level->pixels = base + l->pixeloffset;
+		level->mapped = 1;
+	}
+	if(i < e->numlevels || t->nummips !=
+			(t->log2width < t->log2height ? t->log2width : t->log2height))
+	{
+		printf("%s in %s does not match the texture, not using it\n", t->path,
+			r->options.pack);
+		free(t->mips);
+		t->mips = NULL;
+		t->nummips = 0;
+		t->pixels = NULL;
+		t->mapped = 0;
+		t->tiled = wanttiled;
 		return 0;
 	}
+	t->firstrun = (int*)(base + e->firstrunoffset);
+	t->runs = (texrun_t*)(base + e->runoffset);
 	return 1;
 }
 
-void
-convertedge ( raycaster_t *r, level_t *l, fedge_t *fe, edge_t *e )
+int
+loadtexture ( texture_t *t, raycaster_t *r, char *filename )
 {
-	int i;
-	
-	e->texture = texturefrompath(r,"wall.tga");
-	for(i=0;i<2;i++)
-		e->verts[i] = &l->verts[fe->vertrefs[i]];
-	if(fe->leftplatref == -1)
-		e->leftplat = &l->infplatform;
-	else
-		e->leftplat = &l->platforms[fe->leftplatref];
-		
-	if(fe->rightplatref == -1)
-		e->rightplat = &l->infplatform;
-	else
-		e->rightplat = &l->platforms[fe->rightplatref];
+	byte *bpixel,*rgb;
+	int i,bytes;
+	bitmap_t b;
 
-	vectorsubtract(&e->verts[1]->pos,&e->verts[0]->pos,&e->line);
-	vectornormalise(&e->line,&e->line);
-	vectorrot90(&e->line,&e->normal);
-	e->planedist = dotproduct(&e->normal,&e->verts[0]->pos);
+	snprintf(t->path, sizeof(t->path), "textures/%s", filename);
+	t->pixels = NULL;
+	t->nummips = 0;
+	t->mips = NULL;
+	t->runs = NULL;
+	t->firstrun = NULL;
+	t->mapped = 0;
+
+	if(maptexture(t,r,filename))
+		return 1;
+	if(!loadTGA(t->path,&b))
+		return 0;
+	if(!settexturesize(t,b.width,b.height))
+	{
+		printf("Bad texture size in %s, %ix%i\n", t->path,t->width,t->height);
+		freeTGA(&b);
+		return 0;
+	}
+	t->tiled = t->tiled && cantile(t->width,t->height);
+	bytes = b.bitsperpixel>>3;
+	if(bytes < 3)
+	{
+		printf("%s has %i bits per pixel, expected 24 or 32\n", t->path,b.bitsperpixel);
+		freeTGA(&b);
+		return 0;
+	}
+
+	/* The image is in rows from the top, as rgb is. */
+	rgb = (byte*)malloc(3*b.width*b.height);
+	for(i=0,bpixel=b.image;i<b.width*b.height;i++,bpixel+=bytes)
+	{
+		rgb[3*i] = bpixel[2];
+		rgb[3*i+1] = bpixel[1];
+		rgb[3*i+2] = bpixel[0];
+	}
+	freeTGA(&b);
+	settexels(r,t,rgb);
+	buildruns(r,t);
+	buildmips(r,t,rgb);
+	free(rgb);
+	return 1;
 }
 
 void
-convertvert ( raycaster_t *r, level_t *l, ivert_t *iv, vert_t *v )
+linktexture ( level_t *l, texture_t *new )
 {
-	int i;
-	v->pos.x = iv->f.pos.x;
-	v->pos.y = iv->f.pos.y;
-	v->numedges = iv->f.numedges;
-	
-	v->edges = (edge_t**)malloc(sizeof(edge_t*)*iv->f.numedges);
-	for(i=0;i<v->numedges;i++)
-		v->edges[i] = &l->edges[iv->edgerefs[i]];
+	new->next = NULL;
+	if(!l->lasttexture)
+	{
+		l->texturelist = l->lasttexture = new;
+		new->prev = NULL;
+		return;
+	}
+	l->lasttexture->next = new;
+	new->prev = l->lasttexture;
+	l->lasttexture = new;
 }
 
 void
-convertplatform ( raycaster_t *r, level_t *l, iplatform_t *ip, platform_t *p )
+freetexture ( texture_t *t )
 {
 	int i;
-	
-	p->ceilheight = ip->f.ceilheight;
-	p->floorheight = ip->f.floorheight;
 
-	p->numedges = ip->f.numedges;
-	p->edges = (edge_t**)malloc(sizeof(edge_t*)*ip->f.numedges);
-	for(i=0;i<ip->f.numedges;i++)
+	if(!t->mapped)
 	{
-		p->edges[i] = &l->edges[ip->edgerefs[i]];
+		free(t->pixels);
+		for(i=0;i<t->nummips;i++)
+			free(t->mips[i].pixels);
+		free(t->runs);
+		free(t->firstrun);
 	}
-	p->texture = texturefrompath(r,"floor.tga");
-	p->allocatedsprites = 4;
-	p->sprites = (sprite_t**)malloc(p->allocatedsprites*sizeof(sprite_t*));
-	p->numsprites = 0;
+	t->pixels = NULL;
+	free(t->mips);
+	t->mips = NULL;
+	t->nummips = 0;
+	t->runs = NULL;
+	t->firstrun = NULL;
+	t->mapped = 0;
+}
+
+/* The loaded texture made from textures/name, if there is one. */
+texture_t *
+lookuptexture ( raycaster_t *r, char *name, int tiled )
+{
+	texture_t *t;
+	char path[sizeof(t->path)];
 
+	snprintf(path, sizeof(path), "textures/%s", name);
+	/* A texture too small to tile is the same either way. */
+	for(t=r->level.texturelist;t;t=t->next)
+	{
+		if(!strcmp(path,t->path) && (t->tiled == tiled ||
+				!cantile(t->width,t->height)))
+			return t;
+	}
+	return NULL;
 }
 
+/* Textures being loaded by loadtextures. */
+typedef struct textureload_s
+{
+	raycaster_t *r;
+	char **names;
+	texture_t **textures;
+	int *loaded;
+	workqueue_t queues[MAX_THREADS];
+} textureload_t;
+
 void
-optimiseplatform ( raycaster_t *r, level_t *l, platform_t *p)
+loadtexturejob ( void *data, int thread )
 {
-	int i,changeceil=1,changefloor=1,firstfloor=1,firstceil=1;
-	platform_t *n; /* Neighbouring platform. */
-	float highest=0.0f,lowest=0.0f;
+	textureload_t *tl=(textureload_t*)data;
+	int i;
 
-	/* If the platform's floor is higher than all its neighbours' ceilings then
-	 * set the platform's floor height to the maximum of its neighbours
-	 * ceilings. This is to minimise overdraw.
-	 *
-	 * Do similar if the platform's ceiling is lower than all of its
-	 * neighbours' floors.
-	 */
-	for(i=0;i<p->numedges;i++)
+	while((i = nextworkitem(tl->queues,tl->r->pool.numthreads,thread)) >= 0)
+		tl->loaded[i] = loadtexture(tl->textures[i],tl->r,tl->names[i]);
+}
+
+/* loadtextures
+ *
+ * Find the count textures named in names, tiled where tiled is set (NULL
+ * for none), and put them in textures. Those not loaded already are
+ * loaded at the same time, one on each thread of the pool if it has been
+ * started. A texture that cannot be loaded is NULL. Returns 0 if any
+ * could not be.
+ */
+int
+loadtextures ( raycaster_t *r, char **names, int *tiled, int count, texture_t **textures )
+{
+	textureload_t *tl;
+	texture_t *t;
+	int i,j,n=0,ok=1,*pending;
+
+	if(posix_memalign((void**)&tl,sizeof(workqueue_t),sizeof(textureload_t)))
+		return 0;
+	tl->r = r;
+	tl->names = (char**)malloc(sizeof(char*)*count);
+	tl->textures = (texture_t**)malloc(sizeof(texture_t*)*count);
+	tl->loaded = (int*)malloc(sizeof(int)*count);
+	pending = (int*)malloc(sizeof(int)*count);
+
+	/* Each texture is loaded once, however many times it is named. */
+	for(i=0;i<count;i++)
 	{
-		if(p->edges[i]->leftplat != p)
-			n = p->edges[i]->leftplat;
-		else
-			n = p->edges[i]->rightplat;
-		if(p->floorheight > n->ceilheight)
-		{
-			if(firstfloor || n->ceilheight > highest)
-				highest = n->ceilheight;
-			firstfloor = 0;
-		} else 
+		pending[i] = -1;
+		textures[i] = lookuptexture(r,names[i],tiled ? tiled[i] : 0);
+		if(textures[i])
+			continue;
+		for(j=0;j<n;j++)
 		{
-			changefloor = 0;
+			if(!strcmp(names[i],tl->names[j]) &&
+					tl->textures[j]->tiled == (tiled ? tiled[i] : 0))
+				break;
 		}
-		
-		if(p->ceilheight < n->floorheight)
+		if(j == n)
 		{
-			if(firstceil || n->floorheight < lowest)
-				lowest = n->floorheight;
-			firstceil = 0;
-		} else
+			printf("loading texture %s...\n", names[i]);
+			t = (texture_t*)calloc(1,sizeof(texture_t));
+			t->tiled = tiled ? tiled[i] : 0;
+			tl->names[n] = names[i];
+			tl->textures[n++] = t;
+		}
+		pending[i] = j;
+	}
+
+	if(n > 1 && r->pool.workers)
+	{
+		initworkqueues(tl->queues,r->pool.numthreads);
+		fillworkqueues(tl->queues,r->pool.numthreads,n);
+		runthreadpool(&r->pool,loadtexturejob,tl);
+		freeworkqueues(tl->queues,r->pool.numthreads);
+	} else
+	{
+		for(j=0;j<n;j++)
+			tl->loaded[j] = loadtexture(tl->textures[j],r,tl->names[j]);
+	}
+
+	/* Textures join the list in the order they were named. */
+	for(j=0;j<n;j++)
+	{
+		if(tl->loaded[j])
+			linktexture(&r->level,tl->textures[j]);
+	}
+	for(i=0;i<count;i++)
+	{
+		if(pending[i] >= 0)
+			textures[i] = tl->loaded[pending[i]] ? tl->textures[pending[i]] : NULL;
+		if(!textures[i])
+			ok = 0;
+	}
+	for(j=0;j<n;j++)
+	{
+		if(!tl->loaded[j])
 		{
-			changeceil = 0;
+			freetexture(tl->textures[j]);
+			free(tl->textures[j]);
 		}
 	}
-	if(changefloor)
-		p->floorheight = highest+1.0f;	
-	if(changeceil)
-		p->ceilheight = lowest-1.0f;
+
+	free(pending);
+	free(tl->loaded);
+	free(tl->textures);
+	free(tl->names);
+	free(tl);
+	return ok;
 }
 
+texture_t *
+findtexture ( raycaster_t *r, char *path, int tiled )
+{
+	texture_t *t;
+
+	loadtextures(r,&path,&tiled,1,&t);
+	return t;
+}
+
+texture_t *
+texturefrompath ( raycaster_t *r, char *path )
+{
+	return findtexture(r,path,0);
+}
+
+void
+freetextures ( raycaster_t *r )
+{
+	texture_t *t,*next;
+
+	for(next=r->level.texturelist;(t=next);)
+	{
+		next = t->next;
+		freetexture(t);
+		free(t);
+	}
+	r->level.texturelist = r->level.lasttexture = NULL;
+}
+
+/**************************************************************/
+
+/* startheadless
+ *
+ * Set up a plain memory framebuffer in place of the window, so that frames
+ * can be rendered without a display.
+ */
 int
-loadlevel ( raycaster_t *r, char *filename )
+startheadless( raycaster_t *r )
 {
-	FILE *f;
-	levelfile_t lf;
-	level_t *l=&r->level;
-	int i;
-	fedge_t *fedges;
-	iplatform_t *iplatforms;
-	iplatform_t iinfplatform;
-	ivert_t *iverts;
-	
-	f=fopen(filename,"rb");
-	if(!f)
+	if(SDL_Init(SDL_INIT_TIMER) == -1)
 	{
-		printf("Could not open file %s\n", filename);
+		printf("Failed to start SDL\n");
 		return 0;
 	}
-	
-	fread(&lf,sizeof(levelfile_t),1,f);
 
-	fedges = (fedge_t*)malloc(sizeof(fedge_t)*lf.numedges);
-	for(i=0;i<lf.numedges;i++)
-	{	
-		fread(&fedges[i],sizeof(fedge_t),1,f);
+	if(r->options.bpp == 32)
+		r->screen = SDL_CreateRGBSurface(SDL_SWSURFACE, SCREEN_WIDTH, SCREEN_HEIGHT, 32,
+				0xff0000, 0x00ff00, 0x0000ff, 0);
+	else
+		r->screen = SDL_CreateRGBSurface(SDL_SWSURFACE, SCREEN_WIDTH, SCREEN_HEIGHT, 16,
+				0xf800, 0x07e0, 0x001f, 0);
+	if(!r->screen)
+	{
+		fprintf(stderr, "Unable to create framebuffer: %s\n", SDL_GetError());
+		return 0;
 	}
-	
-	iplatforms = (iplatform_t*)malloc(sizeof(iplatform_t)*lf.numplatforms);
-	for(i=0;i<lf.numplatforms;i++)
-	{	
-		fread(&iplatforms[i].f,sizeof(fplatform_t),1,f);
-		iplatforms[i].edgerefs = 
-			(int32_t*)malloc(sizeof(int32_t)*iplatforms[i].f.numedges);
-		fread(iplatforms[i].edgerefs,sizeof(int32_t),iplatforms[i].f.numedges,f);
-	}
-
-	iinfplatform.f = lf.infplatform;
-	iinfplatform.edgerefs = 
-		(int32_t*)malloc(sizeof(int32_t)*iinfplatform.f.numedges);
-	fread(iinfplatform.edgerefs,sizeof(int32_t),iinfplatform.f.numedges,f);
-	
-	iverts = (ivert_t*)malloc(sizeof(ivert_t)*lf.numverts);
-	for(i=0;i<lf.numverts;i++)
-	{	
-		fread(&iverts[i].f,sizeof(fvert_t),1,f);
-		iverts[i].edgerefs = 
-			(int32_t*)malloc(sizeof(int32_t)*iverts[i].f.numedges);
-		fread(iverts[i].edgerefs,sizeof(int32_t),iverts[i].f.numedges,f);
+	return 1;
+}
+
+int
+startsdl( raycaster_t *r )
+{
+	if(r->options.headless)
+		return startheadless(r);
+
+	if(SDL_Init(SDL_INIT_VIDEO | SDL_INIT_TIMER) == -1)
+	{
+		printf("Failed to start SDL\n");
+		return 0;
 	}
 	
-	fclose(f);
-	
-	l->numedges = lf.numedges;
-	l->numplatforms = lf.numplatforms;
-	l->numverts = lf.numverts;
-	l->size.x = lf.size.x;
-	l->size.y = lf.size.y;
-	
-	l->edges = (edge_t*)malloc(sizeof(edge_t)*l->numedges);
-	l->platforms = (platform_t*)malloc(sizeof(platform_t)*l->numplatforms);
-	l->verts = (vert_t*)malloc(sizeof(vert_t)*l->numverts);
-
-	for(i=0;i<lf.numverts;i++)
-		convertvert(r,l,&iverts[i],&l->verts[i]);	
-	for(i=0;i<lf.numedges;i++)
-		convertedge(r,l,&fedges[i],&l->edges[i]);
-	for(i=0;i<lf.numplatforms;i++)
-		convertplatform(r,l,&iplatforms[i],&l->platforms[i]);	
-	convertplatform(r,l,&iinfplatform,&l->infplatform);
-
-	for(i=0;i<lf.numplatforms;i++)
-		optimiseplatform(r,l,&l->platforms[i]);	
-	optimiseplatform(r,l,&l->infplatform);
+	r->screen = SDL_SetVideoMode(SCREEN_WIDTH, SCREEN_HEIGHT, r->options.bpp,
+			SDL_HWSURFACE|SDL_HWPALETTE);
+	if(!r->screen)
+	{
+		fprintf(stderr, "Unable to set video: %s\n", SDL_GetError());
+		return 0;
+	}
+	return 1;
+}
+
+/* loadlevel
+ *
+ * Everything but the textures comes from buildlevel; see level.c.
+ */
+int
+loadlevel ( raycaster_t *r, char *filename )
+{
+	levelimage_t img;
+	level_t *l=&r->level;
+	texture_t *wall,*floor,*textures[2];
+	char *names[2]={"wall.tga","floor.tga"};
+	int tiled[2]={0,r->options.tiled};
+	int i,ok,flags=LEVEL_PVS|LEVEL_GRID;
 	
-	/*
-	 * Cleanup.
-     */
-	for(i=0;i<lf.numplatforms;i++)
-		free(iplatforms[i].edgerefs);
-	free(iinfplatform.edgerefs);
-	free(iplatforms);
-	for(i=0;i<lf.numverts;i++)
-		free(iverts[i].edgerefs);
-	free(iverts);
-	free(fedges);
+	if(!openlevelimage(&img,filename))
+		return 0;
+
+	/* A pvs for a large level takes too long to wait for. */
+	if(!(img.header->flags & LEVEL_PVS) && img.header->numplatforms > PVS_LOAD_LIMIT)
+	{
+		printf("%s has %i platforms and no pvs, so everything will be drawn; "
+			"run lvlc on it to work one out\n", filename, img.header->numplatforms);
+		flags &= ~LEVEL_PVS;
+	}
+	ok = buildlevel(l,&img,&r->pool,flags);
+	closelevelimage(&img);
+	if(!ok)
+		return 0;
 
+	/* Every platform shares one texture, so that drawcolumn can tell
+	 * when nothing changes from one platform to the next. Floors and
+	 * ceilings are only drawn by the floor kernels and drawspan, which
+	 * can read tiled textures.
+	 */
+	loadtextures(r,names,tiled,2,textures);
+	wall = textures[0];
+	floor = textures[1];
+	for(i=0;i<l->numedges;i++)
+		l->edges[i].texture = wall;
+	for(i=0;i<l->numplatforms;i++)
+		l->platforms[i].texture = floor;
+	l->infplatform.texture = floor;
 	return 1;
 }
 
@@ -511,23 +728,35 @@ handleevents( raycaster_t *r, world_t *w, int *done )
 #define HUNK_SPRITES	4
 
 void
-addspritetolist ( raycaster_t *r, sprite_t **i, float mingrad, float maxgrad )
+addspritetolist ( renderthread_t *rt, sprite_t *s, float mingrad, float maxgrad,
+		float dist, float texoffset )
 {
-	if(!(*i)->renderflag)
+	spriteref_t *ref;
+	int i;
+
+	/* A sprite spanning several platforms is only drawn once per column. */
+	for(i=0;i<rt->numsprites;i++)
+	{
+		if(rt->spritelist[i].sprite == s)
+			break;
+	}
+	if(i == rt->numsprites)
 	{
-		if(r->numsprites == r->allocatedsprites)
+		if(rt->numsprites == rt->allocatedsprites)
 		{
-			r->allocatedsprites+=HUNK_SPRITES;
-			r->spritelist = (sprite_t**)realloc(r->spritelist,
-					sizeof(sprite_t*)*r->allocatedsprites);
+			rt->allocatedsprites+=HUNK_SPRITES;
+			rt->spritelist = (spriteref_t*)realloc(rt->spritelist,
+					sizeof(spriteref_t)*rt->allocatedsprites);
 		}
-		memcpy(&r->spritelist[r->numsprites++],i,sizeof(sprite_t*));
-	
-		(*i)->renderflag = 1;
+		rt->numsprites++;
 	}
+	ref = &rt->spritelist[i];
 	
-	(*i)->mingrad = mingrad;
-	(*i)->maxgrad = maxgrad;
+	ref->sprite = s;
+	ref->mingrad = mingrad;
+	ref->maxgrad = maxgrad;
+	ref->dist = dist;
+	ref->texoffset = texoffset;
 	
 	return;
 }
@@ -541,6 +770,7 @@ linelineintersect ( vector2d_t *origin, vector2d_t *dir, vector2d_t *vert1,
 {
 	float d,dp1,dp2;
 	
+	COUNT(lineintersects,1);
 	d=dotproduct(dir,normal);
 	if(d==0.0f)
 		return 0;
@@ -568,79 +798,76 @@ linelineintersect ( vector2d_t *origin, vector2d_t *dir, vector2d_t *vert1,
 	return 0;
 }
 
+/* makeintersection
+ *
+ * Fill in in for a ray from origin leaving platform p through its edge i,
+ * dist along dir.
+ */
+void
+makeintersection ( platform_t *p, int i, vector2d_t *origin,
+		vector2d_t *dir, float dist, float prevdist, intersection_t *in )
+{
+	edge_t *e=p->edges[i];
+
+	vectorscale(dir,dist,&in->pos);
+	vectoradd(&in->pos,origin,&in->pos);
+	in->distance = dist + prevdist;
+	in->edge = e;
+	in->edgeindex = i;
+	in->final = 0;
+	in->platform = e->leftplat != p ? e->leftplat : e->rightplat;
+	in->texoffset = dotproduct(&in->pos,&e->line)
+		- dotproduct(&e->verts[0]->pos,&e->line);
+}
+
 /* check for intersections of the passed ray with the specified platform */
 intersection_t *
 edgeintersect ( raycaster_t *r, platform_t *p, vector2d_t *dir, 
 		vector2d_t *passedorigin, float prevdist, 
 		intersection_t *intersection, edge_t *ignoreedge)
 {
-	vector2d_t poi,origin;
-	int i,first,done;
-	float dist,mindist=0.0f,texoffset;
-	platform_t *nextplatform;
-	intersection_t in;
-	edge_t *e;
+	vector2d_t origin;
+	float dist;
+	int i;
 	
 	vectorcopy(&origin,passedorigin);
 	
-	first = 1;
-	done = 0;
-	for(i=0;i<p->numedges;i++)
-	{
-		e=p->edges[i];
-		
-		if(!linelineintersect(&origin,dir,&e->verts[0]->pos,
-					&e->verts[1]->pos,&e->normal,&e->line,
-					&dist,&texoffset,&poi))
-		{
-			continue;
-		}
+	COUNT(edgeintersects,1);
+	COUNT(edgestested,p->numedges);
+	i = edgekernel(&p->edgearrays,&origin,dir,&dist);
+	if(i < 0)
+		return NULL;
+	makeintersection(p,i,&origin,dir,dist,prevdist,intersection);
+	return intersection;
+}
 
-		// Determine what the next platform is, and check that it's in the forward
-		// direction.
-		if(e->leftplat != p)
-		{
-			if (dotproduct(&e->normal, dir) > 0.0f)
-				continue;
-			nextplatform = e->leftplat;
-		}
-		else if(e->rightplat != p)
-		{
-			if (dotproduct(&e->normal, dir) < 0.0f)
-				continue;
-			nextplatform = e->rightplat;
-		}
-		else
-		{
-			printf("edgeintersect() problem\n");
-			nextplatform = NULL;
-		}
+#define TRACE_NUDGE	0.001f	/* how far on a trace looks to find where it is going */
 
-		if(first || dist < mindist)
-		{
-			mindist = dist;
-			first = 0;
-		} else
-		{
-			continue;
-		}
-		
-		vectorcopy(&in.pos,&poi);
-		in.distance = dist + prevdist;
-		in.edge = e;
-		in.final = 0;
-		in.platform = nextplatform;
-		
-		in.texoffset = texoffset;
-		done = 1;
-	}
-	if(!done)
-	{
-		printf("No intersection!\n");
+/* traceintersect
+ *
+ * edgeintersect for traces which can start on an edge of *p, heading out
+ * of it: things standing on the joins between the pieces lvlc -convex
+ * cuts platforms into, or traces through a vertex. edgeintersect finds
+ * nothing then, so the trace carries on from the platform just ahead,
+ * which *p is set to. Returns NULL if there is none, as when the trace
+ * starts outside the level.
+ */
+intersection_t *
+traceintersect ( raycaster_t *r, platform_t **p, vector2d_t *dir,
+		vector2d_t *origin, float prevdist, intersection_t *in )
+{
+	vector2d_t ahead;
+	platform_t *next;
+
+	if(edgeintersect(r,*p,dir,origin,prevdist,in,NULL))
+		return in;
+	vectorscale(dir,TRACE_NUDGE,&ahead);
+	vectoradd(origin,&ahead,&ahead);
+	next = locateplatform(r,*p,&ahead);
+	if(!next || next == *p)
 		return NULL;
-	}
-	memcpy(intersection,&in,sizeof(intersection_t));
-	return intersection;
+	*p = next;
+	return edgeintersect(r,next,dir,origin,prevdist,in,NULL);
 }
 
 /* sets intersection to the nearest point on the line where the cylinder either
@@ -767,244 +994,623 @@ checkdone( int first, float high, float low, intersection_t *hi,
 	return 0;
 }
 
-#define SCREEN_DISTANCE	1.0f
-#define TAN_FOV		1.0f	/* tan(45) */
-#define HALF_SCREEN_HEIGHT	(SCREEN_HEIGHT>>1)
+#define SCREEN_DISTANCE	1.0f
+#define TAN_FOV		1.0f	/* tan(45) */
+
+int halfframeheight;
+float pixeltogradcoefficent;
+float
+pixeltogradslow ( int pixel )
+{
+	return (float)(pixel-halfframeheight)*pixeltogradcoefficent;
+}
+
+/* One entry per row of the frame, rebuilt by pixeltogradinit whenever
+ * the frame changes size.
+ */
+float *pixeltograd;
+float *invpixeltograd;
+int *invpixeltogradint;
+float *pixelfootprint;
+float gradtopixelcoefficent;
+
+/* pixeltogradinit
+ *
+ * Set up the projection for a frame of width by height pixels.
+ */
+void
+pixeltogradinit ( int width, int height )
+{
+	int i=0;
+
+	halfframeheight = height>>1;
+	gradtopixelcoefficent = -(float)(width*halfframeheight)/((float)height*TAN_FOV);
+	pixeltogradcoefficent = -(TAN_FOV*(float)height/(float)width)/(float)halfframeheight;
+
+	pixeltograd = (float*)realloc(pixeltograd,sizeof(float)*height);
+	invpixeltograd = (float*)realloc(invpixeltograd,sizeof(float)*height);
+	invpixeltogradint = (int*)realloc(invpixeltogradint,sizeof(int)*height);
+	pixelfootprint = (float*)realloc(pixelfootprint,sizeof(float)*height);
+	for(i=0;i<height;i++)
+	{
+		pixeltograd[i] = pixeltogradslow(i);
+		invpixeltograd[i] = 1.0f/pixeltograd[i];
+		invpixeltogradint[i] = (int)(PRECISION_PRODUCT*invpixeltograd[i]);
+
+		/* A floor pixel at distance d is d*step wide and d*step/grad
+		 * deep; take the side of the square of the same area.
+		 */
+		pixelfootprint[i] = fabsf(pixeltogradcoefficent)*
+				powf(fabsf(invpixeltograd[i]),1.5f);
+	}
+}
+
+int
+gradtopixel ( float grad )
+{
+	return (int)(grad*gradtopixelcoefficent)+halfframeheight;
+}
+
+int
+propermodulo( int a, int b )
+{
+	if(a<0)	
+	{
+		while(a<0)
+			a+=b;
+		return a;
+	}
+	return a%b;
+}
+
+static float clamp(float v, float low, float high)
+{
+	return v < low ? low : (v > high ? high : v);
+}
+
+/* miplevel
+ *
+ * The level of t's mip chain to draw when a pixel covers footprint texels
+ * of the full size texture: the smallest level that still has at least
+ * one texel to a pixel.
+ */
+int
+miplevel ( raycaster_t *r, texture_t *t, float footprint )
+{
+	int level=0;
+
+	if(r->options.nomips)
+		return 0;
+	while(footprint >= 2.0f && level < t->nummips)
+	{
+		footprint *= 0.5f;
+		level++;
+	}
+	return level;
+}
+
+static inline texture_t *
+mipmap ( texture_t *t, int level )
+{
+	return level ? &t->mips[level-1] : t;
+}
+
+#define SPAN_FRACTION_BITS	16	/* extra precision of the span steps (-spans) */
+
+/* Texture coordinates along a row are linear in the column, so a plane's
+ * coordinates are set up once and then stepped along each span.
+ */
+typedef struct spansetup_s
+{
+	long long hx0,hy0;	/* direction*height at column 0 */
+	long long hxstep,hystep;	/* change per column */
+	int ox,oy;
+	float height;		/* of the plane from eye level, for the mip level */
+	texture_t *t;
+} spansetup_t;
+
+/* The functions that write pixels, compiled once for each pixel format
+ * from drawpixels.h. The set matching the screen is chosen at startup.
+ */
+typedef struct pixelops_s
+{
+	int bytes;		/* per pixel */
+	void (*drawwall) ( raycaster_t *r, intersection_t *in, float g1, float g2, int x );
+	void (*drawfloor) ( raycaster_t *r, platform_t *p, float h,
+			vector2d_t *dir, float g1, float g2, int x );
+	void (*drawspan) ( raycaster_t *r, spansetup_t *s, int y, int x1, int x2 );
+	void (*drawsprite) ( raycaster_t *r, spriteref_t *ref, vector2d_t *dir, int x );
+} pixelops_t;
+
+#define PIXEL		unsigned short
+#define PIXELFUNC(f)	f##16
+#define FLOORKERNEL	floorkernel
+#include "drawpixels.h"
+#undef PIXEL
+#undef PIXELFUNC
+#undef FLOORKERNEL
+
+#define PIXEL		unsigned int
+#define PIXELFUNC(f)	f##32
+#define FLOORKERNEL	floorkernel32
+#include "drawpixels.h"
+#undef PIXEL
+#undef PIXELFUNC
+#undef FLOORKERNEL
+
+/* selectpixelops
+ *
+ * Pick the drawing functions for the format the screen actually has, which
+ * may not be the depth that was asked for.
+ */
+int
+selectpixelops ( raycaster_t *r )
+{
+	switch(r->screen->format->BytesPerPixel)
+	{
+	case 2:
+		r->ops = &pixelops16;
+		return 1;
+	case 4:
+		r->ops = &pixelops32;
+		return 1;
+	}
+	fprintf(stderr, "Unsupported screen depth, %i bits per pixel\n",
+			r->screen->format->BitsPerPixel);
+	return 0;
+}
+
+/**************************************************************/
+
+/* Horizontal span floors and ceilings (-spans).
+ *
+ * drawcolumn only marks the rows of each floor and ceiling it can see.
+ * Once a thread has finished its columns the marked planes are drawn
+ * row by row, stepping the texture coordinates along each span.
+ */
+
+#define HUNK_PLANES		16
+#define HUNK_DEFERRED_SPRITES	16
+
+int
+planekey ( raycaster_t *r, platform_t *p, int surface )
+{
+	return 2*platformindex(&r->level,p) + (surface == SURFACE_CEILING);
+}
+
+visplane_t *
+newplane ( renderthread_t *rt, platform_t *p, int surface )
+{
+	raycaster_t *r=rt->raycaster;
+	visplane_t *pl;
+	int i;
+
+	if(rt->numplanes == rt->allocatedplanes)
+	{
+		rt->allocatedplanes += HUNK_PLANES;
+		rt->planes = (visplane_t*)realloc(rt->planes,
+				sizeof(visplane_t)*rt->allocatedplanes);
+		for(i=rt->numplanes;i<rt->allocatedplanes;i++)
+		{
+			/* Indexed by column+1 so that there is an empty column either side. */
+			rt->planes[i].top = (short*)malloc(sizeof(short)*(SCREEN_WIDTH+2));
+			rt->planes[i].bottom = (short*)malloc(sizeof(short)*(SCREEN_WIDTH+2));
+		}
+	}
+	pl = &rt->planes[rt->numplanes++];
+	pl->platform = p;
+	pl->surface = surface;
+	pl->minx = r->width;
+	pl->maxx = -1;
+	for(i=0;i<r->width+2;i++)
+	{
+		pl->top[i] = r->height;
+		pl->bottom[i] = -1;
+	}
+	return pl;
+}
+
+/* markplane
+ *
+ * Record that column x sees platform p's floor or ceiling between
+ * gradients g1 and g2.
+ */
+void
+markplane ( renderthread_t *rt, platform_t *p, int surface, float g1, float g2, int x )
+{
+	raycaster_t *r=rt->raycaster;
+	planekey_t *key;
+	visplane_t *pl=NULL;
+	int p1,p2;
+
+	p1 = gradtopixel(g1);
+	p2 = gradtopixel(g2);
+	
+	if(p1 < 0)
+		p1 = 0;
+	
+	if(p2 > r->height-1)
+		p2 = r->height-1;
+
+	if(p2 <= p1)
+		return;
+	COUNT(floorpixels,p2-p1);
+
+	/* A column can see the same surface twice through a concave platform,
+	 * in which case it needs a plane of its own.
+	 */
+	key = &rt->planekeys[planekey(r,p,surface)];
+	if(key->frame == r->framenum)
+		pl = &rt->planes[key->plane];
+	if(!pl || pl->top[x+1] <= pl->bottom[x+1])
+	{
+		pl = newplane(rt,p,surface);
+		key->plane = pl - rt->planes;
+		key->frame = r->framenum;
+	}
+
+	pl->top[x+1] = p1;
+	pl->bottom[x+1] = p2-1;
+	if(x < pl->minx)
+		pl->minx = x;
+	if(x > pl->maxx)
+		pl->maxx = x;
+}
+
+/* drawplane
+ *
+ * Turn the columns of a plane into horizontal spans, as Doom's
+ * R_MakeSpans does, and draw them.
+ */
+void
+drawplane ( renderthread_t *rt, visplane_t *pl )
+{
+	raycaster_t *r=rt->raycaster;
+	spansetup_t s;
+	vector2d_t side;
+	float h,scale,step;
+	int x,t1,b1,t2,b2;
+
+	if(pl->surface == SURFACE_FLOOR)
+		h = pl->platform->floorheight - r->eyelevel;
+	else
+		h = pl->platform->ceilheight - r->eyelevel;
+
+	/* Column x looks along viewdir + side*(2x/width - 1), as set up
+	 * in columndir.
+	 */
+	vectorrot90(&r->viewdir,&side);
+	scale = h*PRECISION_PRODUCT*(float)(1<<SPAN_FRACTION_BITS);
+	step = TAN_FOV*SCREEN_DISTANCE*2.0f/(float)r->width;
+	s.hx0 = (long long)((r->viewdir.x*SCREEN_DISTANCE - side.x*TAN_FOV*SCREEN_DISTANCE)*scale);
+	s.hy0 = (long long)((r->viewdir.y*SCREEN_DISTANCE - side.y*TAN_FOV*SCREEN_DISTANCE)*scale);
+	s.hxstep = (long long)(side.x*step*scale);
+	s.hystep = (long long)(side.y*step*scale);
+	s.ox = ((int)r->viewpos.x)<<DOUBLE_PRECISION_BITS;
+	s.oy = ((int)r->viewpos.y)<<DOUBLE_PRECISION_BITS;
+	s.height = fabsf(h);
+	s.t = pl->platform->texture;
+
+	for(x=pl->minx;x<=pl->maxx+1;x++)
+	{
+		t1 = pl->top[x];	/* column x-1 */
+		b1 = pl->bottom[x];
+		t2 = pl->top[x+1];	/* column x */
+		b2 = pl->bottom[x+1];
+
+		while(t1 < t2 && t1 <= b1)
+		{
+			r->ops->drawspan(r,&s,t1,rt->spanstart[t1],x-1);
+			t1++;
+		}
+		while(b2 < b1 && t1 <= b1)
+		{
+			r->ops->drawspan(r,&s,b1,rt->spanstart[b1],x-1);
+			b1--;
+		}
+		while(t2 < t1 && t2 <= b2)
+		{
+			rt->spanstart[t2] = x;
+			t2++;
+		}
+		while(b1 < b2 && t2 <= b2)
+		{
+			rt->spanstart[b2] = x;
+			b2--;
+		}
+	}
+}
+
+void
+drawsprites( renderthread_t *rt, vector2d_t *dir, int x )
+{
+	int i;
+	
+	for(i=0;i<rt->numsprites;i++)
+		rt->raycaster->ops->drawsprite(rt->raycaster,&rt->spritelist[i],dir,x);
+}
+
+void
+defersprites ( renderthread_t *rt, int x )
+{
+	int i;
+
+	for(i=0;i<rt->numsprites;i++)
+	{
+		if(rt->numdeferred == rt->allocateddeferred)
+		{
+			rt->allocateddeferred += HUNK_DEFERRED_SPRITES;
+			rt->deferred = (deferredsprite_t*)realloc(rt->deferred,
+					sizeof(deferredsprite_t)*rt->allocateddeferred);
+		}
+		rt->deferred[rt->numdeferred].ref = rt->spritelist[i];
+		rt->deferred[rt->numdeferred].x = x;
+		rt->numdeferred++;
+	}
+}
+
+/* drawplanes
+ *
+ * Draw the floors and ceilings marked by this thread's columns and then
+ * the sprites which were waiting to go on top of them.
+ */
+void
+drawplanes ( renderthread_t *rt )
+{
+	int i;
+
+	for(i=0;i<rt->numplanes;i++)
+		drawplane(rt,&rt->planes[i]);
+	for(i=0;i<rt->numdeferred;i++)
+		rt->raycaster->ops->drawsprite(rt->raycaster,&rt->deferred[i].ref,NULL,rt->deferred[i].x);
+	rt->numplanes = 0;
+	rt->numdeferred = 0;
+}
+
+/**************************************************************/
 
-float pixeltogradcoefficent;
-float
-pixeltogradslow ( int pixel )
+/* Packet tracing (-packets).
+ *
+ * Neighbouring columns nearly always cross the same platforms, so
+ * PACKET_SIZE of them are traced together, testing each platform's edges
+ * against all the rays at once. The packet stays together for as long as
+ * every ray still being traced moves on to the same platform. The
+ * intersections found are kept in a chain per column for drawcolumn,
+ * which traces the rest of a column itself once the packet splits up.
+ */
+
+#define HUNK_CHAIN	16
+
+/* Enough of drawcolumn's state to tell when a column is finished. */
+typedef struct columnstate_s
 {
-	return (float)(pixel-HALF_SCREEN_HEIGHT)*pixeltogradcoefficent;
-}
+	float maxfloorgrad,minceilgrad;
+	float prevfloorgrad,prevceilgrad;
+} columnstate_t;
 
-float pixeltograd[SCREEN_HEIGHT];
-float invpixeltograd[SCREEN_HEIGHT];
-int invpixeltogradint[SCREEN_HEIGHT];
 void
-pixeltogradinit ( void )
+tracefloor ( columnstate_t *c, float grad )
 {
-	int i=0;
-	for(i=0;i<SCREEN_HEIGHT;i++)
-	{
-		pixeltograd[i] = pixeltogradslow(i);
-		invpixeltograd[i] = 1.0f/pixeltograd[i];
-		invpixeltogradint[i] = (int)(PRECISION_PRODUCT*invpixeltograd[i]);
-	}
-}
+	float g1,g2;
 
-float gradtopixelcoefficent;
-int
-gradtopixel ( float grad )
-{
-	return (int)(grad*gradtopixelcoefficent)+HALF_SCREEN_HEIGHT;
+	g2 = clamp(c->prevfloorgrad, c->maxfloorgrad, c->minceilgrad);
+	g1 = clamp(grad, c->maxfloorgrad, c->minceilgrad);
+	if (g2 < g1)
+		c->maxfloorgrad = g1;
+	c->prevfloorgrad = grad;
 }
 
 void
-drawvertline ( raycaster_t *r, float g1, float g2, int x, int re, int g, int b )
+traceceiling ( columnstate_t *c, float grad )
 {
-	unsigned short *pixel;
-	int p1,p2,t,y;
-	p1 = gradtopixel(g1);
-	p2 = gradtopixel(g2);
-	if(p2 < p1)
-	{
-		t=p1;
-		p1=p2;
-		p2=t;
-	}
-	if(p1 < 0)
-		p1 = 0;
-	else if(p1 > SCREEN_HEIGHT-1)
-		p1 = SCREEN_HEIGHT-1;
-	if(p2 < 0)
-		p2 = 0;
-	else if(p2 > SCREEN_HEIGHT-1)
-		p2 = SCREEN_HEIGHT-1;
+	float g1,g2;
 
-	pixel = ((unsigned short*)r->screen->pixels)+(p1)*SCREEN_WIDTH+(x);
-	for(y=p1;y<p2;y++)
-	{
-		*pixel = SDL_MapRGB(r->screen->format, re,g,b);
-		pixel += SCREEN_WIDTH;
-	}
+	g1 = clamp(c->prevceilgrad, c->maxfloorgrad, c->minceilgrad);
+	g2 = clamp(grad, c->maxfloorgrad, c->minceilgrad);
+	if (g2 < g1)
+		c->minceilgrad = g2;
+	c->prevceilgrad = grad;
 }
 
+/* Returns whether the column can see past the intersection. */
 int
-propermodulo( int a, int b )
+traceintersection ( raycaster_t *r, columnstate_t *c, platform_t *prevplat,
+		intersection_t *in )
 {
-	if(a<0)	
+	tracefloor(c, (prevplat->floorheight - r->eyelevel) / in->distance);
+	traceceiling(c, (prevplat->ceilheight - r->eyelevel) / in->distance);
+	tracefloor(c, (in->platform->floorheight - r->eyelevel) / in->distance);
+	traceceiling(c, (in->platform->ceilheight - r->eyelevel) / in->distance);
+	return c->maxfloorgrad < c->minceilgrad;
+}
+
+intersection_t *
+chainentry ( renderthread_t *rt, int column )
+{
+	int i;
+
+	if(rt->chainlength[column] == rt->allocatedchain)
 	{
-		while(a<0)
-			a+=b;
-		return a;
+		rt->allocatedchain += HUNK_CHAIN;
+		for(i=0;i<PACKET_SIZE;i++)
+			rt->chains[i] = (intersection_t*)realloc(rt->chains[i],
+					sizeof(intersection_t)*rt->allocatedchain);
 	}
-	return a%b;
+	return &rt->chains[column][rt->chainlength[column]++];
 }
 
-/* drawwall
+/* tracepacket
  *
- * Draw a piece of a wall, between gradients g1 and g2
+ * Trace the PACKET_SIZE columns looking along dirs from the view into
+ * rt->chains. Where the rays go into different platforms the packet is
+ * split, and the rays in each platform are traced together; a ray alone
+ * in its platform is traced on its own.
  */
-inline void
-drawwall ( raycaster_t *r, intersection_t *in, float g1, float g2, int x )
+void
+tracepacket ( renderthread_t *rt, vector2d_t *dirs )
 {
-	unsigned short *pixel,*tpixel;
-	int p1,p2,y,tx,ty,i,h1,h2;
-	texture_t *t=in->edge->texture;
-	
-	p1 = gradtopixel(g1);
-	p2 = gradtopixel(g2);
-	if(p2 == p1)
-		return;
-
-	/* Clamp p1,p2 and the corresponding values of h1,h2 to the screen.
-	 */
-	if(p1 < 0)
-		p1 = 0;
-
-	if(p2 > SCREEN_HEIGHT-1)
-		p2 = SCREEN_HEIGHT-1;
-
-	h1 = (int)(PRECISION_PRODUCT * (r->eyelevel + pixeltograd[p1] * in->distance));
-	h2 = (int)(PRECISION_PRODUCT * (r->eyelevel + pixeltograd[p2] * in->distance));
+	raycaster_t *r=rt->raycaster;
+	columnstate_t c[PACKET_SIZE];
+	vector2d_t origins[PACKET_SIZE];
+	float dists[PACKET_SIZE],prevdists[PACKET_SIZE];
+	int edges[PACKET_SIZE];
+	platform_t *platforms[PACKET_SIZE],*p;
+	intersection_t *in;
+	int i,first,active,group;
+
+	for(i=0;i<PACKET_SIZE;i++)
+	{
+		c[i].maxfloorgrad = pixeltograd[r->height-1];
+		c[i].minceilgrad = pixeltograd[0];
+		c[i].prevfloorgrad = -INFINITY;
+		c[i].prevceilgrad = +INFINITY;
+		vectorcopy(&origins[i],&r->viewpos);
+		prevdists[i] = 0.0f;
+		rt->chainlength[i] = 0;
+		platforms[i] = r->currentplatform;
+	}
 
-	tx = ((int)in->texoffset)&(t->widthmask);
-	i = ((h2-h1)/(p2-p1)) & t->heightmasksmallshift;
-	ty = h1 & t->heightmasksmallshift;
-	pixel = ((unsigned short*)r->screen->pixels)+(p1)*SCREEN_WIDTH+(x);
-	tpixel = &t->pixels[tx<<t->log2height];
-	for(y=p1;y<p2;y++)
+	active = (1<<PACKET_SIZE)-1;
+	while(active)
 	{
-		*pixel = tpixel[ty>>PRECISION_BITS];
+		/* The rays in the same platform as the first still going. */
+		first = __builtin_ctz(active);
+		p = platforms[first];
+		group = 0;
+		for(i=first;i<PACKET_SIZE;i++)
+		{
+			if((active & (1<<i)) && platforms[i] == p)
+				group |= 1<<i;
+		}
 
-		/* Recalculate the vertical texture pixel `ty`. Most of the time do this by
-		 * adding on a constant but periodically do an expensive recalculation. This is
-		 * to mitigate acculated rounding errors in the increment value `i`.
-		 */
-		if ((y & 0xF) == 0)
-			ty = ((h2 * (y - p1) + h1 * (p2 - y)) / (p2 - p1)) & t->heightmasksmallshift;
+		COUNT(edgeintersects,1);
+		COUNT(edgestested,p->numedges);
+		if(group == (1<<first))
+			edges[first] = edgekernel(&p->edgearrays,&origins[first],&dirs[first],
+					&dists[first]);
 		else
-			ty = (ty+i)&(t->heightmasksmallshift);
-		pixel += SCREEN_WIDTH;
+			packetkernel(&p->edgearrays,origins,dirs,edges,dists);
+
+		for(i=first;i<PACKET_SIZE;i++)
+		{
+			if(!(group & (1<<i)))
+				continue;
+			if(edges[i] < 0)
+			{
+				/* The lane drops out and its column's trace
+				 * ends here; drawcolumn still counts the
+				 * column.
+				 */
+				active &= ~(1<<i);
+				continue;
+			}
+			in = chainentry(rt,i);
+			makeintersection(p,edges[i],&origins[i],&dirs[i],
+					dists[i],prevdists[i],in);
+			vectorcopy(&origins[i],&in->pos);
+			prevdists[i] = in->distance;
+			platforms[i] = in->platform;
+
+			if(!traceintersection(r,&c[i],p,in))
+				active &= ~(1<<i);
+		}
 	}
 }
 
+/**************************************************************/
 
-/* drawfloor
+/* Column cache.
  *
- * h is the distance the floor is above or below current eye level
- *   it is required for correct texture mapping
+ * Each column keeps the intersections it went through, in columncache.
+ * When the view has not moved the next frame draws from them without any
+ * edge tests. When it has only turned, each column starts from the chain
+ * of the old column that looked nearest its way, testing just the edge
+ * that column left each platform by. In a convex platform a ray which
+ * leaves through an edge, clear of its ends, can leave through no other,
+ * so the guess either gives what edgeintersect would or is thrown away.
  */
-inline void
-drawfloor ( raycaster_t *r, platform_t *p, float h,
-		vector2d_t *dir, float g1, float g2, int x )
+
+/* How far from the end of an edge a guessed intersection has to be. */
+#define GUESS_MARGIN	0.01f
+
+/* Where drawcolumn gets its intersections from. */
+typedef struct columntrace_s
 {
-	unsigned short *pixel;
-	int p1,p2,y,ty,tx;;
-	int hdirx,hdiry,ox,oy;
-	texture_t *t;
-	
-	p1 = gradtopixel(g1);
-	p2 = gradtopixel(g2);
-	
-	if(p1 < 0)
-		p1 = 0;
-	
-	if(p2 > SCREEN_HEIGHT-1)
-		p2 = SCREEN_HEIGHT-1;
-	
-	pixel = ((unsigned short*)r->screen->pixels)+(p1)*SCREEN_WIDTH+(x);
-	hdirx = (int)(dir->x*h*PRECISION_PRODUCT);
-	hdiry = (int)(dir->y*h*PRECISION_PRODUCT);
-	ox = ((int)r->viewpos.x)<<DOUBLE_PRECISION_BITS;
-	oy = ((int)r->viewpos.y)<<DOUBLE_PRECISION_BITS;
-	
-	t=p->texture;
-	for(y=p1;y<p2;y++)
-	{
-		tx = (hdirx*invpixeltogradint[y]+ox)&(p->texture->widthmaskshift);
-		ty = (hdiry*invpixeltogradint[y]+oy)&(p->texture->heightmaskshift);
-		
-		*pixel = t->pixels[(ty>>DOUBLE_PRECISION_BITS)+((tx>>DOUBLE_PRECISION_BITS)<<t->log2height)];
-		
-		pixel += SCREEN_WIDTH;
-	}
-}
+	intersection_t *chain;	/* traced already, used as they are */
+	int chainlength;
+	intersection_t *guess;	/* another column's, whose edges are tried first */
+	int guesslength;
+	columncache_t *cache;	/* where this column's intersections are kept */
+	int n;			/* intersections so far */
+} columntrace_t;
 
-static float clamp(float v, float low, float high)
+void
+keepintersection ( columncache_t *c, intersection_t *in )
 {
-	return v < low ? low : (v > high ? high : v);
+	if(c->length == c->allocated)
+	{
+		c->allocated += HUNK_CHAIN;
+		c->chain = (intersection_t*)realloc(c->chain,
+				sizeof(intersection_t)*c->allocated);
+	}
+	memcpy(&c->chain[c->length++],in,sizeof(intersection_t));
 }
 
-void
-drawsprite ( raycaster_t *r, sprite_t *s, vector2d_t *dir, int x )
+/* nextintersection
+ *
+ * The next intersection of a column, from its chain if it was traced
+ * already, otherwise from its guess or with edgeintersect.
+ */
+intersection_t *
+nextintersection ( raycaster_t *r, platform_t *p, vector2d_t *dir,
+		vector2d_t *origin, float prevdist, intersection_t *in,
+		columntrace_t *t )
 {
-	float sprmingrad,sprmaxgrad,mingr,maxgr;
-	int i,y;
-	int p1,p2,p1b,p2b,ty,tx,h1=s->heights[0],h2=s->heights[1];
-	unsigned short *pixel,*tpixel;
-	texture_t *t=s->texture;
-	
-	sprmingrad = (s->heights[0]-r->eyelevel)/s->dist;
-	sprmaxgrad = (s->heights[1]-r->eyelevel)/s->dist;
+	intersection_t *g;
+	vector2d_t start;
+	float dist;
+	int found=0;
 
-	p1b = gradtopixel(sprmaxgrad);
-	p2b = gradtopixel(sprmingrad);
-	
-	if(sprmingrad > s->mingrad)
-	{
-		mingr = sprmingrad;
-		p2 = p2b;
-	} else
+	if(t->n < t->chainlength)
 	{
-		mingr = s->mingrad;
-		p2 = gradtopixel(mingr);
+		memcpy(in,&t->chain[t->n],sizeof(intersection_t));
+		found = 1;
 	}
-	
-	if(sprmaxgrad < s->maxgrad)
-	{
-		maxgr = sprmaxgrad;
-		p1 = p1b;
-	} else
+	else if(t->n < t->guesslength)
 	{
-		maxgr = s->maxgrad;
-		p1 = gradtopixel(maxgr);
+		g = &t->guess[t->n];
+		if(p->convex && g->edgeindex < p->numedges && p->edges[g->edgeindex] == g->edge
+				&& exitsthroughedge(&p->edgearrays,g->edgeindex,origin,dir,
+					GUESS_MARGIN,&dist))
+		{
+			/* origin may be in->pos. */
+			vectorcopy(&start,origin);
+			makeintersection(p,g->edgeindex,&start,dir,dist,prevdist,in);
+			found = 1;
+		}
+		else
+		{
+			/* It has gone another way, so the rest of the guess is no use. */
+			t->guesslength = 0;
+		}
 	}
+	if(!found && !edgeintersect(r,p,dir,origin,prevdist,in,NULL))
+		return NULL;
 
-	if(p1 < 0)
-		p1 = 0;
-	if(p2 > SCREEN_HEIGHT-1)
-		p2 = SCREEN_HEIGHT-1;
-	
-	tx = ((int)s->texoffset)%(t->widthmask);
-	pixel = ((unsigned short*)r->screen->pixels)+(p1)*SCREEN_WIDTH+(x);
-	tpixel = &t->pixels[tx<<t->log2height];
-	ty = ((((p1-p1b)*(h2-h1))<<PRECISION_BITS)/
-			(p2b-p1b))&(t->heightmasksmallshift);
-	i = ((h2-h1)<<PRECISION_BITS)/(p2b-p1b);
-
-	for(y=p1;y<p2;y++)
-	{
-		if(tpixel[ty>>PRECISION_BITS] != r->transpixel)
-			*pixel = tpixel[ty>>PRECISION_BITS];
-		ty = (ty+i)&(t->heightmasksmallshift);
-		pixel += SCREEN_WIDTH;
-	}	
+	/* A replayed chain is only added to once the column gets further. */
+	t->n++;
+	if(t->cache && t->cache->length < t->n)
+		keepintersection(t->cache,in);
+	return in;
 }
 
-void
-drawsprites( raycaster_t *r, vector2d_t *dir, int x )
+/* Count a traced column, however its trace ended. */
+static inline void
+countcolumn ( int crossed )
 {
-	int i;
-	sprite_t *s;
-	
-	for(i=0;i<r->numsprites;i++)
-	{
-		s = r->spritelist[i];
-		drawsprite(r,s,dir,x);
-		s->renderflag = 0;
-	}
+	COUNT(columns,1);
+	COUNT(platformscrossed,crossed);
+	COUNTMAX(maxplatformscrossed,crossed);
 }
 
 /* drawcolumn
@@ -1015,15 +1621,18 @@ drawsprites( raycaster_t *r, vector2d_t *dir, int x )
  * x is the column we are drawing.
  */
 void
-drawcolumn ( raycaster_t *r, vector2d_t *dir, int x )
+drawcolumn ( renderthread_t *rt, vector2d_t *dir, int x, columntrace_t *t )
 {
 	int i;
+	raycaster_t *r=rt->raycaster;
 	intersection_t in;
 	float floorgrad, ceilgrad;
 	float prevfloorgrad, prevceilgrad;
 	float maxfloorgrad, minceilgrad;
 	float g1,g2;
 	float prevdist;
+	float sdist,stexoffset;
+	int crossed=0;
 	platform_t *prevplat;
 	sprite_t *s;	
 	vector2d_t poi;
@@ -1036,7 +1645,7 @@ drawcolumn ( raycaster_t *r, vector2d_t *dir, int x )
      * When stepping through also add sprites to a list of sprites to be
      * drawn. The sprites are rendered last.
      */
-	maxfloorgrad = pixeltograd[SCREEN_HEIGHT-1];    /* Highest floor gradient so far. */
+	maxfloorgrad = pixeltograd[r->height-1];        /* Highest floor gradient so far. */
 	minceilgrad = pixeltograd[0];                   /* Lowest ceiling gradient so far. */
 
 	prevfloorgrad = -INFINITY; /* Straight down. */
@@ -1045,10 +1654,13 @@ drawcolumn ( raycaster_t *r, vector2d_t *dir, int x )
 	prevplat = r->currentplatform;
 	prevdist = 0.0f;
 
-	r->numsprites = 0;
+	rt->numsprites = 0;
 
-	if (edgeintersect(r, prevplat, dir, &r->viewpos, 0.0f, &in, NULL) == NULL)
+	if (nextintersection(r, prevplat, dir, &r->viewpos, 0.0f, &in, t) == NULL)
+	{
+		countcolumn(crossed);
 		return;
+	}
 	while(maxfloorgrad < minceilgrad)
 	{
 		/* Add sprites to list to be rendered. */
@@ -1056,11 +1668,33 @@ drawcolumn ( raycaster_t *r, vector2d_t *dir, int x )
 		{
 			s=prevplat->sprites[i];
 			if(linelineintersect(&r->viewpos,dir,&s->verts[0],&s->verts[1],
-				&s->normal,&s->line,&s->dist,&s->texoffset,&poi) &&
-				s->dist > prevdist && s->dist < in.distance)
+				&s->normal,&s->line,&sdist,&stexoffset,&poi) &&
+				sdist > prevdist && sdist < in.distance)
+			{
+				addspritetolist(rt,s,maxfloorgrad,minceilgrad,sdist,stexoffset);
+			}
+		}
+
+		/* Where nothing changes across the edge, as between the pieces
+		 * lvlc splits a platform into, carry on to the next edge and draw
+		 * both platforms' floor and ceiling in one go. The platform must
+		 * have no sprites, as they would be clipped against what has been
+		 * drawn before it.
+		 */
+		if(in.platform->floorheight == prevplat->floorheight &&
+				in.platform->ceilheight == prevplat->ceilheight &&
+				in.platform->texture == prevplat->texture &&
+				!in.platform->numsprites)
+		{
+			prevplat = in.platform;
+			prevdist = in.distance;
+			crossed++;
+			if(nextintersection(r, prevplat, dir, &in.pos, prevdist, &in, t) == NULL)
 			{
-				addspritetolist(r,&prevplat->sprites[i],maxfloorgrad,minceilgrad);
+				countcolumn(crossed);
+				return;
 			}
+			continue;
 		}
 
 		/* Draw floor from prev platform to current platform. */
@@ -1069,7 +1703,10 @@ drawcolumn ( raycaster_t *r, vector2d_t *dir, int x )
 		g1 = clamp(floorgrad, maxfloorgrad, minceilgrad);
 		if (g2 < g1)
 		{
-			drawfloor(r, prevplat, prevplat->floorheight - r->eyelevel, dir, g1, g2, x);
+			if(r->options.spans)
+				markplane(rt, prevplat, SURFACE_FLOOR, g1, g2, x);
+			else
+				r->ops->drawfloor(r, prevplat, prevplat->floorheight - r->eyelevel, dir, g1, g2, x);
 			maxfloorgrad = g1;
 		}
 		prevfloorgrad = floorgrad;
@@ -1080,7 +1717,10 @@ drawcolumn ( raycaster_t *r, vector2d_t *dir, int x )
 		g2 = clamp(ceilgrad, maxfloorgrad, minceilgrad);
 		if (g2 < g1)
 		{
-			drawfloor(r, prevplat, prevplat->ceilheight - r->eyelevel, dir, g1, g2, x);
+			if(r->options.spans)
+				markplane(rt, prevplat, SURFACE_CEILING, g1, g2, x);
+			else
+				r->ops->drawfloor(r, prevplat, prevplat->ceilheight - r->eyelevel, dir, g1, g2, x);
 			minceilgrad = g2;
 		}
 		prevceilgrad = ceilgrad;
@@ -1091,50 +1731,481 @@ drawcolumn ( raycaster_t *r, vector2d_t *dir, int x )
 		g1 = clamp(floorgrad, maxfloorgrad, minceilgrad);
 		if (g2 < g1)
 		{
-			drawwall(r, &in, g1, g2, x);
+			r->ops->drawwall(r, &in, g1, g2, x);
 			maxfloorgrad = g1;
 		}
 		prevfloorgrad = floorgrad;
 
-		/* Draw wall from prev ceiling to current ceiling. */
-		ceilgrad = (in.platform->ceilheight - r->eyelevel) / in.distance;
-		g1 = clamp(prevceilgrad, maxfloorgrad, minceilgrad);
-		g2 = clamp(ceilgrad, maxfloorgrad, minceilgrad);
-		if (g2 < g1)
-		{
-			drawwall(r, &in, g1, g2, x);
-			minceilgrad = g2;
-		}
-		prevceilgrad = ceilgrad;
+		/* Draw wall from prev ceiling to current ceiling. */
+		ceilgrad = (in.platform->ceilheight - r->eyelevel) / in.distance;
+		g1 = clamp(prevceilgrad, maxfloorgrad, minceilgrad);
+		g2 = clamp(ceilgrad, maxfloorgrad, minceilgrad);
+		if (g2 < g1)
+		{
+			r->ops->drawwall(r, &in, g1, g2, x);
+			minceilgrad = g2;
+		}
+		prevceilgrad = ceilgrad;
+
+		prevplat = in.platform;
+		prevdist = in.distance;
+		crossed++;
+		if (maxfloorgrad < minceilgrad)
+			if (nextintersection(r, prevplat, dir, &in.pos, prevdist, &in, t) == NULL)
+			{
+				countcolumn(crossed);
+				return;
+			}
+	}
+	countcolumn(crossed);
+
+	/* With span floors the sprites have to wait for the floors to be drawn. */
+	if(r->options.spans)
+		defersprites(rt,x);
+	else
+		drawsprites(rt,dir,x);
+}
+
+#ifdef RENDER_COUNTERS
+/* Add the counts in from onto to, and clear from. */
+void
+addcounters ( rendercounters_t *to, rendercounters_t *from )
+{
+	to->edgeintersects += from->edgeintersects;
+	to->edgestested += from->edgestested;
+	to->lineintersects += from->lineintersects;
+	to->columns += from->columns;
+	to->platformscrossed += from->platformscrossed;
+	if(from->maxplatformscrossed > to->maxplatformscrossed)
+		to->maxplatformscrossed = from->maxplatformscrossed;
+	to->wallpixels += from->wallpixels;
+	to->floorpixels += from->floorpixels;
+	to->spritepixels += from->spritepixels;
+	to->pickplatforms += from->pickplatforms;
+	to->pointedges += from->pointedges;
+	to->locates += from->locates;
+	to->locatemisses += from->locatemisses;
+	memset(from,0,sizeof(rendercounters_t));
+}
+#endif
+
+void
+resetcounters ( raycaster_t *r )
+{
+#ifdef RENDER_COUNTERS
+	int i;
+
+	memset(&threadcounters,0,sizeof(rendercounters_t));
+	for(i=0;i<r->pool.numthreads;i++)
+		memset(&r->threads[i].counters,0,sizeof(rendercounters_t));
+#endif
+}
+
+/* reportcounters
+ *
+ * Print the hot path counts gathered since the last report as averages
+ * over frames frames, and reset them.
+ */
+void
+reportcounters ( raycaster_t *r, int frames )
+{
+#ifdef RENDER_COUNTERS
+	rendercounters_t c;
+	double f;
+	int i;
+
+	memset(&c,0,sizeof(c));
+	addcounters(&c,&threadcounters);	/* counted outside drawscene */
+	for(i=0;i<r->pool.numthreads;i++)
+		addcounters(&c,&r->threads[i].counters);
+
+	if(frames < 1)
+		frames = 1;
+	f = 1.0/frames;
+	printf("per frame: edgeintersect %.0f (%.0f edges) linelineintersect %.0f "
+		"platforms crossed %.2f per column (max %lli)\n",
+		f*c.edgeintersects, f*c.edgestested, f*c.lineintersects,
+		c.columns ? (double)c.platformscrossed/c.columns : 0.0,
+		c.maxplatformscrossed);
+	printf("per frame: pixels wall %.0f floor %.0f sprite %.0f "
+		"pickplatform %.1f (%.0f edges) locateplatform %.1f (%.1f fell back)\n",
+		f*c.wallpixels, f*c.floorpixels, f*c.spritepixels,
+		f*c.pickplatforms, f*c.pointedges, f*c.locates, f*c.locatemisses);
+#endif
+}
+
+/* The direction column x looks in. Not normalised. */
+void
+columndir ( raycaster_t *r, int x, vector2d_t *v )
+{
+	vector2d_t temp;
+
+	vectorrot90(&r->viewdir,&temp);
+	vectorscale(&r->viewdir,SCREEN_DISTANCE,v);
+	vectorscale(&temp,TAN_FOV*SCREEN_DISTANCE*
+			((2.0f*(float)x/(float)r->width)-1.0f),&temp);
+	vectoradd(v,&temp,v);
+}
+
+/* The column of the last frame which looked nearest to dir, or -1. */
+int
+oldcolumn ( raycaster_t *r, vector2d_t *dir )
+{
+	vector2d_t side;
+	float ahead,across;
+	int x;
+
+	/* Undo columndir using the view direction of the last frame. */
+	vectorrot90(&r->cacheviewdir,&side);
+	ahead = dotproduct(dir,&r->cacheviewdir);
+	across = dotproduct(dir,&side);
+	if(ahead <= 0.0f)
+		return -1;
+	x = (int)floorf((across/(ahead*TAN_FOV)+1.0f)*0.5f*r->width + 0.5f);
+	if(x < 0 || x >= r->width)
+		return -1;
+	return x;
+}
+
+/* startcolumntrace
+ *
+ * Set up t for column x, looking along dir, from the column cache.
+ */
+void
+startcolumntrace ( raycaster_t *r, int x, vector2d_t *dir, columntrace_t *t )
+{
+	columncache_t *c;
+	int old;
+
+	memset(t,0,sizeof(*t));
+	if(!r->columncache)
+		return;
+	c = t->cache = &r->columncache[x];
+	switch(r->cachemode)
+	{
+	case CACHE_REPLAY:
+		t->chain = c->chain;
+		t->chainlength = c->length;
+		return;
+	case CACHE_ROTATED:
+		if((old = oldcolumn(r,dir)) >= 0)
+		{
+			t->guess = r->oldcolumncache[old].chain;
+			t->guesslength = r->oldcolumncache[old].length;
+		}
+		break;
+	case CACHE_NONE:
+		break;
+	}
+	c->length = 0;
+}
+
+/* drawcolumns
+ *
+ * Thread job for drawscene. Columns are handed out in batches from
+ * work-stealing queues, so a thread which finishes its share early helps
+ * with the columns that cross the most platforms.
+ */
+void
+drawcolumns ( void *data, int thread )
+{
+	renderthread_t *rt=&((raycaster_t*)data)->threads[thread];
+	raycaster_t *r=rt->raycaster;
+	int i,x,batch,lastcolumn;
+	long long start,busy=0;
+	vector2d_t v,dirs[PACKET_SIZE];
+	columntrace_t t;
+	
+	while((batch = nextworkitem(r->queues,r->pool.numthreads,thread)) >= 0)
+	{
+		start = nanotime();
+		x = batch*r->options.batchsize;
+		lastcolumn = x+r->options.batchsize;
+		if(lastcolumn > r->width)
+			lastcolumn = r->width;
+		while(x<lastcolumn)
+		{
+			if(r->options.packets && r->cachemode == CACHE_NONE
+					&& x+PACKET_SIZE <= lastcolumn)
+			{
+				for(i=0;i<PACKET_SIZE;i++)
+					columndir(r,x+i,&dirs[i]);
+				tracepacket(rt,dirs);
+				for(i=0;i<PACKET_SIZE;i++,x++)
+				{
+					startcolumntrace(r,x,&dirs[i],&t);
+					t.chain = rt->chains[i];
+					t.chainlength = rt->chainlength[i];
+					drawcolumn(rt,&dirs[i],x,&t);
+				}
+				continue;
+			}
+			columndir(r,x,&v);
+			startcolumntrace(r,x,&v,&t);
+			drawcolumn(rt,&v,x,&t);
+			x++;
+		}
+		busy += nanotime()-start;
+	}
+	if(r->options.spans)
+	{
+		start = nanotime();
+		drawplanes(rt);
+		busy += nanotime()-start;
+	}
+
+	/* drawscene adds on the frame time once all threads have finished. */
+	rt->busytime += busy;
+	rt->idletime -= busy;
+
+#ifdef RENDER_COUNTERS
+	addcounters(&rt->counters,&threadcounters);
+#endif
+}
+
+/* Whether the frame is smaller than the screen. */
+int
+framescaled ( raycaster_t *r )
+{
+	return r->width != SCREEN_WIDTH || r->height != SCREEN_HEIGHT;
+}
+
+/* copycolumns
+ *
+ * Thread job copying a band of rows from the column buffer to the screen,
+ * or to the scale buffer. The bands are multiples of 8 rows so that they
+ * split on block edges.
+ */
+void
+copycolumns ( void *data, int thread )
+{
+	raycaster_t *r=(raycaster_t*)data;
+	renderthread_t *rt=&r->threads[thread];
+	int n=r->pool.numthreads,y1,y2;
+	long long start,busy;
+
+	start = nanotime();
+	y1 = (thread*r->height/n)&~7;
+	y2 = thread == n-1 ? r->height : ((thread+1)*r->height/n)&~7;
+	if(r->ops->bytes == 4)
+	{
+		if(framescaled(r))
+			transposecolumns32(r->scalebuffer,r->width,
+					r->columnbuffer,r->height,r->width,y1,y2);
+		else
+			transposecolumns32((unsigned int*)r->screen->pixels,r->screen->pitch/4,
+					r->columnbuffer,r->height,r->width,y1,y2);
+	} else
+	{
+		if(framescaled(r))
+			transposecolumns16(r->scalebuffer,r->width,
+					r->columnbuffer,r->height,r->width,y1,y2);
+		else
+			transposecolumns16((unsigned short*)r->screen->pixels,r->screen->pitch/2,
+					r->columnbuffer,r->height,r->width,y1,y2);
+	}
+	busy = nanotime()-start;
+	rt->busytime += busy;
+	rt->idletime -= busy;
+}
+
+/* scaleframe
+ *
+ * Thread job stretching the scale buffer over a band of the screen's rows.
+ */
+void
+scaleframe ( void *data, int thread )
+{
+	raycaster_t *r=(raycaster_t*)data;
+	renderthread_t *rt=&r->threads[thread];
+	int n=r->pool.numthreads;
+	long long start,busy;
+
+	start = nanotime();
+	if(r->ops->bytes == 4)
+		scalerows32((unsigned int*)r->screen->pixels,r->screen->pitch/4,
+				SCREEN_WIDTH,SCREEN_HEIGHT,r->scalebuffer,r->width,r->width,r->height,
+				thread*SCREEN_HEIGHT/n,(thread+1)*SCREEN_HEIGHT/n);
+	else
+		scalerows16((unsigned short*)r->screen->pixels,r->screen->pitch/2,
+				SCREEN_WIDTH,SCREEN_HEIGHT,r->scalebuffer,r->width,r->width,r->height,
+				thread*SCREEN_HEIGHT/n,(thread+1)*SCREEN_HEIGHT/n);
+	busy = nanotime()-start;
+	rt->busytime += busy;
+	rt->idletime -= busy;
+}
+
+/* choosecachemode
+ *
+ * Work out how much of the last frame's column chains this frame can use.
+ * The chains depend only on where the view is and which way it faces;
+ * eyelevel just changes how far along them each column gets, and a
+ * column which sees further than before traces on and adds to its chain.
+ */
+void
+choosecachemode ( raycaster_t *r )
+{
+	columncache_t *swap;
+
+	r->cachemode = CACHE_NONE;
+	if(!r->columncache || r->cacheplatform != r->currentplatform
+			|| r->cacheviewpos.x != r->viewpos.x
+			|| r->cacheviewpos.y != r->viewpos.y)
+		return;
+	if(r->cacheviewdir.x == r->viewdir.x && r->cacheviewdir.y == r->viewdir.y)
+	{
+		r->cachemode = CACHE_REPLAY;
+		return;
+	}
+
+	/* The new chains are written while the old ones are read. */
+	r->cachemode = CACHE_ROTATED;
+	swap = r->oldcolumncache;
+	r->oldcolumncache = r->columncache;
+	r->columncache = swap;
+}
+
+/* invalidatecolumncache
+ *
+ * Make the next frame trace every column. Needed whenever edges or
+ * vertices move.
+ */
+void
+invalidatecolumncache ( raycaster_t *r )
+{
+	r->cacheplatform = NULL;
+}
+
+#define MIN_SCALE		0.25f
+#define SCALE_STEP		0.05f	/* smallest change -target makes */
+#define FRAMETIME_SMOOTHING	0.2f
 
-		prevplat = in.platform;
-		prevdist = in.distance;
-		if (maxfloorgrad < minceilgrad)
-			if (edgeintersect(r, prevplat, dir, &in.pos, prevdist, &in, NULL) == NULL)
-				return;
+/* setresolution
+ *
+ * Draw frames at scale times the width and height of the screen from now
+ * on. The sizes are kept to multiples of 8 to suit the block copies.
+ */
+void
+setresolution ( raycaster_t *r, float scale )
+{
+	int width,height;
+
+	if(!r->scalebuffer || scale > 1.0f)
+		scale = 1.0f;
+	if(scale < MIN_SCALE)
+		scale = MIN_SCALE;
+	width = (int)(SCREEN_WIDTH*scale+4.0f)&~7;
+	height = (int)(SCREEN_HEIGHT*scale+4.0f)&~7;
+	if(width == r->width && height == r->height)
+		return;
+
+	r->width = width;
+	r->height = height;
+	r->scale = (float)width/SCREEN_WIDTH;
+	pixeltogradinit(width,height);
+	r->numbatches = (width+r->options.batchsize-1)/r->options.batchsize;
+	invalidatecolumncache(r);
+
+	if(r->columnbuffer)
+	{
+		r->pixels = r->columnbuffer;
+		r->xstep = height;
+		r->ystep = 1;
+	} else if(framescaled(r))
+	{
+		r->pixels = r->scalebuffer;
+		r->xstep = 1;
+		r->ystep = width;
+	} else
+	{
+		r->pixels = r->screen->pixels;
+		r->xstep = 1;
+		r->ystep = r->screen->pitch/r->ops->bytes;
 	}
+}
+
+/* adjustresolution
+ *
+ * Steer the frame size towards one that is drawn in options.targetms,
+ * given that the last frame took ms. The time taken goes roughly with the
+ * number of pixels, so the scale goes with the square root of how far the
+ * smoothed frame time is from the target.
+ */
+void
+adjustresolution ( raycaster_t *r, float ms )
+{
+	float scale,oldpixels;
+
+	if(r->options.targetms <= 0.0f || !r->scalebuffer)
+		return;
+	if(r->frametime <= 0.0f)
+		r->frametime = ms;
+	else
+		r->frametime += FRAMETIME_SMOOTHING*(ms-r->frametime);
+
+	scale = r->scale*sqrtf(r->options.targetms/r->frametime);
+	if(scale > 1.0f)
+		scale = 1.0f;
+	if(scale < MIN_SCALE)
+		scale = MIN_SCALE;
+	if(fabsf(scale-r->scale) < SCALE_STEP)
+		return;
 
-	drawsprites(r,dir,x);
+	/* Until the new size has been timed, expect it to take its share of
+	 * the old time.
+	 */
+	oldpixels = (float)r->width*r->height;
+	setresolution(r,scale);
+	r->frametime *= (float)r->width*r->height/oldpixels;
 }
 
 void
 drawscene ( raycaster_t *r )
 {
-	int x;
-	vector2d_t v,temp;
-	
-	for(x=0;x<SCREEN_WIDTH;x++)
+	long long start,frametime;
+	int i;
+
+	start = nanotime();
+	r->framenum++;
+	choosecachemode(r);
+	fillworkqueues(r->queues,r->pool.numthreads,r->numbatches);
+	runthreadpool(&r->pool,drawcolumns,r);
+	r->cacheplatform = r->currentplatform;
+	vectorcopy(&r->cacheviewpos,&r->viewpos);
+	vectorcopy(&r->cacheviewdir,&r->viewdir);
+	if(r->columnbuffer)
+		runthreadpool(&r->pool,copycolumns,r);
+	if(framescaled(r))
+		runthreadpool(&r->pool,scaleframe,r);
+	frametime = nanotime()-start;
+
+	for(i=0;i<r->pool.numthreads;i++)
+		r->threads[i].idletime += frametime;
+	adjustresolution(r,1.0e-6f*frametime);
+}
+
+/* Print how the column work was shared between threads since the last
+ * report.
+ */
+void
+reportthreads ( raycaster_t *r )
+{
+	renderthread_t *rt;
+	long long total;
+	int i;
+
+	printf("thread load:");
+	for(i=0;i<r->pool.numthreads;i++)
 	{
-		vectorrot90(&r->viewdir,&temp);
-		vectorscale(&r->viewdir,SCREEN_DISTANCE,&v);
-		vectorscale(&temp,TAN_FOV*SCREEN_DISTANCE*
-				((2.0f*(float)x/(float)SCREEN_WIDTH)-1.0f),&temp);
-		vectoradd(&v,&temp,&v);
-		
-/*		vectornormalise(&v,&v);*/
-		
-		drawcolumn(r,&v,x);
+		rt = &r->threads[i];
+		total = rt->busytime + rt->idletime;
+		if(!total)
+			total = 1;
+		printf(" %i: %.0f%% busy %.1f ms idle", i,
+			(100.0*rt->busytime)/total, 1.0e-6*rt->idletime);
+		rt->busytime = rt->idletime = 0;
 	}
+	printf("\n");
 }
 
 #define MIN_PHYSICS_FRAME_TIME	10	/* ms */
@@ -1174,6 +2245,8 @@ perframe ( raycaster_t *r, world_t *w )
 		printf("FPS: %f (%f ms per frame)\n",
 			(float)(1000.0f * r->framessincelastreport)/(float)(current - r->lastfpsreporttime),
 			(float)(current - r->lastfpsreporttime)/(float)r->framessincelastreport);
+		reportthreads(r);
+		reportcounters(r,r->framessincelastreport);
 
 		r->framessincelastreport = 0;
 		r->lastfpsreporttime = current;
@@ -1194,137 +2267,71 @@ drawscreen( raycaster_t *r )
 	screenrect.h=SCREEN_HEIGHT;
 	
 	drawscene(r);
-	SDL_UpdateRects(r->screen, 1, &screenrect);
-}
-
-void
-twopiconvention ( float *a )
-{
-	if(*a < 0)
-	{
-		do
-		{
-			*a += 2*M_PI;
-		} while(*a<0);
-		return;
-	}
-	if(*a > 2.0f*M_PI)
-	{
-		do
-		{
-			*a -= 2*M_PI;
-		} while(*a>2.0f*M_PI);
-		return;
-	}
+	if(!r->options.headless)
+		SDL_UpdateRects(r->screen, 1, &screenrect);
 }
 
-void
-piconvention ( float *a )
+/* dumpframe
+ *
+ * Write the contents of the screen to a 24-bit .tga file.
+ */
+int
+dumpframe( raycaster_t *r, char *filename )
 {
-	if(*a < -M_PI)
-	{
-		do
-		{
-			*a += 2*M_PI;
-		} while(*a<-M_PI);
-		return;
-	}
-	if(*a > M_PI)
+	bitmap_t b;
+	byte *bpixel;
+	byte *row;
+	Uint32 colour;
+	int x,y,ret;
+
+	CreateBlankBitmap(&b,SCREEN_WIDTH,SCREEN_HEIGHT,24);
+	if(SDL_MUSTLOCK(r->screen))
+		SDL_LockSurface(r->screen);
+	for(y=0;y<SCREEN_HEIGHT;y++)
 	{
-		do
+		row = (byte*)r->screen->pixels + y*r->screen->pitch;
+		for(x=0;x<SCREEN_WIDTH;x++)
 		{
-			*a -= 2*M_PI;
-		} while(*a>M_PI);
-		return;
+			bpixel = getPixel(&b,x,y);
+			if(r->ops->bytes == 4)
+				colour = ((Uint32*)row)[x];
+			else
+				colour = ((Uint16*)row)[x];
+			SDL_GetRGB(colour,r->screen->format,&bpixel[2],&bpixel[1],&bpixel[0]);
+		}
 	}
-}
-
-enum
-{
-	CONV_PI,
-	CONV_TWO_PI
-};
-
-/* returns the angle ACB using the specified convention */
-float
-findangle ( vector2d_t *a, vector2d_t *b, vector2d_t *c, int convention )
-{
-	float f;
-	vector2d_t t1,t2;
-	vectorsubtract(a,c,&t1);
-	vectorsubtract(b,c,&t2);
+	if(SDL_MUSTLOCK(r->screen))
+		SDL_UnlockSurface(r->screen);
 
-	f=atan2f(t2.x,t2.y)-atan2f(t1.x,t1.y);
-	if(convention == CONV_PI)
-		piconvention(&f);
-	else
-		twopiconvention(&f);
-		
-	return f;
+	ret = writeTGA(filename,&b);
+	freeTGA(&b);
+	return ret;
 }
 
-#if 1
+/* isinplatform
+ *
+ * Crossing number test: v is inside p if a ray from it along +x crosses
+ * an odd number of p's edges. The edges need not be in order.
+ */
 int
 isinplatform( raycaster_t *r, platform_t *p, vector2d_t *v )
 {
-	int i;
-	float angle,totalangle;
-	edge_t *d;
-	
-	totalangle=0.0f;
-	for(i=0;i<p->numedges;i++)
-	{
-		d=p->edges[i];
-		angle=findangle(&d->verts[0]->pos,
-				&d->verts[1]->pos,v,CONV_PI);
-		if(d->leftplat == p)
-		{
-			totalangle+=angle;
-		} else if(d->rightplat == p)
-		{
-			totalangle-=angle;
-		} else
-		{
-			printf("Edge not associated with parent platform\n");
-		}
-	}
-	if(totalangle > M_PI)
-		return 1;
-	return 0;
-}
-#else
-int
-isinplatform2( raycaster_t *r, platform_t *p, vector2d_t *v )
-{
-	int i,count=0;
-	edge_t *d;
-	vector2d_t verts[2];
-	
+	int i,inside=0;
+	vector2d_t *a,*b;
+
+	COUNT(pointedges,p->numedges);
 	for(i=0;i<p->numedges;i++)
 	{
-		d=p->edges[i];
-		vectorsubtract ( &d->verts[0]->pos, v, &verts[0] );
-		vectorsubtract ( &d->verts[1]->pos, v, &verts[1] );
-	
-		if((verts[0].y > 0.0f) == (verts[1].y > 0.0f))
-			continue;
-		if(verts[0].x <= 0.0f && verts[1].x <= 0.0f)
-			continue;
-		if( verts[0].x > 0.0f && verts[1].x > 0.0f )
-		{
-			count++;
+		a = &p->edges[i]->verts[0]->pos;
+		b = &p->edges[i]->verts[1]->pos;
+		if((a->y > v->y) == (b->y > v->y))
 			continue;
-		}
-		if ( verts[0].x*(verts[1].y-verts[1].y) > verts[0].y*(verts[1].x-verts[1].x) )
-		{
-			count++;
-			continue;
-		}
+		if(v->x < a->x + (v->y-a->y)*(b->x-a->x)/(b->y-a->y))
+			inside = !inside;
 	}
-	return count&1;
+	return inside;
 }
 
-#endif
 #if 0
 int
 cylinderisinplatform ( raycaster_t *r, platform_t *p, vector2d_t *v, float radius )
@@ -1395,21 +2402,100 @@ cylinderpickplatforms ( raycaster_t *r, vector2d_t *v, float radius,
 platform_t *
 pickplatform ( raycaster_t *r, vector2d_t *v )
 {
-	int i;
+	int *candidates;
+	int i,n;
 	
 	level_t *l=&r->level;
-	for(i=0;i<l->numplatforms;i++)
+	COUNT(pickplatforms,1);
+	candidates = gridcandidates(l,v,&n);
+	for(i=0;i<n;i++)
 	{
-		if(isinplatform(r,&l->platforms[i],v))
-			return &l->platforms[i];
+		if(isinplatform(r,&l->platforms[candidates[i]],v))
+			return &l->platforms[candidates[i]];
 	}
 
 	printf("Pick platform returned infplat!\n");
 	return &l->infplatform;
 }
 
+/* Squared distance from v to the nearest point of e. */
+static float
+edgedistancesq ( edge_t *e, vector2d_t *v )
+{
+	vector2d_t d,nearest;
+	float along,length;
+
+	vectorsubtract(&e->verts[1]->pos,&e->verts[0]->pos,&d);
+	length = dotproduct(&d,&e->line);
+	vectorsubtract(v,&e->verts[0]->pos,&d);
+	along = clamp(dotproduct(&d,&e->line),0.0f,length);
+	vectorscale(&e->line,along,&nearest);
+	vectoradd(&nearest,&e->verts[0]->pos,&nearest);
+	vectorsubtract(v,&nearest,&d);
+	return dotproduct(&d,&d);
+}
+
+#define LOCATE_MAX_STEPS	16
+
+/* locateplatform
+ *
+ * Find the platform v is in by walking from hint, a platform v was in
+ * or near recently. Each step crosses the edge nearest v of those which
+ * v is beyond, so a point that has moved a little is found after testing
+ * one or two platforms. If the walk gets lost, which can happen among
+ * platforms that are not convex, the whole level is searched.
+ */
+platform_t *
+locateplatform ( raycaster_t *r, platform_t *hint, vector2d_t *v )
+{
+	platform_t *p=hint,*prev=NULL,*next,*best;
+	edge_t *e;
+	float beyond,dist,bestdist=0.0f;
+	int i,step;
+
+	if(!hint || hint == &r->level.infplatform)
+		return pickplatform(r,v);
+
+	COUNT(locates,1);
+	for(step=0;step<LOCATE_MAX_STEPS;step++)
+	{
+		if(isinplatform(r,p,v))
+			return p;
+
+		best = NULL;
+		for(i=0;i<p->numedges;i++)
+		{
+			e = p->edges[i];
+			next = e->leftplat == p ? e->rightplat : e->leftplat;
+			if(next == p || next == prev || next == &r->level.infplatform)
+				continue;
+
+			/* Edges are crossed into rightplat along the normal. */
+			beyond = dotproduct(&e->normal,v) - e->planedist;
+			if(next == e->leftplat)
+				beyond = -beyond;
+			if(beyond <= 0.0f)
+				continue;
+
+			dist = edgedistancesq(e,v);
+			if(!best || dist < bestdist)
+			{
+				best = next;
+				bestdist = dist;
+			}
+		}
+		if(!best)
+			break;
+		prev = p;
+		p = best;
+	}
+	COUNT(locatemisses,1);
+	return pickplatform(r,v);
+}
+
 int
-pointcanseepoint ( raycaster_t *r, vector2d_t *v1, float v1height, vector2d_t *v2, float v2height )
+pointcanseepoint ( raycaster_t *r, vector2d_t *v1, platform_t *p1, float v1height,
+		vector2d_t *v2, float v2height )
 {
 	intersection_t in;
 	float tracedist,tracegrad,dist=0.0f,h;
@@ -1424,14 +2510,16 @@ pointcanseepoint ( raycaster_t *r, vector2d_t *v1, float v1height, vector2d_t *v
 	tracegrad = (v2height-v1height)/tracedist;
 
 	vectorcopy(&pos,v1);
-	plat = pickplatform(r,v1);
+	plat = locateplatform(r,p1,v1);
 	if(!plat)
 		return 0;
 
-	vectorscale(&dir,0.001f,&offs);
+	vectorscale(&dir,TRACE_NUDGE,&offs);
 	while ( 0 < 1)
 	{
-		edgeintersect ( r, plat, &dir, &pos, dist, &in, NULL );
+		/* Nowhere to go, so the trace has left the level. */
+		if(!traceintersect(r,&plat,&dir,&pos,dist,&in))
+			return 0;
 		if(in.distance > tracedist)
 			return 1;
 		
@@ -1475,11 +2563,6 @@ initvariables ( raycaster_t *r )
 	r->viewpos.x = 32.0f;
 
 	r->currentplatform = pickplatform(r,&r->viewpos);
-	
-	r->numsprites = 0;
-	r->allocatedsprites = HUNK_SPRITES;
-	r->spritelist = (sprite_t**)malloc(
-			sizeof(sprite_t)*r->allocatedsprites);
 
 	r->transpixel = SDL_MapRGB(r->screen->format,255,0,255);
 
@@ -1488,21 +2571,176 @@ initvariables ( raycaster_t *r )
 	r->lastmousepolltime = 0;
 	r->lastfpsreporttime = 0;
 	r->framessincelastreport = 0;
-
-	gradtopixelcoefficent = -(float)(SCREEN_WIDTH*HALF_SCREEN_HEIGHT)/((float)SCREEN_HEIGHT*TAN_FOV);
-	pixeltogradcoefficent = -(TAN_FOV*(float)SCREEN_HEIGHT/(float)SCREEN_WIDTH)/(float)HALF_SCREEN_HEIGHT;
-	pixeltogradinit();
 	return;
 }
+
+/* startthreads
+ *
+ * Start the pool before the level is loaded, so that its textures can be
+ * loaded in parallel; initthreads sets up the rest once the level is in.
+ */
+void
+startthreads ( raycaster_t *r )
+{
+	int n;
+
+	n = r->options.numthreads;
+	if(n <= 0)
+		n = numcpus();
+	startthreadpool(&r->pool,n);
+}
+
+void
+initthreads ( raycaster_t *r )
+{
+	renderthread_t *rt;
+	int i,j,n;
+
+	n = r->pool.numthreads;
+	printf("rendering with %i thread%s\n", n, n == 1 ? "" : "s");
+
+	r->threads = (renderthread_t*)malloc(sizeof(renderthread_t)*n);
+	for(i=0;i<n;i++)
+	{
+		rt = &r->threads[i];
+		rt->raycaster = r;
+		rt->index = i;
+		rt->busytime = rt->idletime = 0;
+
+		rt->numsprites = 0;
+		rt->allocatedsprites = HUNK_SPRITES;
+		rt->spritelist = (spriteref_t*)malloc(
+				sizeof(spriteref_t)*rt->allocatedsprites);
+
+		rt->numplanes = rt->allocatedplanes = 0;
+		rt->planes = NULL;
+		rt->planekeys = (planekey_t*)malloc(
+				sizeof(planekey_t)*2*(r->level.numplatforms+1));
+		for(j=0;j<2*(r->level.numplatforms+1);j++)
+			rt->planekeys[j].frame = -1;
+		rt->numdeferred = rt->allocateddeferred = 0;
+		rt->deferred = NULL;
+
+		rt->allocatedchain = 0;
+		for(j=0;j<PACKET_SIZE;j++)
+		{
+			rt->chainlength[j] = 0;
+			rt->chains[j] = NULL;
+		}
+	}
+
+	if(r->options.batchsize <= 0)
+		r->options.batchsize = DEFAULT_BATCH_SIZE;
+	if(posix_memalign((void**)&r->queues,sizeof(workqueue_t),sizeof(workqueue_t)*n))
+	{
+		fprintf(stderr,"Could not allocate work queues\n");
+		exit(1);
+	}
+	initworkqueues(r->queues,n);
+	resetcounters(r);
+}
+
+/* initframe
+ *
+ * Decide where the frame is drawn. Spans are drawn along rows, so they go
+ * straight to the screen, or to the scale buffer when the frame is to be
+ * smaller than the screen.
+ */
+void
+initframe ( raycaster_t *r )
+{
+	int size=r->ops->bytes*SCREEN_WIDTH*SCREEN_HEIGHT;
+
+	if(r->options.rowmajor || r->options.spans ||
+			posix_memalign((void**)&r->columnbuffer,64,size))
+		r->columnbuffer = NULL;
+	else
+		memset(r->columnbuffer,0,size);
+	if((r->options.scale >= 1.0f && r->options.targetms <= 0.0f) ||
+			posix_memalign((void**)&r->scalebuffer,64,size))
+		r->scalebuffer = NULL;
+	else
+		memset(r->scalebuffer,0,size);
+	setresolution(r,r->options.scale);
+}
+
+void
+initcolumncache ( raycaster_t *r )
+{
+	if(!r->options.nocache)
+	{
+		r->columncache = (columncache_t*)calloc(SCREEN_WIDTH,sizeof(columncache_t));
+		r->oldcolumncache = (columncache_t*)calloc(SCREEN_WIDTH,sizeof(columncache_t));
+	}
+	invalidatecolumncache(r);
+}
+
+void
+freecolumncache ( raycaster_t *r )
+{
+	int i;
+
+	if(!r->columncache)
+		return;
+	for(i=0;i<SCREEN_WIDTH;i++)
+	{
+		free(r->columncache[i].chain);
+		free(r->oldcolumncache[i].chain);
+	}
+	free(r->columncache);
+	free(r->oldcolumncache);
+	r->columncache = r->oldcolumncache = NULL;
+}
+
+void
+freethreads ( raycaster_t *r )
+{
+	renderthread_t *rt;
+	int i,j;
+
+	stopthreadpool(&r->pool);
+	if(!r->threads)
+		return;
+	freeworkqueues(r->queues,r->pool.numthreads);
+	free(r->queues);
+	for(i=0;i<r->pool.numthreads;i++)
+	{
+		rt = &r->threads[i];
+		free(rt->spritelist);
+		for(j=0;j<rt->allocatedplanes;j++)
+		{
+			free(rt->planes[j].top);
+			free(rt->planes[j].bottom);
+		}
+		free(rt->planes);
+		free(rt->planekeys);
+		free(rt->deferred);
+		for(j=0;j<PACKET_SIZE;j++)
+			free(rt->chains[j]);
+	}
+	free(r->threads);
+	r->threads = NULL;
+}
 #define HUNK_PLATFORM_SPRITES	4
+
+/* The lists live in the frame arena, so a full one is copied to one twice
+ * the size; the old one is given back with the rest of the frame.
+ */
 void
-addspritetoplatform( sprite_t *sprite, platform_t *platform )
+addspritetoplatform( raycaster_t *r, sprite_t *sprite, platform_t *platform )
 {
+	sprite_t **sprites;
+
 	if(platform->numsprites >= platform->allocatedsprites)
 	{
-		platform->allocatedsprites += HUNK_PLATFORM_SPRITES;
-		platform->sprites = (sprite_t**)realloc(platform->sprites, 
+		platform->allocatedsprites = platform->allocatedsprites ?
+				2*platform->allocatedsprites : HUNK_PLATFORM_SPRITES;
+		sprites = (sprite_t**)arenaalloc(&r->framearena,
 				platform->allocatedsprites*sizeof(sprite_t*));
+		if(platform->numsprites)
+			memcpy(sprites,platform->sprites,
+					platform->numsprites*sizeof(sprite_t*));
+		platform->sprites = sprites;
 	}
 	platform->sprites[platform->numsprites++] = sprite;
 }
@@ -1512,12 +2750,17 @@ addspritetoplatform( sprite_t *sprite, platform_t *platform )
  * designates a sprite to be rendered by assigning platforms to it,
  * and setting its parameters.
  *
+ * hint is a platform at or near verts[0], or NULL if none is known
+ *
+ * the sprite is only given to the platforms it spans that can be seen from
+ * r->currentplatform, so the view should be placed first
+ *
  * surface defines whether the sprite is "attached" to the floor or ceiling
  * 	   it is used for determining the vertical position of the sprite only
  * vdist is the distance the sprite will be from the floor or ceiling
  */
 sprite_t *
-addsprite ( raycaster_t *r, vector2d_t *verts, float height, float vdist, 
+addsprite ( raycaster_t *r, platform_t *hint, vector2d_t *verts, float height, float vdist, 
 		int surface, texture_t *texture )
 {
 	platform_t *currentplat;
@@ -1525,11 +2768,11 @@ addsprite ( raycaster_t *r, vector2d_t *verts, float height, float vdist,
 	sprite_t *sprite;
 	intersection_t currentint;
 	float width,dist,highestfloor=0.0f,lowestceil=0.0f;
-	int first=1,i;
+	int first=1,found,i;
 	
-	currentplat = pickplatform(r,&verts[0]);
+	currentplat = locateplatform(r,hint,&verts[0]);
 
-	sprite = (sprite_t*)malloc(sizeof(sprite_t));
+	sprite = (sprite_t*)arenaalloc(&r->framearena,sizeof(sprite_t));
 
 	vectorsubtract(&verts[1],&verts[0],&direction);
 	width = vectorlength(&direction);
@@ -1542,23 +2785,25 @@ addsprite ( raycaster_t *r, vector2d_t *verts, float height, float vdist,
 	dist = 0.0f;
 	while(0<1)
 	{
-		edgeintersect(r,currentplat,&direction,&pos,dist,&currentint,NULL);
+		/* With nowhere to go, the sprite is taken to end here. */
+		found = traceintersect(r,&currentplat,&direction,&pos,dist,&currentint) != NULL;
 		for(i=0;i<currentplat->numsprites;i++)
 		{
 			if(currentplat->sprites[i] == sprite)
 				break;
 		}	
 		
-		if(i==currentplat->numsprites)
+		if(i==currentplat->numsprites &&
+				platformcanseeplatform(&r->level,r->currentplatform,currentplat))
 		{
-			addspritetoplatform(sprite,currentplat);
+			addspritetoplatform(r,sprite,currentplat);
 		}
 		if(currentplat == &r->level.infplatform)
 		{
 			fprintf(stderr,"Sprite is on inf platform\n");
 			break;
 		}
-		if(currentint.distance > width)
+		if(!found || currentint.distance > width)
 		{
 			/* The sprite ends in this platform */
 			break;
@@ -1594,52 +2839,49 @@ addsprite ( raycaster_t *r, vector2d_t *verts, float height, float vdist,
 	}
 	memcpy(sprite->verts,verts,2*sizeof(vector2d_t));
 	sprite->texture = texture;
-	sprite->renderflag = 0;
 	return sprite;
 }
 
-void
-initraycaster( raycaster_t *r, char *level )
+int
+initraycaster( raycaster_t *r, options_t *options )
 {
 	printf("loading level...\n");
 	
-	memset(r,0,sizeof(r));
-	memset(&r->level,0,sizeof(level_t));
+	memset(r,0,sizeof(*r));
+	memcpy(&r->options,options,sizeof(options_t));
+	printf("using %s kernels\n", selectkernels(options->kernels));
+	initarena(&r->framearena);
 	
-	if(!startsdl(r))
-		return;
-	if(!loadlevel(r,level))
-		return;
+	if(!startsdl(r) || !selectpixelops(r))
+		return 0;
+	openpack(r);
+	startthreads(r);
+	if(!loadlevel(r,options->level))
+		return 0;
 
 	initvariables(r);
+	initthreads(r);
+	initframe(r);
+	initcolumncache(r);
+	return 1;
 }
 
 void
 cleanup ( raycaster_t *r )
 {
-	texture_t *t,*next;
 	level_t *l=&r->level;
-	int i;
-	for(i=0;i<l->numplatforms;i++)
-	{
-		free(l->platforms[i].edges);
-		free(l->platforms[i].sprites);
-	}
-	free(l->platforms);
-	free(l->infplatform.edges);
-	free(l->infplatform.sprites);
-	for(i=0;i<l->numverts;i++)
-		free(l->verts[i].edges);
-	free(l->verts);
-	free(l->edges);
 
-	for(next=r->level.texturelist;(t=next);)
-	{
-		next = t->next;
-		freetexture(t);
-		free(t);
-	}
-	
+	freethreads(r);
+	freecolumncache(r);
+	freearena(&r->framearena);
+	free(r->columnbuffer);
+	free(r->scalebuffer);
+	freelevel(l);
+	freetextures(r);
+	closetexpack(&r->pack);
+
+	if(r->options.headless)
+		SDL_FreeSurface(r->screen);
 	SDL_Quit();
 }
 
@@ -1652,54 +2894,125 @@ clearsprites ( raycaster_t *r )
 	int i;
 	platform_t *p;
 
-	for(i=0;i<r->level.numplatforms;i++)
+	for(i=0;i<=r->level.numplatforms;i++)
 	{
-		p = &r->level.platforms[i];
+		p = i < r->level.numplatforms ? &r->level.platforms[i] : &r->level.infplatform;
 		p->numsprites = 0;
+		p->allocatedsprites = 0;
+		p->sprites = NULL;
 	}
+	resetarena(&r->framearena);
 }
 	      
 
 void
 renderloop( raycaster_t *r, world_t *w )
 {
-	int done;
+	int done,frames;
 	
 	done = 0;
+	frames = 0;
 	while(!done)
 	{
-		handleevents(r,w,&done);
+		if(!r->options.headless)
+			handleevents(r,w,&done);
 		setupworld (w);
 		drawscreen(r);
+		frames++;
+		if(r->options.numframes && frames >= r->options.numframes)
+			done = 1;
+		if(done && r->options.dumpfile)
+			dumpframe(r,r->options.dumpfile);
 		clearsprites(r);
 		perframe(r,w);
 	}
 }
 
-int
-main ( int argc, char **argv )
+void
+defaultoptions ( options_t *o )
 {
-	char *level;
-	raycaster_t r;
-	world_t w;
+	o->level = DEFAULT_LEVEL;
+	o->numthreads = 0;
+	o->batchsize = DEFAULT_BATCH_SIZE;
+	o->headless = 0;
+	o->numframes = 0;
+	o->dumpfile = NULL;
+	o->spans = 0;
+	o->rowmajor = 0;
+	o->kernels = NULL;
+	o->packets = 0;
+	o->nocache = 0;
+	o->nomips = 0;
+	o->tiled = 0;
+	o->scale = 1.0f;
+	o->targetms = 0.0f;
+	o->bpp = 16;
+	o->pack = NULL;
+}
 
-	printf("Copyright Notice: This program is licensed under the GNU General Public License\nSee COPYING for details\n\n");
+/* parseoption
+ *
+ * Handle the renderer option at argv[*i], if it is one, advancing *i past
+ * any argument it takes. Returns 0 for anything not recognised so that
+ * callers can handle their own options.
+ */
+int
+parseoption ( options_t *o, int argc, char **argv, int *i )
+{
+	char *arg=argv[*i];
+	int hasvalue=(*i+1 < argc);
 
-	if(argc >= 2)
-		level = argv[1];
-	else
-		level = DEFAULT_LEVEL;
-	initraycaster(&r,level);
-	initworld(&w,&r);
-	if(!addentity(&w, "type=spawn\\coords=384 384\\angle=0"))
-		return 0;
-	if(!addentity(&w, "type=monster\\coords=300 300\\angle=90"))
+	if(!strcmp(arg,"-threads") && hasvalue)
+	{
+		o->numthreads = atoi(argv[++*i]);
+	} else if(!strcmp(arg,"-batch") && hasvalue)
+	{
+		o->batchsize = atoi(argv[++*i]);
+	} else if(!strcmp(arg,"-headless"))
+	{
+		o->headless = 1;
+	} else if(!strcmp(arg,"-frames") && hasvalue)
+	{
+		o->numframes = atoi(argv[++*i]);
+	} else if(!strcmp(arg,"-dump") && hasvalue)
+	{
+		o->dumpfile = argv[++*i];
+	} else if(!strcmp(arg,"-spans"))
+	{
+		o->spans = 1;
+	} else if(!strcmp(arg,"-rowmajor"))
+	{
+		o->rowmajor = 1;
+	} else if(!strcmp(arg,"-packets"))
+	{
+		o->packets = 1;
+	} else if(!strcmp(arg,"-nocache"))
+	{
+		o->nocache = 1;
+	} else if(!strcmp(arg,"-nomips"))
+	{
+		o->nomips = 1;
+	} else if(!strcmp(arg,"-tiled"))
+	{
+		o->tiled = 1;
+	} else if(!strcmp(arg,"-scale") && hasvalue)
+	{
+		o->scale = atof(argv[++*i]);
+	} else if(!strcmp(arg,"-target") && hasvalue)
+	{
+		o->targetms = atof(argv[++*i]);
+	} else if(!strcmp(arg,"-bpp") && hasvalue)
+	{
+		o->bpp = atoi(argv[++*i]);
+	} else if(!strcmp(arg,"-pack") && hasvalue)
+	{
+		o->pack = argv[++*i];
+	} else if(!strcmp(arg,"-kernels") && hasvalue)
+	{
+		o->kernels = argv[++*i];
+	} else
+	{
 		return 0;
-	
-	renderloop(&r,&w);
-	
-	cleanup(&r);
-	freeworld(&w);
-	return 0;
+	}
+	return 1;
 }
-
@@ -21,10 +21,22 @@
 
 #include <SDL/SDL.h>
 #include "vector.h"
+#include "threads.h"
+#include "arena.h"
+#include "packfile.h"
+#include "levelfile.h"
+
+#define SCREEN_WIDTH	1024
+#define SCREEN_HEIGHT	768
 
 #define VIEW_HEIGHT	64.0f
 #define MAX_CYLINDER_PICKS	24
 
+#define PRECISION_BITS			8
+#define DOUBLE_PRECISION_BITS		(2*PRECISION_BITS)
+#define PRECISION_PRODUCT		((float)(1<<PRECISION_BITS))		/* 2^PRECISION_BITS */
+#define PRECISION_PRODUCT_SQUARE	(PRECISION_PRODUCT*PRECISION_PRODUCT) 	/* 2^DOUBLE_PRECISION_BITS */
+
 enum
 {
 	SURFACE_CEILING,
@@ -32,19 +44,57 @@ enum
 	SURFACE_NONE
 };
 
+/* Texels start..end-1 of a texture column, none of them transparent. */
+typedef struct texrun_s
+{
+	unsigned short start,end;
+} texrun_t;
+
 typedef struct texture_s
 {
 	char path[64];
-	unsigned short *pixels; /* pixels are stored up-down first */
+	void *pixels;	/* in the screen's format, stored up-down first */
 	int width,height;
 	int widthmask,heightmask;
 	int widthmaskshift,heightmaskshift;
 	int widthmasksmallshift,heightmasksmallshift;
 	int log2width,log2height;
+	int tiled;		/* texels are held in tiles, see texelindex */
+	int nummips;
+	struct texture_s *mips;	/* each half the size of the one before */
+	texrun_t *runs;		/* opaque runs of each column, top first */
+	int *firstrun;		/* column x's runs are firstrun[x]..firstrun[x+1]-1 */
+	int mapped;		/* texels and runs are in the texture pack */
 
 	struct texture_s *prev,*next;
 } texture_t;
 
+/* Floor textures can be held in square tiles of 2^TILE_BITS texels a
+ * side, so that the texels around a floor sample share cache lines
+ * whichever way the floor is crossed. Tiles are stored up-down first, as
+ * are the texels in each tile.
+ */
+#define TILE_BITS	3
+#define TILE_MASK	((1<<TILE_BITS)-1)
+
+/* Whether a texture or mip of this size can be held in tiles; smaller
+ * ones are always stored up-down first.
+ */
+static inline int
+cantile ( int width, int height )
+{
+	return width > TILE_MASK && height > TILE_MASK;
+}
+
+static inline int
+texelindex ( texture_t *t, int x, int y )
+{
+	if(t->tiled)
+		return (y&TILE_MASK) | ((x&TILE_MASK)<<TILE_BITS) |
+				((y&~TILE_MASK)<<TILE_BITS) | ((x&~TILE_MASK)<<t->log2height);
+	return y + (x<<t->log2height);
+}
+
 typedef struct edge_s
 {
 	struct vert_s *verts[2];
@@ -66,24 +116,51 @@ typedef struct sprite_s
 	vector2d_t verts[2],line,normal;
 	float heights[2]; /* "height" of the sprite */
 	texture_t *texture;
-
-	float mingrad,maxgrad;	/* used in runtime for visibility clipping */
 	int nobounds;
-	int renderflag;		/* flagged for rendering, prevents duplicates */
+} sprite_t;
+
+/* A sprite hit by the column currently being drawn. These are kept per
+ * render thread rather than in the sprite itself so that columns can be
+ * drawn in parallel.
+ */
+typedef struct spriteref_s
+{
+	sprite_t *sprite;
+	float mingrad,maxgrad;	/* used for visibility clipping */
 	float texoffset;
 	float dist;
-} sprite_t;
+} spriteref_t;
+
+/* A platform's edges laid out an attribute at a time, so that several
+ * edges can be tested against a ray at once. Each array has count
+ * entries, numedges rounded up to EDGE_BATCH; the padding never
+ * intersects anything.
+ */
+#define EDGE_BATCH	8
+
+typedef struct edgearrays_s
+{
+	int count;
+	float *normalx,*normaly;
+	float *linex,*liney;
+	float *planedist;		/* normal.verts[0] */
+	float *projmin,*projmax;	/* range of line.v over the edge */
+	float *side;	/* 1 if leaving through the edge needs normal.dir > 0, -1 if < 0 */
+	float *data;
+} edgearrays_t;
 
 typedef struct platform_s
 {
 	float ceilheight,floorheight;
 	int numedges;
 	edge_t **edges;
+	edgearrays_t edgearrays;
+	int convex;		/* no edge has any of the others in front of it */
 	struct texture_s *texture;
 
 	int allocatedsprites;
 	int numsprites;
-	sprite_t **sprites;
+	sprite_t **sprites;	/* in the frame arena */
 } platform_t;
 
 typedef struct level_s
@@ -101,6 +178,30 @@ typedef struct level_s
 	int numverts;
 	vert_t *verts;
 	vector2d_t size;	
+
+	int numedgerefs;
+	edge_t **edgerefs;	/* every platform's and vertex's list of edges */
+
+	/* Potentially visible sets, pvswords words per platform; see pvs.c.
+	 * Bit j of platform i's set is set if platform j may be seen from i.
+	 * infplatform comes after the other platforms.
+	 */
+	int pvswords;
+	unsigned int *pvs;
+
+	/* Grid of the platforms which might contain each point; see grid.c.
+	 * Cell (x,y) covers gridcell units from gridorigin+(x,y)*gridcell and
+	 * lists the platforms numbered gridplatforms[gridstart[c]] to
+	 * gridplatforms[gridstart[c+1]-1], where c is x+y*gridwidth.
+	 */
+	vector2d_t gridorigin;
+	float gridcell;
+	int gridwidth,gridheight;
+	int *gridstart;
+	int *gridplatforms;
+
+	void *block;		/* the arrays above and the edge arrays */
+	levelimage_t image;	/* the file, if the pvs or grid lie in it */
 } level_t;
 
 #define HUNK_INTERSECTIONS	8
@@ -109,12 +210,31 @@ typedef struct intersection_s
 {
 	vector2d_t pos;
 	edge_t *edge;
+	int edgeindex;		/* of edge in the platform being left */
 	platform_t *platform;
 	float distance;
 	float texoffset;
 	int final;
 } intersection_t;
 
+/* The intersections one column went through in the last frame. While the
+ * view stays where it is they are used again instead of being traced;
+ * see drawscene.
+ */
+typedef struct columncache_s
+{
+	int length;
+	int allocated;
+	intersection_t *chain;
+} columncache_t;
+
+typedef enum
+{
+	CACHE_NONE,		/* trace every column */
+	CACHE_REPLAY,		/* nothing has moved, use the chains as they are */
+	CACHE_ROTATED		/* the view has only turned, guess from the old chains */
+} cachemode_t;
+
 typedef enum
 {
 	INTERSECTION_ENTRY,
@@ -132,11 +252,161 @@ typedef struct solidintersection_s
 	
 } solidintersection_t;
 
+/* A sprite column whose drawing has been put off until the floors and
+ * ceilings have been drawn (-spans).
+ */
+typedef struct deferredsprite_s
+{
+	spriteref_t ref;
+	int x;
+} deferredsprite_t;
+
+/* The part of one platform's floor or ceiling seen by a set of columns.
+ * Columns record the rows they cover and the plane is then drawn in
+ * horizontal spans, in the manner of Doom's visplanes (-spans).
+ */
+typedef struct visplane_s
+{
+	platform_t *platform;
+	int surface;		/* SURFACE_FLOOR or SURFACE_CEILING */
+	int minx,maxx;
+	short *top,*bottom;	/* rows covered in each column, top > bottom if none */
+} visplane_t;
+
+typedef struct planekey_s
+{
+	int plane;		/* latest plane for a platform surface */
+	int frame;		/* frame the plane belongs to */
+} planekey_t;
+
+struct raycaster_s;
+
+/* Hot path counters, compiled in with -DRENDER_COUNTERS (make COUNTERS=1).
+ * Each thread counts into its own copy which is gathered into its render
+ * thread once per frame.
+ */
+#ifdef RENDER_COUNTERS
+typedef struct rendercounters_s
+{
+	long long edgeintersects;	/* edgeintersect() calls */
+	long long edgestested;		/* edges looked at by edgeintersect() */
+	long long lineintersects;	/* linelineintersect() calls */
+	long long columns;
+	long long platformscrossed;
+	long long maxplatformscrossed;	/* by any one column */
+	long long wallpixels;
+	long long floorpixels;
+	long long spritepixels;
+	long long pickplatforms;	/* pickplatform() calls */
+	long long pointedges;		/* edges tested by isinplatform() */
+	long long locates;		/* locateplatform() calls */
+	long long locatemisses;		/* of which fell back on pickplatform() */
+} rendercounters_t;
+
+extern __thread rendercounters_t threadcounters;
+
+#define COUNT(counter,n)	(threadcounters.counter += (n))
+#define COUNTMAX(counter,n)	do { if((n) > threadcounters.counter) \
+					threadcounters.counter = (n); } while(0)
+#else
+#define COUNT(counter,n)
+#define COUNTMAX(counter,n)
+#endif
+
+/* Columns traced through the level together by -packets. The packet
+ * kernels are written for four.
+ */
+#define PACKET_SIZE	4
+
+/* State owned by one rendering thread. */
+typedef struct renderthread_s
+{
+	struct raycaster_s *raycaster;
+	int index;
+
+	long long busytime;	/* ns spent drawing columns since the last report */
+	long long idletime;	/* ns spent waiting for other threads */
+#ifdef RENDER_COUNTERS
+	rendercounters_t counters;
+#endif
+
+	int numsprites;
+	int allocatedsprites;
+	spriteref_t *spritelist;
+
+	int numplanes;
+	int allocatedplanes;
+	visplane_t *planes;
+	planekey_t *planekeys;	/* two per platform, indexed by planekey() */
+	short spanstart[SCREEN_HEIGHT];
+
+	int numdeferred;
+	int allocateddeferred;
+	deferredsprite_t *deferred;
+
+	/* Intersections traced ahead for each column of a packet (-packets). */
+	int allocatedchain;
+	int chainlength[PACKET_SIZE];
+	intersection_t *chains[PACKET_SIZE];
+} renderthread_t;
+
+typedef struct options_s
+{
+	char *level;
+	int numthreads;		/* 0 to use one thread per core */
+	int batchsize;		/* columns handed out to a thread at a time */
+	int headless;		/* render to memory instead of opening a window */
+	int numframes;		/* stop after this many frames, 0 to run until quit */
+	char *dumpfile;		/* write the last frame to this .tga file */
+	int spans;		/* draw floors and ceilings in horizontal spans */
+	int rowmajor;		/* draw straight into the screen, not a column buffer */
+	char *kernels;		/* inner loops to use, NULL for the best available */
+	int packets;		/* trace neighbouring columns together */
+	int nocache;		/* trace every column every frame */
+	int nomips;		/* always sample full size textures */
+	int tiled;		/* hold floor textures in tiles */
+	float scale;		/* fraction of the screen's width and height to draw */
+	float targetms;		/* frame time to adjust the scale for, 0 to keep it */
+	int bpp;		/* bits per pixel of the screen, 16 or 32 */
+	char *pack;		/* texture pack, NULL for DEFAULT_PACK if there is one */
+} options_t;
+
+#define DEFAULT_PACK	"textures/textures.pak"
+
 typedef struct raycaster_s
 {
 	SDL_Surface *screen;
 	level_t level;
 
+	/* The frame is width by height pixels, drawn at pixels, pixel (x,y)
+	 * being at pixels[x*xstep+y*ystep]. Normally this is columnbuffer,
+	 * which keeps each column contiguous and is copied to the screen once
+	 * drawn. A frame smaller than the screen goes through scalebuffer and
+	 * is stretched to fit.
+	 */
+	int width,height;
+	void *pixels;
+	int xstep,ystep;
+	void *columnbuffer;
+	void *scalebuffer;
+	struct pixelops_s *ops;	/* drawing functions for the screen's format */
+	float scale;		/* width/SCREEN_WIDTH */
+	float frametime;	/* smoothed drawscene time in ms, for -target */
+
+	/* Column chains from the last frame, and where they were seen from.
+	 * Each frame writes columncache, after reading oldcolumncache when
+	 * the view has turned.
+	 */
+	columncache_t *columncache,*oldcolumncache;
+	cachemode_t cachemode;
+	vector2d_t cacheviewpos,cacheviewdir;
+	platform_t *cacheplatform;
+
+	/* The sprites added each frame and the platforms' lists of them,
+	 * emptied by clearsprites.
+	 */
+	arena_t framearena;
+
 	vector2d_t viewdir;
 	vector2d_t viewpos;
 	float eyelevel;
@@ -144,10 +414,14 @@ typedef struct raycaster_s
 	int cursorx,cursory;
 	int lastcursorx,lastcursory;
 
-	int numsprites;
-	int allocatedsprites;
-	sprite_t **spritelist;
-	unsigned short transpixel;
+	options_t options;
+	texpack_t pack;
+	threadpool_t pool;
+	renderthread_t *threads;
+	workqueue_t *queues;
+	int numbatches;
+	int framenum;
+	unsigned int transpixel;
 
 	vector2d_t mousespeed;
 	int lastmousepolltime;
@@ -156,17 +430,45 @@ typedef struct raycaster_s
 	int framessincelastreport;
 } raycaster_t;
 
+#define OPTIONS_USAGE	"[-threads n] [-batch columns] [-headless] [-frames n] [-dump file.tga] [-spans] [-rowmajor] [-packets]\n\t[-kernels avx2|sse2|scalar] [-nocache] [-nomips] [-tiled] [-scale f] [-target ms] [-bpp 16|32]\n\t[-pack file]"
+
+struct world_s;
+
 #include "physics.h"
+void defaultoptions ( options_t *o );
+int parseoption ( options_t *o, int argc, char **argv, int *i );
+int initraycaster ( raycaster_t *r, options_t *options );
+void cleanup ( raycaster_t *r );
+void renderloop ( raycaster_t *r, struct world_s *w );
+void drawscene ( raycaster_t *r );
+void invalidatecolumncache ( raycaster_t *r );
+void clearsprites ( raycaster_t *r );
+int dumpframe ( raycaster_t *r, char *filename );
+void reportthreads ( raycaster_t *r );
+void resetcounters ( raycaster_t *r );
+void reportcounters ( raycaster_t *r, int frames );
+
 intersection_t *
 edgeintersect ( raycaster_t *r, platform_t *p, vector2d_t *dir, 
 		vector2d_t *passedorigin, float prevdist, 
 		intersection_t *intersection, edge_t *ignoreedge);
+intersection_t *
+traceintersect ( raycaster_t *r, platform_t **p, vector2d_t *dir,
+		vector2d_t *origin, float prevdist, intersection_t *in );
 
-sprite_t * addsprite ( raycaster_t *r, vector2d_t *verts, float height, float vdist, 
+sprite_t * addsprite ( raycaster_t *r, platform_t *hint, vector2d_t *verts, float height, float vdist, 
 		int surface, texture_t *texture );
+texture_t *findtexture ( raycaster_t *r, char *path, int tiled );
+int loadtextures ( raycaster_t *r, char **names, int *tiled, int count, texture_t **textures );
 texture_t *texturefrompath ( raycaster_t *r, char *path );
+void freetextures ( raycaster_t *r );
+int startheadless ( raycaster_t *r );
+void getpackformat ( raycaster_t *r, packheader_t *format );
 platform_t * pickplatform ( raycaster_t *r, vector2d_t *v );
-int pointcanseepoint ( raycaster_t *r, vector2d_t *v1, float v1height, vector2d_t *v2, float v2height );
+platform_t * locateplatform ( raycaster_t *r, platform_t *hint, vector2d_t *v );
+int isinplatform ( raycaster_t *r, platform_t *p, vector2d_t *v );
+int pointcanseepoint ( raycaster_t *r, vector2d_t *v1, platform_t *p1, float v1height,
+		vector2d_t *v2, float v2height );
 
 #endif
 
@@ -0,0 +1,194 @@
+/*
+ * Copyright (C) Matthew Earl
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+/* Texture packer. Loads textures the way the game does and writes them,
+ * converted to one screen format along with their mips and sprite runs,
+ * to a pack that the game maps at startup in place of decoding them; see
+ * packfile.h. With no textures named, packs every .tga in textures/.
+ */
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "raycaster.h"
+#include "kernels.h"
+
+void
+usage ( char *name )
+{
+	fprintf(stderr,"Usage: %s [-bpp 16|32] [-tiled] [-o pack] [texture.tga...]\n", name);
+	fprintf(stderr,"Textures are read from textures/; the pack defaults to %s.\n",
+		DEFAULT_PACK);
+}
+
+static int
+istga ( const struct dirent *d )
+{
+	size_t n=strlen(d->d_name);
+
+	return n > 4 && !strcmp(d->d_name+n-4,".tga");
+}
+
+/* packtexture
+ *
+ * Add t, loaded from name tiled or not as asked, and its mips and runs to
+ * the pack.
+ */
+int
+packtexture ( texpack_t *pack, raycaster_t *r, texture_t *t, char *name, int tiled )
+{
+	packentry_t *e;
+	texture_t *level;
+	struct stat st;
+	int i,bytes=r->screen->format->BytesPerPixel;
+
+	if(strlen(name) >= PACK_NAME_LENGTH || t->nummips+1 > PACK_MAX_LEVELS)
+	{
+		fprintf(stderr,"%s: cannot be packed\n",t->path);
+		return 0;
+	}
+	if(stat(t->path,&st))
+	{
+		perror(t->path);
+		return 0;
+	}
+
+	e = addpackentry(pack);
+	strcpy(e->name,name);
+	e->mtime = st.st_mtime;
+	e->size = st.st_size;
+	e->tiled = tiled;
+	e->numlevels = t->nummips+1;
+	for(i=0;i<e->numlevels;i++)
+	{
+		level = i ? &t->mips[i-1] : t;
+		e->levels[i].width = level->width;
+		e->levels[i].height = level->height;
+		e->levels[i].tiled = level->tiled;
+		e->levels[i].pixeloffset = addpackdata(pack,level->pixels,
+				bytes*((size_t)level->width*level->height+TEXTURE_PADDING));
+		if(!e->levels[i].pixeloffset)
+			return 0;
+	}
+	e->numruns = t->firstrun[t->width];
+	e->firstrunoffset = addpackdata(pack,t->firstrun,sizeof(int)*(t->width+1));
+	e->runoffset = addpackdata(pack,t->runs,sizeof(texrun_t)*e->numruns);
+	return e->firstrunoffset && e->runoffset;
+}
+
+int
+main ( int argc, char **argv )
+{
+	raycaster_t r;
+	texpack_t pack;
+	packheader_t format;
+	texture_t **textures;
+	struct dirent **found=NULL;
+	char *out=DEFAULT_PACK,**names,**loadnames;
+	int i,n,numnames=0,numfound=0,tiled=0,bpp=16,*loadtiled;
+
+	names = (char**)malloc(sizeof(char*)*argc);
+	for(i=1;i<argc;i++)
+	{
+		if(!strcmp(argv[i],"-bpp") && i+1 < argc)
+			bpp = atoi(argv[++i]);
+		else if(!strcmp(argv[i],"-tiled"))
+			tiled = 1;
+		else if(!strcmp(argv[i],"-o") && i+1 < argc)
+			out = argv[++i];
+		else if(argv[i][0] == '-')
+		{
+			usage(argv[0]);
+			return 1;
+		} else
+			names[numnames++] = argv[i];
+	}
+	if(bpp != 16 && bpp != 32)
+	{
+		usage(argv[0]);
+		return 1;
+	}
+	if(!numnames)
+	{
+		numfound = scandir("textures",&found,istga,alphasort);
+		if(numfound < 0)
+		{
+			perror("textures");
+			return 1;
+		}
+		names = (char**)realloc(names,sizeof(char*)*(numfound+1));
+		for(i=0;i<numfound;i++)
+			names[numnames++] = found[i]->d_name;
+	}
+
+	/* The textures are converted by the same code as when the game loads
+	 * them, for a screen like the one it would open.
+	 */
+	memset(&r,0,sizeof(r));
+	defaultoptions(&r.options);
+	r.options.headless = 1;
+	r.options.bpp = bpp;
+	if(!startheadless(&r))
+		return 1;
+	getpackformat(&r,&format);
+	if(!newtexpack(&pack,&format))
+	{
+		fprintf(stderr,"Could not allocate texture pack\n");
+		return 1;
+	}
+
+	/* Floors are drawn from tiled textures under -tiled, and anything could
+	 * be a floor.
+	 */
+	n = numnames*(tiled+1);
+	loadnames = (char**)malloc(sizeof(char*)*n);
+	loadtiled = (int*)malloc(sizeof(int)*n);
+	textures = (texture_t**)malloc(sizeof(texture_t*)*n);
+	for(i=0;i<n;i++)
+	{
+		loadnames[i] = names[i%numnames];
+		loadtiled[i] = i >= numnames;
+	}
+	startthreadpool(&r.pool,numcpus());
+	if(!loadtextures(&r,loadnames,loadtiled,n,textures))
+		return 1;
+	stopthreadpool(&r.pool);
+	for(i=0;i<n;i++)
+	{
+		if(!packtexture(&pack,&r,textures[i],loadnames[i],loadtiled[i]))
+			return 1;
+	}
+	if(!writetexpack(&pack,out))
+		return 1;
+	printf("%s: %i textures for %i bpp, %u bytes\n", out, pack.header->numtextures,
+		bpp, pack.header->filesize);
+
+	closetexpack(&pack);
+	freetextures(&r);
+	SDL_FreeSurface(r.screen);
+	SDL_Quit();
+	for(i=0;i<numfound;i++)
+		free(found[i]);
+	free(found);
+	free(textures);
+	free(loadtiled);
+	free(loadnames);
+	free(names);
+	return 0;
+}
@@ -18,6 +18,10 @@
 
 // Handles .tga file loading
 
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "tga.h"
 
 byte *getPixel ( bitmap_t *bitmap, int x, int y )
@@ -185,138 +189,202 @@ int CreateBlankBitmap ( bitmap_t *bitmap, int width, int height, int bpp )
 	return 1;
 }
 
-int loadTGA ( char *filename, bitmap_t *bitmap )
+// Fill count pixels at dest with copies of pixel, copying what has been
+// filled so far each time so that long runs take few copies
+static void fillPixels ( byte *dest, byte *pixel, int bytesperpixel, int count )
+{
+	size_t filled, size, n;
+
+	if(bytesperpixel == 1)
+	{
+		memset(dest, pixel[0], count);
+		return;
+	}
+	size = (size_t)bytesperpixel*count;
+	memcpy(dest, pixel, bytesperpixel);
+	for(filled=bytesperpixel;filled<size;filled+=n)
+	{
+		n = filled < size-filled ? filled : size-filled;
+		memcpy(dest+filled, dest, n);
+	}
+}
+
+// Swap the rows of an image stored bottom row first
+static void flipRows ( byte *image, int rowbytes, int height )
+{
+	byte *row, *top, *bottom;
+	int y;
+
+	row = (byte*)malloc(rowbytes);
+	for(y=0;y<height/2;y++)
+	{
+		top = image + (size_t)y*rowbytes;
+		bottom = image + (size_t)(height-1-y)*rowbytes;
+		memcpy(row, top, rowbytes);
+		memcpy(top, bottom, rowbytes);
+		memcpy(bottom, row, rowbytes);
+	}
+	free(row);
+}
+
+// Expand the run-length packets at data into count pixels at image.
+// Returns 0 if data ends first.
+static int decodeRLE ( byte *data, byte *end, byte *image, int bytesperpixel, int count )
+{
+	int n;
+	size_t size;
+
+	while(count)
+	{
+		if(data >= end)
+			return 0;
+		n = (*data & 127) + 1;
+		if(n > count)
+			n = count;
+		if(*data++ & 128)
+		{
+			if(end - data < bytesperpixel)
+				return 0;
+			fillPixels(image, data, bytesperpixel, n);
+			data += bytesperpixel;
+		} else
+		{
+			size = (size_t)bytesperpixel*n;
+			if((size_t)(end - data) < size)
+				return 0;
+			memcpy(image, data, size);
+			data += size;
+		}
+		image += (size_t)bytesperpixel*n;
+		count -= n;
+	}
+	return 1;
+}
+
+// Whether every pixel of a 32 bit image has an alpha of 255
+static int solidAlpha ( byte *image, int count )
 {
-	FILE *f_in = fopen(filename, "rb");
-	int idLength;
-	int colourMapType;
-	int x, y;
 	int i;
-	byte *tempbuf;
-	int type;
-	byte header;
-	byte count;
-	byte temppixel[4];
-	byte imagedescriptor;
-	int done;
 
-	if(!f_in)
+	for(i=0;i<count;i++)
 	{
-		printf("Could not open input file: %s\n", filename);
-		return 0;
+		if(image[4*i+3] != 255)
+			return 0;
 	}
+	return 1;
+}
 
-	idLength = getc(f_in);
-	colourMapType = getc(f_in);
+// Decode a whole TGA file held in memory
+int decodeTGA ( byte *data, size_t size, char *filename, bitmap_t *bitmap )
+{
+	byte *pixels, *end=data+size;
+	int type, bytesperpixel, rowbytes, y;
+	byte imagedescriptor;
 
-	if(colourMapType)
+	bitmap->image = NULL;
+	if(size < 18)
+	{
+		printf("%s is not a TGA file\n", filename);
+		return 0;
+	}
+	if(data[1])
 	{
 		printf("Program does not handle colour maps\n");
 		return 0;
 	}
 
 	// We only handle type 2 and type 10 TGA's atm
-	type = getc(f_in);
+	type = data[2];
 	if(type != 2 && type != 10)
 	{
 		printf("input file is not of type 2\n");
 		return 0;
 	}
 
-	fseek(f_in, 8, SEEK_SET);
-	bitmap->xorigin = getshort(f_in);
-	bitmap->yorigin = getshort(f_in);
-	bitmap->width = getword(f_in);
-	bitmap->height = getword(f_in);
-	bitmap->bitsperpixel = getc(f_in);
-	imagedescriptor = getc(f_in);
+	bitmap->xorigin = (short)(data[8] + data[9]*256);
+	bitmap->yorigin = (short)(data[10] + data[11]*256);
+	bitmap->width = data[12] + data[13]*256;
+	bitmap->height = data[14] + data[15]*256;
+	bitmap->bitsperpixel = data[16];
+	imagedescriptor = data[17];
+	bytesperpixel = bitmap->bitsperpixel>>3;
+	rowbytes = bitmap->width*bytesperpixel;
+	if(!bytesperpixel)
+	{
+		printf("%s has %i bits per pixel\n", filename, bitmap->bitsperpixel);
+		return 0;
+	}
 
-	if(bitmap->bitsperpixel == 24)
-		bitmap->translucent = 0;
-	else
-		bitmap->translucent = 1;
-	
-	// Seek to the start of the pixel data
-	fseek(f_in, 18+idLength, SEEK_SET);
-	
-	bitmap->image = (char*)malloc(bitmap->height*bitmap->width*(bitmap->bitsperpixel>>3));
-	tempbuf = bitmap->image;
+	// The pixel data follows the image id
+	pixels = data + 18 + data[0];
+	bitmap->image = (byte*)malloc((size_t)rowbytes*bitmap->height);
+	if(!bitmap->image)
+		return 0;
 	if(type == 2)
 	{
-		for(y=0;y<bitmap->height;y++)
+		if(pixels > end || (size_t)(end - pixels) < (size_t)rowbytes*bitmap->height)
 		{
-			if(!(32&imagedescriptor))
-				tempbuf = bitmap->image+bitmap->width*(bitmap->bitsperpixel>>3)*(bitmap->height-1-y);
-			for(x=0;x<bitmap->width;x++)
-			{
-				for(i=0;i<bitmap->bitsperpixel>>3;i++)
-					*(tempbuf++) = getc(f_in);
-				if(bitmap->bitsperpixel==32&&*(tempbuf-1)<255)
-					bitmap->translucent=1;
-			}
+			printf("%s is truncated\n", filename);
+			freeTGA(bitmap);
+			bitmap->image = NULL;
+			return 0;
+		}
+		if(32&imagedescriptor)
+			memcpy(bitmap->image, pixels, (size_t)rowbytes*bitmap->height);
+		else
+		{
+			for(y=0;y<bitmap->height;y++)
+				memcpy(bitmap->image + (size_t)rowbytes*(bitmap->height-1-y),
+					pixels + (size_t)rowbytes*y, rowbytes);
 		}
 	} else
 	{
-		done = x = y = 0;
-		while ( !done )
+		if(pixels > end || !decodeRLE(pixels, end, bitmap->image, bytesperpixel,
+				bitmap->width*bitmap->height))
 		{
-			// Read in the header packet
-			header = getc(f_in);
-			count = header & 127;
-			count++;
-
-			if(header & 128)
-			{
-				// We have a run-length
-				for(i=0;i<bitmap->bitsperpixel>>3;i++)
-					temppixel[i] = getc(f_in);
-				
-				if(bitmap->bitsperpixel==32&&temppixel[3]<255)
-					bitmap->translucent=1;
-
-				// temppixel is the pixel we want to load
-				for(;y<bitmap->height;y++)
-				{
-					if(!(32&imagedescriptor))
-						tempbuf = bitmap->image+(bitmap->width*(bitmap->height-1-y)+x)*(bitmap->bitsperpixel>>3);
-					for(;x<bitmap->width;)
-					{
-						for(i=0;i<bitmap->bitsperpixel>>3;i++)
-							*(tempbuf++) = temppixel[i];
-						x++;
-						count--;
-						if(!count)
-							goto out;
-					}
-					x=0;
-				}
-				done=1;
-			} else
-			{
-				// We have a normal set of pixels
-				for(;y<bitmap->height;y++)
-				{
-					if(!(32&imagedescriptor))
-						tempbuf = bitmap->image+(bitmap->width*(bitmap->height-1-y)+x)*(bitmap->bitsperpixel>>3);
-					for(;x<bitmap->width;)
-					{
-						for(i=0;i<bitmap->bitsperpixel>>3;i++)
-							*(tempbuf++) = getc(f_in);
-						if(bitmap->bitsperpixel==32&&*(tempbuf-1)<255)
-							bitmap->translucent=1;
-						x++;
-						count--;
-						if(!count)
-							goto out;
-					}
-					x=0;
-				}
-				done=1;
-			}
-out:;
+			printf("%s is truncated\n", filename);
+			freeTGA(bitmap);
+			bitmap->image = NULL;
+			return 0;
 		}
+		if(!(32&imagedescriptor))
+			flipRows(bitmap->image, rowbytes, bitmap->height);
 	}
-	fclose(f_in);
+
+	if(bitmap->bitsperpixel == 32)
+		bitmap->translucent = !solidAlpha(bitmap->image, bitmap->width*bitmap->height);
+	else
+		bitmap->translucent = bitmap->bitsperpixel != 24;
 	return 1;
 }
 
+// The file is mapped and decoded in one go rather than read a byte at a time
+int loadTGA ( char *filename, bitmap_t *bitmap )
+{
+	struct stat st;
+	void *data;
+	int fd, ok;
+
+	fd = open(filename, O_RDONLY);
+	if(fd < 0)
+	{
+		printf("Could not open input file: %s\n", filename);
+		return 0;
+	}
+	if(fstat(fd, &st) || st.st_size < 18)
+	{
+		printf("%s is not a TGA file\n", filename);
+		close(fd);
+		return 0;
+	}
+	data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(data == MAP_FAILED)
+	{
+		perror(filename);
+		return 0;
+	}
+	ok = decodeTGA((byte*)data, st.st_size, filename, bitmap);
+	munmap(data, st.st_size);
+	return ok;
+}
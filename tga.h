@@ -38,6 +38,7 @@ typedef struct _bitmap_t
 
 int writeTGA ( char* filename, bitmap_t *bitmap );
 int loadTGA ( char *filename, bitmap_t *bitmap );
+int decodeTGA ( byte *data, size_t size, char *filename, bitmap_t *bitmap );
 float compareAreas ( bitmap_t *area1, bitmap_t *area2, int xorigin1, int yorigin1, int xorigin2, int yorigin2, int areaWidth, int areaHeight );
 int allocTGA ( bitmap_t *bitmap );
 int freeTGA ( bitmap_t* bitmap );
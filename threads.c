@@ -0,0 +1,259 @@
+/*
+ * Copyright (C) Matthew Earl
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+/* A persistent pool of worker threads. The threads are created once and
+ * then sleep until a job is posted, so the per-frame cost is one wakeup
+ * and one join rather than a thread creation.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include "threads.h"
+
+int
+numcpus ( void )
+{
+	long n;
+
+	n = sysconf(_SC_NPROCESSORS_ONLN);
+	if(n < 1)
+		return 1;
+	if(n > MAX_THREADS)
+		return MAX_THREADS;
+	return (int)n;
+}
+
+long long
+nanotime ( void )
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC,&t);
+	return (long long)t.tv_sec*1000000000LL + t.tv_nsec;
+}
+
+static void *
+workermain ( void *arg )
+{
+	worker_t *w=(worker_t*)arg;
+	threadpool_t *p=w->pool;
+	int generation=0;
+
+	while(0<1)
+	{
+		pthread_mutex_lock(&p->lock);
+		while(!p->quit && p->generation == generation)
+			pthread_cond_wait(&p->start,&p->lock);
+		if(p->quit)
+		{
+			pthread_mutex_unlock(&p->lock);
+			break;
+		}
+		generation = p->generation;
+		pthread_mutex_unlock(&p->lock);
+
+		p->job(p->data,w->index);
+
+		pthread_mutex_lock(&p->lock);
+		if(--p->running == 0)
+			pthread_cond_signal(&p->finish);
+		pthread_mutex_unlock(&p->lock);
+	}
+	return NULL;
+}
+
+int
+startthreadpool ( threadpool_t *p, int numthreads )
+{
+	int i;
+
+	if(numthreads < 1)
+		numthreads = 1;
+	if(numthreads > MAX_THREADS)
+		numthreads = MAX_THREADS;
+
+	p->numthreads = numthreads;
+	p->generation = 0;
+	p->running = 0;
+	p->quit = 0;
+	p->job = NULL;
+	p->data = NULL;
+	pthread_mutex_init(&p->lock,NULL);
+	pthread_cond_init(&p->start,NULL);
+	pthread_cond_init(&p->finish,NULL);
+
+	p->workers = (worker_t*)malloc(sizeof(worker_t)*numthreads);
+	for(i=0;i<numthreads;i++)
+	{
+		p->workers[i].pool = p;
+		p->workers[i].index = i;
+	}
+
+	/* Worker 0 is whoever calls runthreadpool. */
+	for(i=1;i<numthreads;i++)
+	{
+		if(pthread_create(&p->workers[i].thread,NULL,workermain,&p->workers[i]))
+		{
+			fprintf(stderr,"Could not start thread %i, using %i threads\n",i,i);
+			p->numthreads = i;
+			break;
+		}
+	}
+	return 1;
+}
+
+/* Run job on every thread in the pool and wait for all of them to finish. */
+void
+runthreadpool ( threadpool_t *p, threadjob_t job, void *data )
+{
+	if(p->numthreads == 1)
+	{
+		job(data,0);
+		return;
+	}
+
+	pthread_mutex_lock(&p->lock);
+	p->job = job;
+	p->data = data;
+	p->running = p->numthreads-1;
+	p->generation++;
+	pthread_cond_broadcast(&p->start);
+	pthread_mutex_unlock(&p->lock);
+
+	job(data,0);
+
+	pthread_mutex_lock(&p->lock);
+	while(p->running)
+		pthread_cond_wait(&p->finish,&p->lock);
+	pthread_mutex_unlock(&p->lock);
+}
+
+void
+stopthreadpool ( threadpool_t *p )
+{
+	int i;
+
+	if(!p->workers)
+		return;
+
+	pthread_mutex_lock(&p->lock);
+	p->quit = 1;
+	pthread_cond_broadcast(&p->start);
+	pthread_mutex_unlock(&p->lock);
+
+	for(i=1;i<p->numthreads;i++)
+		pthread_join(p->workers[i].thread,NULL);
+
+	free(p->workers);
+	p->workers = NULL;
+	pthread_mutex_destroy(&p->lock);
+	pthread_cond_destroy(&p->start);
+	pthread_cond_destroy(&p->finish);
+}
+
+/**************************************************************/
+
+void
+initworkqueues ( workqueue_t *q, int numqueues )
+{
+	int i;
+
+	for(i=0;i<numqueues;i++)
+	{
+		pthread_spin_init(&q[i].lock,PTHREAD_PROCESS_PRIVATE);
+		q[i].head = q[i].tail = 0;
+	}
+}
+
+/* Share items 0..numitems-1 out between the queues in contiguous runs, so
+ * that when nothing is stolen each thread works on neighbouring items.
+ */
+void
+fillworkqueues ( workqueue_t *q, int numqueues, int numitems )
+{
+	int i;
+
+	for(i=0;i<numqueues;i++)
+	{
+		pthread_spin_lock(&q[i].lock);
+		q[i].head = i*numitems/numqueues;
+		q[i].tail = (i+1)*numitems/numqueues;
+		pthread_spin_unlock(&q[i].lock);
+	}
+}
+
+static int
+stealwork ( workqueue_t *q, int numqueues, int thread )
+{
+	workqueue_t *victim,*own=&q[thread];
+	int i,n,first,last;
+
+	for(i=1;i<numqueues;i++)
+	{
+		victim = &q[(thread+i)%numqueues];
+
+		pthread_spin_lock(&victim->lock);
+		n = victim->tail - victim->head;
+		if(n <= 0)
+		{
+			pthread_spin_unlock(&victim->lock);
+			continue;
+		}
+		last = victim->tail;
+		first = last - (n+1)/2;
+		victim->tail = first;
+		pthread_spin_unlock(&victim->lock);
+
+		/* Keep the first stolen item and queue the rest as our own. */
+		pthread_spin_lock(&own->lock);
+		own->head = first+1;
+		own->tail = last;
+		pthread_spin_unlock(&own->lock);
+		return first;
+	}
+	return -1;
+}
+
+/* Returns the next item for thread to work on, or -1 once every queue
+ * is empty.
+ */
+int
+nextworkitem ( workqueue_t *q, int numqueues, int thread )
+{
+	workqueue_t *own=&q[thread];
+	int item=-1;
+
+	pthread_spin_lock(&own->lock);
+	if(own->head < own->tail)
+		item = own->head++;
+	pthread_spin_unlock(&own->lock);
+
+	if(item < 0)
+		item = stealwork(q,numqueues,thread);
+	return item;
+}
+
+void
+freeworkqueues ( workqueue_t *q, int numqueues )
+{
+	int i;
+
+	for(i=0;i<numqueues;i++)
+		pthread_spin_destroy(&q[i].lock);
+}
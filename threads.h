@@ -0,0 +1,76 @@
+/*
+ * Copyright (C) Matthew Earl
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+#ifndef _THREADS_H_
+#define _THREADS_H_
+
+#include <pthread.h>
+
+#define MAX_THREADS	64
+
+/* A job is run once on every thread in the pool. thread is in the range
+ * 0..numthreads-1, thread 0 being the caller of runthreadpool.
+ */
+typedef void (*threadjob_t) ( void *data, int thread );
+
+struct threadpool_s;
+
+typedef struct worker_s
+{
+	struct threadpool_s *pool;
+	int index;
+	pthread_t thread;
+} worker_t;
+
+typedef struct threadpool_s
+{
+	int numthreads;
+	worker_t *workers;
+
+	pthread_mutex_t lock;
+	pthread_cond_t start,finish;
+	int generation;		/* incremented each time a job is posted */
+	int running;		/* workers yet to finish the current job */
+	int quit;
+
+	threadjob_t job;
+	void *data;
+} threadpool_t;
+
+/* Work-stealing queue of item indices. Each thread takes items from the
+ * head of its own queue; a thread whose queue is empty steals half of
+ * the remaining items from the tail of another thread's queue.
+ */
+typedef struct workqueue_s
+{
+	pthread_spinlock_t lock;
+	int head,tail;		/* items [head,tail) are left */
+} __attribute__((aligned(64))) workqueue_t;
+
+int numcpus ( void );
+long long nanotime ( void );
+int startthreadpool ( threadpool_t *p, int numthreads );
+void runthreadpool ( threadpool_t *p, threadjob_t job, void *data );
+void stopthreadpool ( threadpool_t *p );
+
+void initworkqueues ( workqueue_t *q, int numqueues );
+void fillworkqueues ( workqueue_t *q, int numqueues, int numitems );
+int nextworkitem ( workqueue_t *q, int numqueues, int thread );
+void freeworkqueues ( workqueue_t *q, int numqueues );
+
+#endif
@@ -24,6 +24,7 @@
 #include <string.h>
 #include "raycaster.h"
 #include "world.h"
+#include "pvs.h"
 
 entity_t *allocentity ( world_t *world )
 {
@@ -110,7 +111,19 @@ setupworld ( world_t *world )
 			e->think = NULL;
 			think(world,e);
 		}
-		
+	}
+
+	/* copy over player view pos to raycaster */
+	world->raycaster->currentplatform = world->playerentity->currentplatform;
+	vectorcopy(&world->raycaster->viewpos,&world->playerentity->pos);
+	vectorcopy(&world->raycaster->viewdir,&world->playerentity->angle);
+	world->raycaster->eyelevel = world->playerentity->vpos+VIEW_HEIGHT;
+
+	/* addsprite leaves sprites out of the platforms the view can't see */
+	for(i=0;i<world->numentities;i++)
+	{
+		e = &world->entities[i];
+
 		/* don't need to add transparent stuff to the world */
 		if(!e->texture)
 			continue;
@@ -124,15 +137,9 @@ setupworld ( world_t *world )
 		vectorsubtract( &e->pos, &dir, &verts[0]);
 		vectoradd( &e->pos, &dir, &verts[1]);
 		
-		addsprite(world->raycaster,verts,e->texture->height,e->vpos,
+		addsprite(world->raycaster,e->currentplatform,verts,e->texture->height,e->vpos,
 				SURFACE_NONE,e->texture);
 	}
-
-	/* copy over player view pos to raycaster */
-	world->raycaster->currentplatform = world->playerentity->currentplatform;
-	vectorcopy(&world->raycaster->viewpos,&world->playerentity->pos);
-	vectorcopy(&world->raycaster->viewdir,&world->playerentity->angle);
-	world->raycaster->eyelevel = world->playerentity->vpos+VIEW_HEIGHT;
 }
 
 int
@@ -222,8 +229,10 @@ monster_think ( world_t *world, entity_t *ent )
 		ent->shoottime = -1;
 		return;
 	}
-	if(!pointcanseepoint(world->raycaster,
-			&world->playerentity->pos,world->playerentity->vpos+VIEW_HEIGHT,
+	if(!platformcanseeplatform(&world->raycaster->level,
+			world->playerentity->currentplatform,ent->currentplatform) ||
+		!pointcanseepoint(world->raycaster,&world->playerentity->pos,
+			world->playerentity->currentplatform,world->playerentity->vpos+VIEW_HEIGHT,
 			&ent->pos,ent->vpos+MONSTER_MUZZLEHEIGHT))
 	{
 		ent->texture = ent->frames[MONSTERFRAME_STAND];
@@ -270,16 +279,11 @@ monster_think ( world_t *world, entity_t *ent )
 int
 spawn_monster ( world_t *world, entity_t *ent, char *strings )
 {
-	int i;
-	
 	ent->frames = (texture_t**)malloc(sizeof(texture_t*)*MONSTERFRAME_MAX);
 	ent->follow = 1;
 	
-	for(i=0;i<MONSTERFRAME_MAX;i++)
-	{
-		ent->frames[i] = texturefrompath(world->raycaster,
-				monsterframelookup[i]);
-	}
+	loadtextures(world->raycaster,monsterframelookup,NULL,MONSTERFRAME_MAX,
+			ent->frames);
 	ent->texture = ent->frames[MONSTERFRAME_STAND];
 
 	ent->think = monster_think;